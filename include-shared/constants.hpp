@@ -33,3 +33,38 @@ const CryptoPP::Integer DL_Q = CryptoPP::Integer(
 
 const int POLY_MODULUS_DEGREE = 4096;
 const int PLAINTEXT_MODULUS = 1024;
+
+// Keyword PIR: each key has CUCKOO_HASH_COUNT candidate slots, and every
+// record starts with a KEYWORD_TAG_SIZE-byte fingerprint of its key.
+const int CUCKOO_HASH_COUNT = 3;
+const int CUCKOO_MAX_KICKS = 500;
+const int KEYWORD_TAG_SIZE = 8;
+
+// Point updates are batched: a batch is published once no update has arrived
+// for UPDATE_DEBOUNCE_MS, UPDATE_MAX_DELAY_MS after its first update, or when
+// it reaches UPDATE_MAX_BATCH entries, whichever comes first.
+const int UPDATE_DEBOUNCE_MS = 50;
+const int UPDATE_MAX_DELAY_MS = 500;
+const int UPDATE_MAX_BATCH = 4096;
+
+// The cloud rewrites its Prometheus metrics file every METRICS_DUMP_INTERVAL_MS.
+const int METRICS_DUMP_INTERVAL_MS = 10000;
+
+// Trace spans each thread keeps; older spans are overwritten.
+const int TRACE_RING_EVENTS = 4096;
+
+// Database the cloud starts with, and that queries naming none go to.
+const char DEFAULT_DATABASE[] = "default";
+
+// Base version of a bulk update that applies whatever version the database
+// is at.
+const std::uint64_t UPDATE_ANY_VERSION = ~std::uint64_t(0);
+
+// The cloud writes a new database snapshot once the log of updates since the
+// last one reaches SNAPSHOT_LOG_MAX_BYTES.
+const std::size_t SNAPSHOT_LOG_MAX_BYTES = 64 << 20;
+
+// The agent keeps up to RESULT_CACHE_ENTRIES decrypted results, each served
+// for at most RESULT_CACHE_MAX_AGE_MS while the cloud's epoch is unchanged.
+const int RESULT_CACHE_ENTRIES = 1024;
+const int RESULT_CACHE_MAX_AGE_MS = 30000;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <iostream>
 #include <stdexcept>
 #include <string>
@@ -26,9 +27,26 @@ enum T {
   DHPublicValue_Message = 2,
   UserToServer_Query_Message = 3,
   ServerToUser_Response_Message = 4,
+  UserToServer_XorQuery_Message = 5,
+  ServerToUser_XorResponse_Message = 6,
+  UserToServer_Insert_Message = 7,
+  ServerToUser_InsertResult_Message = 8,
+  UserToServer_Update_Message = 9,
+  ServerToUser_UpdateResult_Message = 10,
+  UserToServer_Epoch_Message = 11,
+  ServerToUser_Epoch_Message = 12,
+};
+};
+namespace UpdateOp {
+enum T {
+  UPSERT = 0,
+  DELETE = 1,
+  REPLACE = 2,
 };
 };
 MessageType::T get_message_type(std::vector<unsigned char> &data);
+std::string message_type_name(MessageType::T type);
+seal::scheme_type get_query_scheme(std::vector<unsigned char> &data);
 
 // ================================================
 // SERIALIZABLE
@@ -73,6 +91,21 @@ struct HMACTagged_Wrapper : public Serializable {
 // KEY EXCHANGE
 // ================================================
 
+/**
+ * One state of a cloud database: a random id the cloud process picks when it
+ * starts, and the database's version. A cloud restarted without --data
+ * counts versions from zero again; the id keeps those epochs apart.
+ */
+struct CloudEpoch {
+  std::uint64_t instance = 0;
+  std::uint64_t version = 0;
+
+  bool operator==(const CloudEpoch &other) const {
+    return this->instance == other.instance && this->version == other.version;
+  }
+  bool operator!=(const CloudEpoch &other) const { return !(*this == other); }
+};
+
 struct DHPublicValue_Message : public Serializable {
   CryptoPP::SecByteBlock public_value;
 
@@ -85,16 +118,126 @@ struct DHPublicValue_Message : public Serializable {
 // ================================================
 
 struct UserToServer_Query_Message : public SerializableWithContext {
+  // Scheme the query is encrypted under; see get_query_scheme.
+  seal::scheme_type scheme = seal::scheme_type::bfv;
+  // Database to query; empty for the default one.
+  std::string database;
   seal::RelinKeys rks;
   std::vector<seal::Ciphertext> query;
+  // Bytes taken by the relinearization keys; set by serialize and deserialize.
+  std::size_t rks_size = 0;
 
   void serialize(std::vector<unsigned char> &data);
   int deserialize(std::vector<unsigned char> &data, seal::SEALContext ctx);
 };
 
 struct ServerToUser_Response_Message : public SerializableWithContext {
-  seal::Ciphertext response;
+  // Version of the snapshot the response was computed from and the cloud's
+  // instance id: the epoch the agent tags cached results with.
+  std::uint64_t version = 0;
+  std::uint64_t instance = 0;
+  // One ciphertext per plaintext the record is split into, per requested
+  // entry; or, when stride is set, the entries packed stride coefficients
+  // apart into as few ciphertexts as fit.
+  std::vector<seal::Ciphertext> response;
+  std::size_t stride = 0;
 
   void serialize(std::vector<unsigned char> &data);
   int deserialize(std::vector<unsigned char> &data, seal::SEALContext ctx);
 };
+
+struct UserToServer_XorQuery_Message : public Serializable {
+  // Database to query; empty for the default one.
+  std::string database;
+  // One share of a selection bit vector per requested entry.
+  std::vector<std::vector<unsigned char>> selections;
+
+  void serialize(std::vector<unsigned char> &data);
+  int deserialize(std::vector<unsigned char> &data);
+};
+
+struct ServerToUser_XorResponse_Message : public Serializable {
+  // Version of the snapshot the answers were computed from.
+  std::uint64_t version;
+  std::uint64_t instance = 0;
+  // XOR of the selected entries' packed coefficients, one per selection.
+  std::vector<std::vector<unsigned char>> answers;
+
+  void serialize(std::vector<unsigned char> &data);
+  int deserialize(std::vector<unsigned char> &data);
+};
+
+struct UserToServer_Insert_Message : public Serializable {
+  // Database to write; empty for the default one.
+  std::string database;
+  int index;
+  std::uint64_t value;
+
+  void serialize(std::vector<unsigned char> &data);
+  int deserialize(std::vector<unsigned char> &data);
+};
+
+struct ServerToUser_InsertResult_Message : public Serializable {
+  // False if the cloud does not accept remote inserts or rejected this one.
+  bool accepted;
+
+  void serialize(std::vector<unsigned char> &data);
+  int deserialize(std::vector<unsigned char> &data);
+};
+
+// One change in a bulk update. UPSERT writes the entry at index, DELETE
+// clears count entries from index on, and REPLACE writes consecutive entries
+// from index on. Entries are given as values for scalar databases and as
+// records for record databases.
+struct UpdateMutation {
+  UpdateOp::T op;
+  int index;
+  // Entries cleared; DELETE only.
+  int count = 0;
+  std::vector<std::uint64_t> values;
+  std::vector<std::vector<unsigned char>> records;
+};
+
+struct UserToServer_Update_Message : public Serializable {
+  // Database to write; empty for the default one.
+  std::string database;
+  // Secret the cloud's updates are authorized with.
+  std::string token;
+  // Only apply if the database is still at this version; UPDATE_ANY_VERSION
+  // to apply on top of whatever is there.
+  std::uint64_t base_version;
+  // Applied in order, and published together as one version.
+  std::vector<UpdateMutation> mutations;
+
+  void serialize(std::vector<unsigned char> &data);
+  int deserialize(std::vector<unsigned char> &data);
+};
+
+struct ServerToUser_UpdateResult_Message : public Serializable {
+  bool accepted;
+  // The version the update was published as. If it was rejected after
+  // authorization, the version the database is at.
+  std::uint64_t version;
+  // Why the update was rejected; empty if it was accepted.
+  std::string error;
+
+  void serialize(std::vector<unsigned char> &data);
+  int deserialize(std::vector<unsigned char> &data);
+};
+
+struct UserToServer_Epoch_Message : public Serializable {
+  // Database whose epoch the agent's cached results depend on; empty for
+  // the default one.
+  std::string database;
+
+  void serialize(std::vector<unsigned char> &data);
+  int deserialize(std::vector<unsigned char> &data);
+};
+
+struct ServerToUser_Epoch_Message : public Serializable {
+  // Zero version if the database does not exist.
+  CloudEpoch epoch;
+
+  void serialize(std::vector<unsigned char> &data);
+  int deserialize(std::vector<unsigned char> &data);
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+/**
+ * Bytes and messages moved under one label.
+ */
+struct TrafficCounter {
+  std::uint64_t bytes_sent = 0;
+  std::uint64_t bytes_received = 0;
+  std::uint64_t messages_sent = 0;
+  std::uint64_t messages_received = 0;
+
+  std::uint64_t bytes() const { return bytes_sent + bytes_received; }
+  void merge(const TrafficCounter &other);
+};
+
+/**
+ * Traffic counters by label, plus the number of round trips. Safe to update
+ * from several threads.
+ */
+class TrafficStats {
+public:
+  void record_send(const std::string &label, std::uint64_t bytes);
+  void record_read(const std::string &label, std::uint64_t bytes);
+  void record_round_trip();
+  void merge(const TrafficStats &other);
+  std::map<std::string, TrafficCounter> counters() const;
+  TrafficCounter get(const std::string &label) const;
+  TrafficCounter total() const;
+  std::uint64_t round_trips() const;
+  std::string summary() const;
+
+private:
+  mutable std::mutex mtx;
+  std::map<std::string, TrafficCounter> by_label;
+  std::uint64_t trips = 0;
+};
+
+// Wire traffic of every connection in this process, by phase.
+TrafficStats &process_traffic();
+// Message traffic of this process, by message type, plus AEAD overhead.
+TrafficStats &process_message_traffic();
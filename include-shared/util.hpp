@@ -54,5 +54,32 @@ std::vector<unsigned char> relinkeys_to_chvec(seal::RelinKeys rk);
 seal::RelinKeys chvec_to_relinkeys(seal::SEALContext ctx,
                                    std::vector<unsigned char> data);
 
+// Homomorphic schemes. BFV and BGV share the coefficient modulus chain and
+// encode entries the same way.
+seal::EncryptionParameters make_parameters(seal::scheme_type scheme,
+                                           std::size_t poly_modulus_degree,
+                                           std::uint64_t plain_modulus);
+std::string scheme_name(seal::scheme_type scheme);
+seal::scheme_type scheme_from_name(const std::string &name);
+
+// Records. A record is a 4-byte little-endian length followed by the bytes,
+// bit-packed into plaintext coefficients of plain_bits(t) bits each.
+const std::size_t RECORD_HEADER_SIZE = 4;
+int plain_bits(std::uint64_t t);
+std::size_t record_coeff_count(std::size_t record_size, int bits);
+std::vector<std::uint64_t> encode_record(const std::vector<unsigned char> &record,
+                                         int bits);
+std::vector<unsigned char> decode_record(const std::vector<std::uint64_t> &coeffs,
+                                         int bits);
+std::vector<unsigned char>
+decode_record(const std::vector<seal::Plaintext> &plaintexts, int bits,
+              std::size_t coeffs_per_plaintext);
+
+// Packed responses. Entry slot of a packed plaintext holds stride
+// coefficients starting at slot * stride.
+seal::Plaintext unpack_plaintext(const seal::Plaintext &packed,
+                                 std::size_t slot, std::size_t stride);
+
 //Other
-std::vector<int> read_csv_values(const std::string &filename);
\ No newline at end of file
+std::vector<int> read_csv_values(const std::string &filename);
+std::string read_secret(const std::string &filename);
\ No newline at end of file
@@ -26,6 +26,7 @@
 #include <crypto++/sha.h>
 
 #include "../../include-shared/messages.hpp"
+#include "../../include-shared/traffic.hpp"
 
 using namespace CryptoPP;
 
@@ -55,4 +56,14 @@ public:
   SecByteBlock HMAC_generate_key(const SecByteBlock &DH_shared_key);
   std::string HMAC_generate(SecByteBlock key, std::string ciphertext);
   bool HMAC_verify(SecByteBlock key, std::string ciphertext, std::string hmac);
+
+  TrafficStats &traffic();
+
+private:
+  // Plaintext bytes by message type, and what encryption and tagging added
+  // on top of them under "aead".
+  TrafficStats stats;
+
+  void account(bool sent, const std::vector<unsigned char> &plaintext,
+               std::size_t wrapped_size);
 };
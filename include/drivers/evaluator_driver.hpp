@@ -0,0 +1,87 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "seal/seal.h"
+
+#include "../../include/drivers/hypercube_driver.hpp"
+#include "../../include/drivers/hypercube_geometry.hpp"
+#include "../../include/drivers/trace_driver.hpp"
+
+// Wall-clock milliseconds spent per named phase, accumulated.
+using PhaseTimings = std::map<std::string, double>;
+
+/**
+ * Memory one evaluation worker allocates from: its own SEAL memory pool, so
+ * concurrent evaluations never contend on the global one, and the
+ * ciphertexts of its last fold, whose buffers the next fold and the next
+ * query overwrite in place.
+ */
+struct EvaluationWorkspace {
+  seal::MemoryPoolHandle pool = seal::MemoryPoolHandle::New();
+  std::vector<seal::Ciphertext> cube;
+  std::vector<seal::Ciphertext> folded;
+  seal::Ciphertext product{pool};
+  // BGV only: a fold's selectors switched down to the level of its inputs.
+  std::vector<seal::Ciphertext> selectors;
+};
+
+/**
+ * Workspaces not currently lent to an evaluation. Connections come and go,
+ * but the workspaces, and the memory their pools hold, outlive them: a
+ * lease hands its workspace back when the last reference to it goes away.
+ */
+class WorkspacePool : public std::enable_shared_from_this<WorkspacePool> {
+public:
+  std::shared_ptr<EvaluationWorkspace> acquire();
+  std::size_t alloc_byte_count();
+
+private:
+  std::mutex mtx;
+  std::vector<std::unique_ptr<EvaluationWorkspace>> idle;
+  // Pools of every workspace ever handed out, for accounting.
+  std::vector<seal::MemoryPoolHandle> pools;
+};
+
+class EvaluatorDriver {
+public:
+  EvaluatorDriver(seal::SEALContext context,
+                  std::shared_ptr<const EvaluationPlan> plan,
+                  EvaluationWorkspace *workspace = nullptr);
+  std::vector<seal::Ciphertext>
+  evaluate(const HypercubeSnapshot &snapshot,
+           const std::vector<seal::Ciphertext> &query,
+           const seal::RelinKeys &relin_keys,
+           PhaseTimings *timings = nullptr);
+  std::size_t pack(std::vector<seal::Ciphertext> &results,
+                   const RecordLayout &layout);
+  void set_trace(TraceDriver *trace, std::uint64_t query);
+
+private:
+  seal::SEALContext context;
+  seal::Evaluator evaluator;
+  std::shared_ptr<const EvaluationPlan> plan;
+  // Lent by the caller; when not given, the evaluator uses its own.
+  EvaluationWorkspace *workspace;
+  std::unique_ptr<EvaluationWorkspace> own_workspace;
+  TraceDriver *trace = nullptr;
+  std::uint64_t trace_query = 0;
+  // Span name of each fold step, "fold_dim<k>".
+  std::vector<std::uint32_t> fold_names;
+  // BGV ciphertexts are switched down the modulus chain as they are folded.
+  bool bgv;
+
+  seal::Ciphertext fold(const HypercubeSnapshot &snapshot, std::size_t part,
+                        const seal::Ciphertext *query,
+                        const seal::RelinKeys &relin_keys,
+                        PhaseTimings *timings);
+  seal::Ciphertext encrypted_zero(const seal::Ciphertext &selector);
+  std::vector<const seal::Ciphertext *>
+  fold_selectors(const seal::Ciphertext *query, const FoldStep &step,
+                 seal::parms_id_type parms_id);
+  void mod_switch_down(seal::Ciphertext &ciphertext);
+};
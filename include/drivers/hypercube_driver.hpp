@@ -1,22 +1,163 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <utility>
 #include <vector>
 
+#include "seal/seal.h"
+
 #include <crypto++/cryptlib.h>
 #include <crypto++/integer.h>
 
+#include "../../include-shared/constants.hpp"
+#include "../../include/drivers/hypercube_geometry.hpp"
+
+/**
+ * Contiguous array of values mod q, each stored in the narrowest unsigned
+ * integer type (1, 2, 4 or 8 bytes) that can hold q - 1.
+ */
+class PackedValueStore {
+public:
+  PackedValueStore() = default;
+  PackedValueStore(std::size_t size, std::uint64_t q, std::uint64_t fill);
+  std::uint64_t get(std::size_t idx) const;
+  void set(std::size_t idx, std::uint64_t x);
+  std::size_t size() const { return this->count; }
+  int width() const { return this->bytes_per_entry; }
+  const unsigned char *data() const { return this->bytes.data(); }
+  void assign(const unsigned char *src);
+
+private:
+  std::size_t count = 0;
+  int bytes_per_entry = 1;
+  std::vector<unsigned char> bytes;
+};
+
+/**
+ * How entries map onto plaintext coefficients. A scalar layout holds one
+ * value per entry as a constant polynomial. A record layout bit-packs a
+ * length-prefixed byte string of up to record_size bytes into coeffs
+ * coefficients, split across parts plaintexts.
+ */
+struct RecordLayout {
+  std::size_t record_size = 0;
+  int bits_per_coeff = 0;
+  std::size_t coeffs = 1;
+  std::size_t coeffs_per_plaintext = 1;
+  std::size_t parts = 1;
+
+  static RecordLayout scalar(std::uint64_t q);
+  static RecordLayout records(std::size_t record_size, std::uint64_t q,
+                              std::size_t poly_degree);
+};
+
+/**
+ * A run of up to HypercubeSnapshot::PAGE_ENTRIES entries: their coefficients
+ * and the plaintexts preprocessed from them. Snapshots share pages; a write
+ * copies and re-encodes only the pages it touches.
+ */
+struct SnapshotPage {
+  // page entries * layout.coeffs coefficients.
+  PackedValueStore values;
+  // page entries * layout.parts plaintexts.
+  std::vector<seal::Plaintext> plaintexts;
+  // Indices (within the page) of entries with a non-zero coefficient, in
+  // ascending order. Evaluators only visit these.
+  std::vector<std::uint16_t> occupied;
+};
+
+/**
+ * Immutable view of the database at one version. Queries hold on to a
+ * snapshot for their whole evaluation; writers never modify a published
+ * snapshot or any of its pages.
+ */
+struct HypercubeSnapshot {
+  static constexpr std::size_t PAGE_ENTRIES = 256;
+
+  std::uint64_t version;
+  std::size_t entries;
+  // Entries with a non-zero coefficient; the rest are empty.
+  std::size_t populated = 0;
+  RecordLayout layout;
+  std::vector<std::shared_ptr<const SnapshotPage>> pages;
+
+  std::size_t size() const { return this->entries; }
+  double density() const {
+    return this->entries == 0 ? 0 : (double)this->populated / this->entries;
+  }
+  std::uint64_t get(std::size_t idx) const {
+    return this->pages[idx / PAGE_ENTRIES]->values.get(
+        (idx % PAGE_ENTRIES) * this->layout.coeffs);
+  }
+  std::vector<unsigned char> record(std::size_t idx) const;
+  const seal::Plaintext &plaintext(std::size_t idx,
+                                   std::size_t part = 0) const {
+    return this->pages[idx / PAGE_ENTRIES]
+        ->plaintexts[(idx % PAGE_ENTRIES) * this->layout.parts + part];
+  }
+};
+
+// Coefficients written to each updated entry, by index.
+using EntryUpdates = std::vector<std::pair<int, std::vector<std::uint64_t>>>;
+
+// Told about every published version: the updates it applied, before they
+// are published, or nullptr after the whole database was replaced.
+using HypercubeJournal =
+    std::function<void(std::uint64_t version, const EntryUpdates *updates)>;
+
 class HypercubeDriver {
 public:
   HypercubeDriver(int d, int s, CryptoPP::Integer q);
+  HypercubeDriver(int d, int s, CryptoPP::Integer q, RecordLayout layout);
+  HypercubeDriver(std::vector<int> sides, CryptoPP::Integer q,
+                  RecordLayout layout);
   void insert(int idx, CryptoPP::Integer x);
+  void insert(int idx, std::uint64_t x);
+  void insert_many(const std::vector<std::pair<int, std::uint64_t>> &updates);
+  void insert_record(int idx, const std::vector<unsigned char> &record);
+  void insert_records(
+      const std::vector<std::pair<int, std::vector<unsigned char>>> &records);
+  std::uint64_t
+  apply(const std::vector<std::pair<int, std::vector<std::uint64_t>>> &updates,
+        std::uint64_t base_version = UPDATE_ANY_VERSION);
+  std::vector<std::uint64_t> value_coeffs(std::uint64_t x) const;
+  std::vector<std::uint64_t>
+  record_coeffs(const std::vector<unsigned char> &record) const;
+  void replace(std::shared_ptr<const PackedValueStore> values, int threads = 0);
+  void restore(std::uint64_t version,
+               const std::function<bool(std::size_t, PackedValueStore &)> &fill,
+               const EntryUpdates &updates, int threads = 0);
+  void set_journal(HypercubeJournal journal);
   CryptoPP::Integer get(int idx);
+  std::uint64_t get_value(int idx);
+  std::vector<unsigned char> get_record(int idx);
+  std::shared_ptr<const HypercubeSnapshot> snapshot();
+  std::uint64_t version();
   std::vector<int> to_coords(int idx);
   int from_coords(std::vector<int> coords);
+  const HypercubeGeometry &geometry() const { return this->geom; }
+  const RecordLayout &layout() const { return this->record_layout; }
+  std::uint64_t modulus() const { return this->q; }
 
 private:
-  std::mutex mtx;
-  int d, s;
-  CryptoPP::Integer q;
-  std::vector<CryptoPP::Integer> data;
-};
\ No newline at end of file
+  std::mutex write_mtx;
+  HypercubeGeometry geom;
+  RecordLayout record_layout;
+  std::uint64_t q;
+  std::shared_ptr<const HypercubeSnapshot> current;
+  HypercubeJournal journal;
+  // While any replace is building, every update applied, in order, so the
+  // build can re-apply those published after it started.
+  int building = 0;
+  std::vector<EntryUpdates> concurrent_updates;
+
+  void patch(std::vector<std::shared_ptr<const SnapshotPage>> &pages,
+             const EntryUpdates &updates);
+  void publish(std::vector<std::shared_ptr<const SnapshotPage>> pages);
+  void install(std::vector<std::shared_ptr<const SnapshotPage>> pages,
+               std::uint64_t version);
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Integer power, usable in constant expressions.
+ */
+constexpr std::size_t ipow(std::size_t base, int exp) {
+  std::size_t res = 1;
+  for (int i = 0; i < exp; i++)
+    res *= base;
+  return res;
+}
+
+/**
+ * Hypercube geometry fixed at compile time. Coordinate 0 is the most
+ * significant digit of the index, matching the selector layout where
+ * dimension i uses query[s * i + coords[i]]. Power-of-two side lengths
+ * reduce to shifts and masks.
+ */
+template <int D, int S> struct StaticGeometry {
+  static_assert(D > 0 && S > 0, "Hypercube must be non-empty");
+
+  static constexpr bool power_of_two = (S & (S - 1)) == 0;
+  static constexpr int shift = power_of_two ? __builtin_ctz(S) : 0;
+  static constexpr std::size_t mask = S - 1;
+  static constexpr std::size_t size = ipow(S, D);
+
+  static constexpr void to_coords(std::size_t idx, int *coords) {
+    for (int i = D - 1; i >= 0; i--) {
+      if constexpr (power_of_two) {
+        coords[i] = static_cast<int>(idx & mask);
+        idx >>= shift;
+      } else {
+        coords[i] = static_cast<int>(idx % S);
+        idx /= S;
+      }
+    }
+  }
+
+  static constexpr std::size_t from_coords(const int *coords) {
+    std::size_t idx = 0;
+    for (int i = 0; i < D; i++) {
+      if constexpr (power_of_two)
+        idx = (idx << shift) | static_cast<std::size_t>(coords[i]);
+      else
+        idx = idx * S + static_cast<std::size_t>(coords[i]);
+    }
+    return idx;
+  }
+};
+
+/**
+ * One step of the evaluation: fold away the leading remaining coordinate.
+ * Input entry (c, r) lives at c * out_count + r and is multiplied by
+ * query[selectors[c]]; the products are summed into output entry r.
+ */
+struct FoldStep {
+  int dimension;
+  std::size_t out_count;
+  std::vector<int> selectors;
+};
+
+/**
+ * Everything the evaluator needs that depends only on the geometry, built
+ * once and shared by every query.
+ */
+struct EvaluationPlan {
+  std::size_t entries;
+  std::size_t query_size;
+  std::vector<FoldStep> folds;
+};
+
+/**
+ * Runtime hypercube geometry with precomputed strides. Each dimension has
+ * its own side length; dimension i's selectors sit at query[offset(i) + c],
+ * right after those of the dimensions before it. Common uniform (d, s)
+ * shapes dispatch to a StaticGeometry specialization.
+ */
+class HypercubeGeometry {
+public:
+  HypercubeGeometry(int d, int s);
+  explicit HypercubeGeometry(std::vector<int> sides);
+  int dimension() const { return this->d; }
+  int side(int i) const { return this->sides[i]; }
+  const std::vector<int> &shape() const { return this->sides; }
+  std::size_t size() const { return this->total; }
+  std::size_t stride(int i) const { return this->strides[i]; }
+  std::size_t offset(int i) const { return this->offsets[i]; }
+  std::size_t query_size() const { return this->selectors; }
+  bool contains(long idx) const { return idx >= 0 && idx < this->total; }
+
+  void to_coords(std::size_t idx, int *coords) const;
+  std::vector<int> to_coords(std::size_t idx) const;
+  std::size_t from_coords(const int *coords) const;
+  std::size_t from_coords(const std::vector<int> &coords) const;
+
+  std::shared_ptr<const EvaluationPlan> plan() const { return this->eval_plan; }
+
+private:
+  int d;
+  std::vector<int> sides;
+  std::size_t total;
+  std::size_t selectors;
+  std::vector<std::size_t> strides;
+  std::vector<std::size_t> offsets;
+  void (*static_to_coords)(std::size_t, int *) = nullptr;
+  std::size_t (*static_from_coords)(const int *) = nullptr;
+  std::shared_ptr<const EvaluationPlan> eval_plan;
+};
+
+// Side lengths from a command line argument: "s" for an s^d cube, or one
+// length per dimension, such as "64x32x8".
+std::vector<int> parse_sides(int d, const std::string &sides);
+std::string shape_name(const std::vector<int> &sides);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../../include/drivers/hypercube_driver.hpp"
+
+// Keyword hashing, shared by the agent and the cloud.
+std::vector<unsigned char> keyword_from_id(std::uint64_t id);
+std::vector<unsigned char> keyword_from_string(const std::string &key);
+std::vector<int> keyword_candidates(const std::vector<unsigned char> &key,
+                                    std::size_t table_size);
+std::vector<unsigned char> keyword_tag_record(
+    const std::vector<unsigned char> &key,
+    const std::vector<unsigned char> &value);
+std::pair<std::vector<unsigned char>, bool>
+keyword_untag_record(const std::vector<unsigned char> &key,
+                     const std::vector<unsigned char> &record);
+
+/**
+ * Places keyed records into a hypercube with cuckoo hashing. A key lives in
+ * one of its CUCKOO_HASH_COUNT candidate slots; every record is prefixed with
+ * a fingerprint of its key so the agent can tell which candidate matched.
+ * Fingerprints cannot be turned back into keys, so a persistent database
+ * also keeps a file of its keys, from which placement is rebuilt on restore.
+ */
+class KeywordDriver {
+public:
+  KeywordDriver(std::shared_ptr<HypercubeDriver> hypercube_driver);
+  ~KeywordDriver();
+  std::size_t restore(std::string path);
+  void insert(const std::vector<unsigned char> &key,
+              const std::vector<unsigned char> &value);
+  std::pair<std::vector<unsigned char>, bool>
+  get(const std::vector<unsigned char> &key);
+  std::size_t size();
+
+private:
+  std::mutex mtx;
+  std::shared_ptr<HypercubeDriver> hypercube_driver;
+  // Key stored in each occupied slot, and the slot of each key.
+  std::unordered_map<int, std::string> slot_keys;
+  std::unordered_map<std::string, int> key_slots;
+  // Where new keys are appended, once restored.
+  std::string keys_path;
+  int keys_fd = -1;
+
+  void append_key(const std::string &key);
+};
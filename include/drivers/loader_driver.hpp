@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../../include/drivers/hypercube_driver.hpp"
+
+// Binary value files: the magic, a 4-byte width (1, 2, 4 or 8), 4 reserved
+// bytes and an 8-byte count, followed by count little-endian values of width
+// bytes each.
+const char BULK_MAGIC[8] = {'P', 'I', 'R', 'V', 'A', 'L', 'S', '1'};
+const std::size_t BULK_HEADER_SIZE = 24;
+
+void write_bulk_values(const std::string &filename,
+                       const std::vector<std::uint64_t> &values,
+                       std::uint64_t q);
+
+/**
+ * Read-only memory mapping of a whole file.
+ */
+class MappedFile {
+public:
+  MappedFile(const std::string &filename);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  const char *data() const { return this->addr; }
+  std::size_t size() const { return this->length; }
+
+private:
+  const char *addr = nullptr;
+  std::size_t length = 0;
+};
+
+/**
+ * Loads a whole scalar hypercube from a file, either the binary format above
+ * or comma/newline separated integers. Parsing and encoding run in parallel
+ * chunks into a fresh database, which is then swapped in as one snapshot.
+ */
+class LoaderDriver {
+public:
+  LoaderDriver(std::shared_ptr<HypercubeDriver> hypercube_driver,
+               int threads = 0);
+  std::size_t load(const std::string &filename);
+  std::shared_ptr<PackedValueStore> parse(const char *data, std::size_t size,
+                                          std::size_t &count);
+
+private:
+  std::shared_ptr<HypercubeDriver> hypercube_driver;
+  int threads;
+
+  void parse_binary(const char *data, std::size_t size,
+                    PackedValueStore &values, std::size_t &count);
+  void parse_csv(const char *data, std::size_t size, PackedValueStore &values,
+                 std::size_t &count);
+};
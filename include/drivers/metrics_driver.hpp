@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../include-shared/constants.hpp"
+
+// Phases of serving one connection.
+enum class ServerPhase { HANDSHAKE, DESERIALIZE, EVALUATE, RESPOND, TOTAL };
+const int SERVER_PHASE_COUNT = 5;
+std::string server_phase_name(ServerPhase phase);
+
+// Upper bounds, in milliseconds, of the latency histogram buckets. A last,
+// unbounded bucket follows.
+const std::array<double, 14> LATENCY_BUCKETS_MS = {
+    1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000};
+
+/**
+ * Latency histogram with LATENCY_BUCKETS_MS buckets, as plain values.
+ */
+struct PhaseHistogram {
+  std::array<std::uint64_t, LATENCY_BUCKETS_MS.size() + 1> counts = {};
+  double sum_ms = 0;
+
+  std::uint64_t count() const;
+  double percentile(double p) const;
+};
+
+/**
+ * Merged view of every thread's counters at one point in time. Gauges are
+ * filled in by whoever owns the state they describe.
+ */
+struct MetricsSnapshot {
+  std::uint64_t connections_opened = 0;
+  std::uint64_t connections_closed = 0;
+  std::uint64_t queries = 0;
+  std::uint64_t errors = 0;
+  double evaluation_seconds = 0;
+  // Over the interval since the previous read.
+  double queries_per_second = 0;
+  double evaluation_utilization = 0;
+  std::array<PhaseHistogram, SERVER_PHASE_COUNT> phases;
+  std::map<std::string, double> gauges;
+
+  std::uint64_t active_connections() const;
+  std::string summary() const;
+  std::string prometheus() const;
+};
+
+/**
+ * Cheap always-on server metrics. Every thread updates its own shard with
+ * relaxed atomics, so recording never contends; read() merges the shards.
+ * Exiting threads hand their shard back for the next thread to keep
+ * counting in, so there are only as many shards as threads ever ran at once.
+ */
+class MetricsDriver {
+public:
+  MetricsDriver();
+  ~MetricsDriver();
+  void connection_opened();
+  void connection_closed();
+  void query_served();
+  void error();
+  void observe(ServerPhase phase, std::chrono::steady_clock::duration elapsed);
+  MetricsSnapshot read();
+  std::size_t shard_count();
+  void start_dump(std::string filename,
+                  std::function<std::string()> render,
+                  std::chrono::milliseconds interval =
+                      std::chrono::milliseconds(METRICS_DUMP_INTERVAL_MS));
+
+  struct Shard {
+    std::atomic<std::uint64_t> connections_opened{0};
+    std::atomic<std::uint64_t> connections_closed{0};
+    std::atomic<std::uint64_t> queries{0};
+    std::atomic<std::uint64_t> errors{0};
+    std::atomic<std::uint64_t> phase_counts[SERVER_PHASE_COUNT]
+                                           [LATENCY_BUCKETS_MS.size() + 1] = {};
+    std::atomic<std::uint64_t> phase_sum_us[SERVER_PHASE_COUNT] = {};
+  };
+  struct Registry;
+
+private:
+  std::shared_ptr<Registry> registry;
+  // Guards the rate bookkeeping of read().
+  std::mutex mtx;
+  std::chrono::steady_clock::time_point last_read;
+  std::uint64_t last_queries = 0;
+  double last_evaluation_seconds = 0;
+
+  std::mutex dump_mtx;
+  std::condition_variable dump_wake;
+  bool stopping = false;
+  std::thread dumper;
+
+  Shard &local();
+  static void add(MetricsSnapshot &total, const Shard &shard);
+};
@@ -6,6 +6,7 @@
 #include <boost/system/error_code.hpp>
 
 #include "../../include-shared/messages.hpp"
+#include "../../include-shared/traffic.hpp"
 
 class NetworkDriver {
 public:
@@ -15,6 +16,8 @@ public:
   virtual void send(std::vector<unsigned char> data) = 0;
   virtual std::vector<unsigned char> read() = 0;
   virtual std::string get_remote_info() = 0;
+  virtual void set_phase(std::string phase) = 0;
+  virtual TrafficStats &traffic() = 0;
 };
 
 class NetworkDriverImpl : public NetworkDriver {
@@ -26,9 +29,15 @@ public:
   void send(std::vector<unsigned char> data);
   std::vector<unsigned char> read();
   std::string get_remote_info();
+  void set_phase(std::string phase);
+  TrafficStats &traffic();
 
 private:
   int port;
+  // Wire bytes, length prefixes included, by phase.
+  TrafficStats stats;
+  std::string phase = "unlabelled";
+  bool awaiting_reply = false;
   boost::asio::io_context io_context;
   std::shared_ptr<boost::asio::ip::tcp::socket> socket;
 };
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "../../include-shared/constants.hpp"
+#include "../../include/drivers/hypercube_driver.hpp"
+
+// Snapshot files: the magic, then 8-byte fields: version, q, entry width,
+// coefficients per entry, entries, dimension and each side length, page
+// count, and an (offset, populated entries) pair per page. Each non-empty
+// page's packed values follow at its offset, SNAPSHOT_ALIGNMENT-aligned, in
+// the in-memory layout, so they are copied straight out of the mapped file.
+// Empty pages take no space. Fields are in host byte order.
+const char SNAPSHOT_MAGIC[8] = {'P', 'I', 'R', 'S', 'N', 'A', 'P', '1'};
+const std::size_t SNAPSHOT_ALIGNMENT = 64;
+
+// Log records: 8-byte version and update count, then per update the 8-byte
+// index, coefficient count and coefficients. Each record is synced before
+// the write that logged it returns; a record cut short by a crash is cut off
+// the log on restore.
+
+/**
+ * Keeps a cloud's database on disk: a snapshot file, plus a log of every
+ * version published since it was written. On startup, the snapshot is mapped
+ * and its pages rebuilt in parallel, and the logged updates are applied on
+ * top. Once the log outgrows max_log_bytes, a background thread writes a new
+ * snapshot and starts a new log; replacing the whole database writes one
+ * right away.
+ */
+class PersistenceDriver {
+public:
+  PersistenceDriver(std::shared_ptr<HypercubeDriver> hypercube_driver,
+                    std::string path,
+                    std::size_t max_log_bytes = SNAPSHOT_LOG_MAX_BYTES,
+                    int threads = 0);
+  ~PersistenceDriver();
+  std::uint64_t restore();
+  std::uint64_t save();
+  std::size_t log_bytes();
+
+private:
+  std::shared_ptr<HypercubeDriver> hypercube_driver;
+  std::string snapshot_path;
+  std::string log_path;
+  std::size_t max_log_bytes;
+  int threads;
+
+  // Held while appending to the log and while writing a snapshot, so a
+  // snapshot and the log it truncates always agree.
+  std::mutex mtx;
+  int log_fd = -1;
+  std::size_t log_size = 0;
+  // Latest version logged, which may not be published yet.
+  std::uint64_t logged_version = 0;
+  // Set once the log could not be written; every later update is refused.
+  bool failed = false;
+
+  std::condition_variable wake;
+  bool compacting = false;
+  bool stopping = false;
+  std::thread compactor;
+
+  void open_log(bool empty);
+  void append(std::uint64_t version, const EntryUpdates *updates);
+  std::uint64_t write_snapshot();
+  void run();
+};
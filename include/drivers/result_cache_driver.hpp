@@ -0,0 +1,56 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "seal/seal.h"
+
+#include "../../include-shared/constants.hpp"
+#include "../../include-shared/messages.hpp"
+
+/**
+ * Decrypted results the agent already paid for, each tagged with the epoch
+ * (instance id and snapshot version) of the cloud that answered it. A result
+ * is served again while the cloud's current epoch, which the caller asks the
+ * cloud for, is unchanged and the result is younger than max_age; the least
+ * recently used result is evicted past capacity.
+ */
+class ResultCacheDriver {
+public:
+  ResultCacheDriver(std::size_t capacity = RESULT_CACHE_ENTRIES,
+                    std::chrono::milliseconds max_age =
+                        std::chrono::milliseconds(RESULT_CACHE_MAX_AGE_MS));
+  bool contains(int key);
+  bool lookup(int key, int cloud, const CloudEpoch &epoch,
+              std::vector<seal::Plaintext> &result);
+  void store(int key, int cloud, const CloudEpoch &epoch,
+             std::vector<seal::Plaintext> result);
+  void invalidate(int key);
+  void clear();
+  std::size_t size();
+  std::uint64_t hits();
+  std::uint64_t misses();
+
+private:
+  struct Entry {
+    int key;
+    int cloud;
+    CloudEpoch epoch;
+    std::chrono::steady_clock::time_point stored;
+    std::vector<seal::Plaintext> result;
+  };
+
+  std::size_t capacity;
+  std::chrono::milliseconds max_age;
+
+  std::mutex mtx;
+  // Most recently used first.
+  std::list<Entry> entries;
+  std::unordered_map<int, std::list<Entry>::iterator> index;
+  std::uint64_t hit_count = 0;
+  std::uint64_t miss_count = 0;
+};
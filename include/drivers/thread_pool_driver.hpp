@@ -0,0 +1,44 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads that share out loops. run() splits [0, count)
+ * into one contiguous range per thread and blocks, working on ranges itself,
+ * until all of them are done. One loop runs at a time; concurrent callers
+ * wait their turn.
+ */
+class ThreadPoolDriver {
+public:
+  explicit ThreadPoolDriver(int threads = 0);
+  ~ThreadPoolDriver();
+  void run(std::size_t count,
+           const std::function<void(std::size_t, std::size_t)> &fn);
+  int size() const { return this->workers.size() + 1; }
+
+private:
+  // Held by the caller of run() for the whole loop.
+  std::mutex run_mtx;
+  std::mutex mtx;
+  std::condition_variable wake;
+  std::condition_variable done;
+  std::vector<std::thread> workers;
+  bool stopping = false;
+
+  // The loop in progress, if any.
+  const std::function<void(std::size_t, std::size_t)> *job = nullptr;
+  std::size_t count = 0;
+  std::size_t chunks = 0;
+  std::size_t next_chunk = 0;
+  std::size_t finished = 0;
+  std::exception_ptr error;
+
+  bool run_chunk(std::unique_lock<std::mutex> &lck);
+  void work();
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../../include-shared/constants.hpp"
+
+// Span names are interned process-wide, so callers can cache the ids.
+std::uint32_t trace_name(const std::string &name);
+std::string trace_name_text(std::uint32_t id);
+
+/**
+ * One finished span, as read back from the ring buffers.
+ */
+struct TraceEvent {
+  std::string name;
+  std::uint64_t query;
+  int thread;
+  // Nanoseconds since the trace driver was created.
+  std::int64_t start_ns, end_ns;
+};
+
+/**
+ * Records timestamped spans into per-thread ring buffers. Recording takes
+ * no lock: each ring has a single writer, and readers use a per-slot
+ * sequence number to skip spans overwritten while they were copying them.
+ * Rings of exited threads are reused by new ones, so memory stays bounded
+ * by the number of concurrent threads.
+ */
+class TraceDriver {
+public:
+  using clock = std::chrono::steady_clock;
+
+  explicit TraceDriver(std::size_t ring_events = TRACE_RING_EVENTS);
+  std::uint64_t next_query();
+  void record(std::uint32_t name, std::uint64_t query, clock::time_point start,
+              clock::time_point end);
+  std::vector<TraceEvent> events(std::uint64_t query = 0);
+  std::string chrome_json(std::uint64_t query = 0);
+  void dump(const std::string &filename, std::uint64_t query = 0);
+  void set_slow_threshold(std::chrono::milliseconds threshold);
+  void finish_query(std::uint64_t query, clock::time_point start,
+                    clock::time_point end);
+
+  struct Ring;
+  struct Registry;
+
+private:
+  std::shared_ptr<Registry> registry;
+  clock::time_point epoch;
+  std::atomic<std::uint64_t> queries{0};
+  // Zero disables slow-query dumps.
+  std::atomic<std::int64_t> slow_threshold_ms{0};
+
+  Ring &local();
+};
+
+/**
+ * Records a span from construction to destruction. Does nothing without a
+ * trace driver.
+ */
+class TraceSpan {
+public:
+  TraceSpan(TraceDriver *trace, std::uint32_t name, std::uint64_t query);
+  ~TraceSpan();
+
+private:
+  TraceDriver *trace;
+  std::uint32_t name;
+  std::uint64_t query;
+  TraceDriver::clock::time_point start;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../../include-shared/constants.hpp"
+#include "../../include/drivers/hypercube_driver.hpp"
+
+/**
+ * Collects point updates and publishes them from a background thread,
+ * coalescing bursts into a single snapshot. Only the pages holding updated
+ * entries are re-encoded. Later updates to the same entry win.
+ */
+class UpdateDriver {
+public:
+  UpdateDriver(std::shared_ptr<HypercubeDriver> hypercube_driver,
+               std::chrono::milliseconds debounce =
+                   std::chrono::milliseconds(UPDATE_DEBOUNCE_MS),
+               std::chrono::milliseconds max_delay =
+                   std::chrono::milliseconds(UPDATE_MAX_DELAY_MS),
+               std::size_t max_batch = UPDATE_MAX_BATCH);
+  ~UpdateDriver();
+  void submit(int idx, std::uint64_t x);
+  void submit_record(int idx, const std::vector<unsigned char> &record);
+  void flush();
+  std::size_t pending_count();
+
+private:
+  std::shared_ptr<HypercubeDriver> hypercube_driver;
+  std::chrono::milliseconds debounce;
+  std::chrono::milliseconds max_delay;
+  std::size_t max_batch;
+
+  std::mutex mtx;
+  std::condition_variable wake;
+  std::condition_variable published;
+  std::unordered_map<int, std::vector<std::uint64_t>> pending;
+  std::chrono::steady_clock::time_point first_update;
+  std::chrono::steady_clock::time_point last_update;
+  bool publishing = false;
+  bool stopping = false;
+  int flushes = 0;
+  std::thread publisher;
+
+  void enqueue(int idx, std::vector<std::uint64_t> coeffs);
+  void run();
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <crypto++/cryptlib.h>
+
+#include "../../include/drivers/hypercube_driver.hpp"
+
+// Agent side of two-server PIR: split the selection of entry idx into two
+// random bit vectors that XOR to the indicator of idx, and recombine the two
+// servers' answers into coefficients of the given width.
+std::pair<std::vector<unsigned char>, std::vector<unsigned char>>
+xor_share_selection(std::size_t entries, std::size_t idx,
+                    CryptoPP::RandomNumberGenerator &rng);
+std::vector<std::uint64_t> xor_combine(const std::vector<unsigned char> &a,
+                                       const std::vector<unsigned char> &b,
+                                       int width);
+
+/**
+ * Server side of two-server PIR. Answers a share of a selection bit vector
+ * with the XOR of the packed coefficients of every selected entry. Two
+ * non-colluding replicas holding the same snapshot each learn nothing from
+ * their share; XOR-ing their answers yields the requested entry.
+ */
+class XorEvaluatorDriver {
+public:
+  std::vector<unsigned char>
+  evaluate(const HypercubeSnapshot &snapshot,
+           const std::vector<unsigned char> &selection);
+};
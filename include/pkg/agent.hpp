@@ -1,5 +1,8 @@
 #pragma once
 
+#include <map>
+#include <mutex>
+
 #include "seal/seal.h"
 
 #include <crypto++/cryptlib.h>
@@ -13,29 +16,141 @@
 #include "../../include-shared/messages.hpp"
 #include "../../include/drivers/cli_driver.hpp"
 #include "../../include/drivers/crypto_driver.hpp"
-#include "../../include/drivers/hypercube_driver.hpp"
+#include "../../include/drivers/hypercube_geometry.hpp"
 #include "../../include/drivers/network_driver.hpp"
+#include "../../include/drivers/result_cache_driver.hpp"
+#include "../../include/drivers/thread_pool_driver.hpp"
+
+// How the agent retrieves entries: BFV or BGV homomorphic evaluation against
+// one or more shards, or XOR secret sharing across two non-colluding replicas.
+enum class PirMode { BFV, BGV, XOR };
+
+/**
+ * Bytes one query put on the wire, by part, summed over every cloud it
+ * contacted. The parts add up to the wire total: handshake, relin_keys and
+ * selectors going up, response coming down, and the AEAD and length-prefix
+ * framing around the last two.
+ */
+struct QueryTraffic {
+  std::map<std::string, std::uint64_t> bytes;
+  std::uint64_t round_trips = 0;
+
+  std::uint64_t total() const;
+  void merge(const QueryTraffic &other);
+  std::string summary() const;
+};
+
+/**
+ * What the agent measured about its most recent query or batch.
+ */
+struct QueryReport {
+  QueryTraffic traffic;
+  // Smallest invariant noise budget, in bits, left in any response
+  // ciphertext; -1 when the query was not homomorphic.
+  int noise_budget = -1;
+  // Whether every entry was served from the result cache; only epoch probes
+  // went to the clouds.
+  bool cached = false;
+
+  std::string summary() const;
+};
 
 class AgentClient {
 public:
   AgentClient(std::string address, int port, int d, int s);
+  AgentClient(std::vector<std::pair<std::string, int>> shards, int d, int s,
+              PirMode mode = PirMode::BFV);
+  AgentClient(std::vector<std::pair<std::string, int>> shards,
+              std::vector<int> sides, PirMode mode = PirMode::BFV);
   void run();
 
   std::pair<CryptoPP::SecByteBlock, CryptoPP::SecByteBlock>
   HandleKeyExchange(std::shared_ptr<CryptoDriver> crypto_driver,
                     std::shared_ptr<NetworkDriver> network_driver);
   void HandleRetrieve(std::string input);
+  void HandleRetrieveRecord(std::string input);
+  void HandleKeywordRetrieve(std::string input);
+  void HandleTraffic(std::string input);
+  void HandleCache(std::string input);
+  void SetResultCache(std::size_t capacity,
+                      std::chrono::milliseconds max_age);
+  void SetDatabase(std::string name);
   CryptoPP::Integer DoRetrieve(std::shared_ptr<NetworkDriver> network_driver,
                                std::shared_ptr<CryptoDriver> crypto_driver,
                                int key);
-  void DoBatchRetrieve(std::shared_ptr<NetworkDriver> network_driver,
-                        std::shared_ptr<CryptoDriver> crypto_driver,std::vector<int> query);
+  std::vector<unsigned char>
+  DoRetrieveRecord(std::shared_ptr<NetworkDriver> network_driver,
+                   std::shared_ptr<CryptoDriver> crypto_driver, int key);
+  std::vector<seal::Plaintext>
+  DoQuery(std::shared_ptr<NetworkDriver> network_driver,
+          std::shared_ptr<CryptoDriver> crypto_driver, int key);
+  std::vector<std::vector<seal::Plaintext>>
+  DoBatchQuery(std::shared_ptr<NetworkDriver> network_driver,
+               std::shared_ptr<CryptoDriver> crypto_driver,
+               std::vector<int> query);
+  std::pair<std::vector<unsigned char>, bool>
+  DoKeywordRetrieve(std::shared_ptr<NetworkDriver> network_driver,
+                    std::shared_ptr<CryptoDriver> crypto_driver,
+                    std::vector<unsigned char> key);
+  bool DoInsert(std::shared_ptr<NetworkDriver> network_driver,
+                std::shared_ptr<CryptoDriver> crypto_driver, int key,
+                std::uint64_t value);
+  std::vector<std::pair<int, ServerToUser_UpdateResult_Message>>
+  DoUpdate(std::shared_ptr<NetworkDriver> network_driver,
+           std::shared_ptr<CryptoDriver> crypto_driver, std::string token,
+           const std::vector<UpdateMutation> &mutations,
+           std::uint64_t base_version = UPDATE_ANY_VERSION);
+  std::size_t size();
+  std::pair<int, int> shard_of(int key);
+  std::vector<std::vector<unsigned char>>
+  selector_plan(const std::vector<int> &query);
+  QueryReport last_query_report();
 
 private:
   std::string address;
   int port;
+  // Address and port of every shard, in index order. In XOR mode, the two
+  // replicas.
+  std::vector<std::pair<std::string, int>> shards;
+  PirMode mode;
+  // Database queried on every cloud; empty for the default one.
+  std::string database;
 
-  int dimension, sidelength;
   std::shared_ptr<CLIDriver> cli_driver;
-  std::shared_ptr<HypercubeDriver> hypercube_driver;
+  std::shared_ptr<HypercubeGeometry> geometry;
+  // Encrypts selectors and decrypts responses on every client core.
+  std::shared_ptr<ThreadPoolDriver> pool_driver;
+  // Selector plaintexts, encoded once.
+  seal::Plaintext selector_zero, selector_one;
+  // Decrypted results, served again while the cloud's epoch is unchanged.
+  std::shared_ptr<ResultCacheDriver> cache_driver;
+
+  std::mutex report_mtx;
+  QueryReport last_report;
+  void record_report(const std::vector<QueryTraffic> &traffics,
+                     int noise_budget);
+
+  int cache_cloud(int key);
+  CloudEpoch ProbeEpoch(std::pair<std::string, int> cloud);
+  bool LookupCached(const std::vector<int> &query,
+                    std::vector<std::vector<seal::Plaintext>> &results);
+  std::vector<std::vector<seal::Plaintext>>
+  DoXorBatchQuery(std::shared_ptr<NetworkDriver> network_driver,
+                  std::shared_ptr<CryptoDriver> crypto_driver,
+                  std::vector<int> query);
+  ServerToUser_XorResponse_Message
+  SendXorQuery(std::shared_ptr<NetworkDriver> network_driver,
+               std::shared_ptr<CryptoDriver> crypto_driver,
+               std::pair<std::string, int> replica,
+               UserToServer_XorQuery_Message query, QueryTraffic &traffic);
+  std::vector<seal::Ciphertext>
+  EncryptSelectors(seal::SEALContext context,
+                   const seal::PublicKey &public_key,
+                   const std::vector<unsigned char> &bits);
+  ServerToUser_Response_Message
+  SendQuery(std::shared_ptr<NetworkDriver> network_driver,
+            std::shared_ptr<CryptoDriver> crypto_driver,
+            std::pair<std::string, int> shard, seal::SEALContext context,
+            seal::RelinKeys relin_keys,
+            std::vector<seal::Ciphertext> ciphertexts, QueryTraffic &traffic);
 };
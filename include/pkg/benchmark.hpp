@@ -12,19 +12,62 @@
 
 
 #include "../../include/drivers/crypto_driver.hpp"
+#include "../../include/drivers/evaluator_driver.hpp"
 #include "../../include/drivers/hypercube_driver.hpp"
+#include "../../include/drivers/thread_pool_driver.hpp"
 
 
+/**
+ * BFV parameters to benchmark under.
+ */
+struct ParameterProfile {
+    std::string name;
+    std::size_t poly_modulus_degree;
+    std::uint64_t plain_modulus;
+
+    static ParameterProfile standard();
+    static std::vector<ParameterProfile> all();
+    static ParameterProfile find(const std::string &name);
+};
+
+/**
+ * Summary of one phase's samples, in milliseconds.
+ */
+struct PhaseSummary {
+    std::size_t count = 0;
+    double mean = 0, min = 0, max = 0, p50 = 0, p95 = 0, p99 = 0;
+};
+PhaseSummary summarize(std::vector<double> samples);
+
 class BenchmarkClient {
 public:
     BenchmarkClient(int d, int s);
+    BenchmarkClient(int d, int s, ParameterProfile profile);
+    BenchmarkClient(std::vector<int> sides, ParameterProfile profile,
+                    seal::scheme_type scheme = seal::scheme_type::bfv);
     int get(int index);
+    int get_xor(int index);
+    int get_timed(int index, PhaseTimings &timings);
+    int get_xor_timed(int index, PhaseTimings &timings);
+    std::vector<int> get_batch(std::vector<int> indices);
+    std::vector<int> get_batch_timed(std::vector<int> indices,
+                                     PhaseTimings &timings);
+    int last_noise_budget();
 
     void insert(int index, int val);
     void cube(std::vector<int>& cube);
     void cube(std::string filename);
 
 private:
-    int dimension, sidelength;
+    ParameterProfile profile;
+    // Homomorphic scheme queries are evaluated under.
+    seal::scheme_type scheme;
     std::shared_ptr<HypercubeDriver> hypercube_driver;
+    // Encrypts selectors across every core, as the agent does.
+    std::shared_ptr<ThreadPoolDriver> pool_driver;
+    // Reused by every query, as each cloud worker reuses its own.
+    std::shared_ptr<EvaluationWorkspace> workspace;
+    // Noise budget, in bits, left in the last BFV or BGV response; -1 after
+    // XOR.
+    int noise_budget = -1;
 };
\ No newline at end of file
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
 #include "seal/seal.h"
 
 #include <crypto++/cryptlib.h>
@@ -13,27 +18,123 @@
 #include "../../include-shared/messages.hpp"
 #include "../../include/drivers/cli_driver.hpp"
 #include "../../include/drivers/crypto_driver.hpp"
+#include "../../include/drivers/evaluator_driver.hpp"
 #include "../../include/drivers/hypercube_driver.hpp"
+#include "../../include/drivers/keyword_driver.hpp"
+#include "../../include/drivers/loader_driver.hpp"
+#include "../../include/drivers/metrics_driver.hpp"
 #include "../../include/drivers/network_driver.hpp"
+#include "../../include/drivers/persistence_driver.hpp"
+#include "../../include/drivers/trace_driver.hpp"
+#include "../../include/drivers/update_driver.hpp"
+#include "../../include/drivers/xor_driver.hpp"
+
+/**
+ * One named table the cloud hosts: its own geometry and record layout, and
+ * the drivers that write to it. Connection threads, SEAL contexts,
+ * evaluation workspaces, metrics and traces are shared by every table.
+ */
+struct CloudDatabase {
+  std::string name;
+  std::shared_ptr<HypercubeDriver> hypercube_driver;
+  // Only set with a data path. Declared before the update driver so it is
+  // still logging while the last updates are flushed.
+  std::shared_ptr<PersistenceDriver> persistence_driver;
+  std::shared_ptr<UpdateDriver> update_driver;
+  // Only set for keyword databases, which are never written by index.
+  std::shared_ptr<KeywordDriver> keyword_driver;
+  // Only set for scalar cubes.
+  std::shared_ptr<LoaderDriver> loader_driver;
+};
 
 class CloudClient {
 public:
-  CloudClient(int d, int s);
+  CloudClient(int d, int s, int record_size = 0,
+              bool remote_inserts = false, bool keywords = false);
+  CloudClient(std::vector<int> sides, int record_size = 0,
+              bool remote_inserts = false, bool keywords = false);
   void run(int port);
   void HandleInsert(std::string input);
+  void HandleInsertRecord(std::string input);
   void HandleGet(std::string input);
     void HandleCube(std::string input);
+  void HandleKeywordInsert(std::string input);
+  void HandleStats(std::string input);
+  void HandleTrace(std::string input);
+  void HandleSave(std::string input);
+  void HandleCreate(std::string input);
+  void HandleUse(std::string input);
+  void HandleDatabases(std::string input);
+  std::uint64_t EnablePersistence(std::string path);
+  void SetUpdateToken(std::string token);
+  void AddDatabase(std::string name, std::vector<int> sides,
+                   int record_size = 0, bool keywords = false);
+  std::shared_ptr<CloudDatabase> database(const std::string &name);
+  void SetSlowQueryThreshold(std::chrono::milliseconds threshold);
+  void StartMetricsDump(std::string filename);
+  MetricsSnapshot ReadMetrics();
 
   std::pair<CryptoPP::SecByteBlock, CryptoPP::SecByteBlock>
   HandleKeyExchange(std::shared_ptr<NetworkDriver> network_driver,
                     std::shared_ptr<CryptoDriver> crypto_driver);
   void HandleSend(std::shared_ptr<NetworkDriver> network_driver,
-                  std::shared_ptr<CryptoDriver> crypto_driver);
+                  std::shared_ptr<CryptoDriver> crypto_driver,
+                  std::chrono::steady_clock::time_point accepted =
+                      std::chrono::steady_clock::now());
 
 private:
-  int dimension, sidelength;
+  // Whether agents may insert values over the network.
+  bool remote_inserts;
+  // Random id of this process, so epochs differ across restarts.
+  std::uint64_t instance;
+  // Secret bulk updates must carry; bulk updates are refused while empty.
+  std::string update_token;
   std::shared_ptr<CLIDriver> cli_driver;
-  std::shared_ptr<HypercubeDriver> hypercube_driver;
+  std::mutex databases_mtx;
+  std::map<std::string, std::shared_ptr<CloudDatabase>> databases;
+  // Names of databases being restored, reserved until they are added.
+  std::set<std::string> pending_databases;
+  // Database the REPL's commands apply to.
+  std::string current_database;
+  // Where databases are kept, if anywhere; see EnablePersistence.
+  std::string data_path;
+  // One context per scheme, built on first use and shared by every query.
+  std::mutex contexts_mtx;
+  std::map<seal::scheme_type, std::shared_ptr<seal::SEALContext>> contexts;
+  std::shared_ptr<MetricsDriver> metrics_driver;
+  std::shared_ptr<TraceDriver> trace_driver;
+  // Evaluation workspaces, reused across connections.
+  std::shared_ptr<WorkspacePool> workspace_pool;
 
   void ListenForConnections(int port);
+  std::shared_ptr<CloudDatabase> current();
+  std::shared_ptr<CloudDatabase> BuildDatabase(std::string name,
+                                               std::vector<int> sides,
+                                               int record_size,
+                                               bool keywords);
+  std::shared_ptr<seal::SEALContext> context(seal::scheme_type scheme);
+  void persist(CloudDatabase &database, const std::string &data_path);
+  void ServeQuery(std::shared_ptr<NetworkDriver> network_driver,
+                  std::shared_ptr<CryptoDriver> crypto_driver,
+                  std::uint64_t query_id);
+  void HandleXorQuery(
+      std::shared_ptr<NetworkDriver> network_driver,
+      std::shared_ptr<CryptoDriver> crypto_driver,
+      std::pair<CryptoPP::SecByteBlock, CryptoPP::SecByteBlock> keys,
+      std::vector<unsigned char> data);
+  void HandleEpochQuery(
+      std::shared_ptr<NetworkDriver> network_driver,
+      std::shared_ptr<CryptoDriver> crypto_driver,
+      std::pair<CryptoPP::SecByteBlock, CryptoPP::SecByteBlock> keys,
+      std::vector<unsigned char> data);
+  void HandleRemoteInsert(
+      std::shared_ptr<NetworkDriver> network_driver,
+      std::shared_ptr<CryptoDriver> crypto_driver,
+      std::pair<CryptoPP::SecByteBlock, CryptoPP::SecByteBlock> keys,
+      std::vector<unsigned char> data);
+  void HandleRemoteUpdate(
+      std::shared_ptr<NetworkDriver> network_driver,
+      std::shared_ptr<CryptoDriver> crypto_driver,
+      std::pair<CryptoPP::SecByteBlock, CryptoPP::SecByteBlock> keys,
+      std::vector<unsigned char> data);
 };
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../../include/pkg/agent.hpp"
+
+/**
+ * Latency histogram in microseconds with logarithmic buckets, four per power
+ * of two. Bucket i > 0 holds [2^((i-1)/4), 2^(i/4)); bucket 0 holds
+ * everything under 1us.
+ */
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+  void record(double micros);
+  void merge(const LatencyHistogram &other);
+  std::uint64_t count() const { return this->total; }
+  double mean() const;
+  double max() const { return this->maximum; }
+  double percentile(double p) const;
+  std::size_t buckets() const { return this->counts.size(); }
+  std::uint64_t bucket_count(std::size_t i) const { return this->counts[i]; }
+  static double bucket_upper(std::size_t i);
+
+private:
+  std::vector<std::uint64_t> counts;
+  std::uint64_t total = 0;
+  double sum = 0;
+  double maximum = 0;
+};
+
+/**
+ * Distribution of keys over [0, n): uniform, or Zipf with exponent s where
+ * key 0 is the most popular.
+ */
+class KeyDistribution {
+public:
+  static KeyDistribution uniform(std::size_t n);
+  static KeyDistribution zipf(std::size_t n, double s);
+  int sample(std::mt19937_64 &rng) const;
+
+private:
+  std::size_t n = 0;
+  // Cumulative probabilities; empty for the uniform distribution.
+  std::vector<double> cdf;
+};
+
+struct LoadConfig {
+  // Open loop: arrivals at a fixed rate, latency measured from the scheduled
+  // arrival. Closed loop: each session issues its next operation as soon as
+  // the previous one finishes.
+  bool open_loop = false;
+  int sessions = 4;
+  double rate = 10;
+  double duration = 10;
+  double update_fraction = 0;
+  KeyDistribution keys = KeyDistribution::uniform(1);
+};
+
+struct LoadReport {
+  double elapsed = 0;
+  std::uint64_t errors = 0;
+  std::uint64_t rejected = 0;
+  LatencyHistogram queries;
+  LatencyHistogram updates;
+
+  void print(std::ostream &out) const;
+};
+
+/**
+ * Drives concurrent sessions against a cloud. Each operation is a full
+ * agent session: connect, key exchange, request, response.
+ */
+class LoadGenerator {
+public:
+  // Runs one operation; returns false if the cloud rejected it.
+  using Operation = std::function<bool(bool update, int key)>;
+
+  LoadGenerator(LoadConfig config, Operation operation);
+  static Operation agent_operation(std::shared_ptr<AgentClient> agent);
+  LoadReport run();
+
+private:
+  LoadConfig config;
+  Operation operation;
+};
@@ -12,6 +12,48 @@ MessageType::T get_message_type(std::vector<unsigned char> &data) {
   return (MessageType::T)data[0];
 }
 
+/**
+ * Get the scheme of a serialized UserToServer_Query_Message, which the
+ * receiver needs to build the context that deserializes it.
+ */
+seal::scheme_type get_query_scheme(std::vector<unsigned char> &data) {
+  assert(data[0] == MessageType::UserToServer_Query_Message);
+  return (seal::scheme_type)data[1];
+}
+
+/**
+ * Get message type name, for traffic accounting.
+ */
+std::string message_type_name(MessageType::T type) {
+  switch (type) {
+  case MessageType::HMACTagged_Wrapper:
+    return "HMACTagged_Wrapper";
+  case MessageType::DHPublicValue_Message:
+    return "DHPublicValue_Message";
+  case MessageType::UserToServer_Query_Message:
+    return "UserToServer_Query_Message";
+  case MessageType::ServerToUser_Response_Message:
+    return "ServerToUser_Response_Message";
+  case MessageType::UserToServer_XorQuery_Message:
+    return "UserToServer_XorQuery_Message";
+  case MessageType::ServerToUser_XorResponse_Message:
+    return "ServerToUser_XorResponse_Message";
+  case MessageType::UserToServer_Insert_Message:
+    return "UserToServer_Insert_Message";
+  case MessageType::ServerToUser_InsertResult_Message:
+    return "ServerToUser_InsertResult_Message";
+  case MessageType::UserToServer_Update_Message:
+    return "UserToServer_Update_Message";
+  case MessageType::ServerToUser_UpdateResult_Message:
+    return "ServerToUser_UpdateResult_Message";
+  case MessageType::UserToServer_Epoch_Message:
+    return "UserToServer_Epoch_Message";
+  case MessageType::ServerToUser_Epoch_Message:
+    return "ServerToUser_Epoch_Message";
+  }
+  return "Unknown_Message";
+}
+
 // ================================================
 // SERIALIZERS
 // ================================================
@@ -164,7 +206,9 @@ void UserToServer_Query_Message::serialize(std::vector<unsigned char> &data) {
   data.push_back((char)MessageType::UserToServer_Query_Message);
 
   // Add fields.
-  put_string(chvec2str(relinkeys_to_chvec(this->rks)), data);
+  data.push_back((char)this->scheme);
+  put_string(this->database, data);
+  this->rks_size = put_string(chvec2str(relinkeys_to_chvec(this->rks)), data);
 
   // Add number of ciphertexts
   int idx = data.size();
@@ -186,9 +230,12 @@ int UserToServer_Query_Message::deserialize(std::vector<unsigned char> &data,
   assert(data[0] == MessageType::UserToServer_Query_Message);
 
   // Get fields.
+  this->scheme = (seal::scheme_type)data[1];
+  int n = 2;
+  n += get_string(&this->database, data, n);
   std::string rks_str;
-  int n = 1;
-  n += get_string(&rks_str, data, n);
+  this->rks_size = get_string(&rks_str, data, n);
+  n += this->rks_size;
   this->rks = chvec_to_relinkeys(ctx, str2chvec(rks_str));
 
   // Get number of ciphertexts.
@@ -206,29 +253,418 @@ int UserToServer_Query_Message::deserialize(std::vector<unsigned char> &data,
 }
 
 /**
- * serialize UserToServer_Query_Message.
+ * serialize ServerToUser_Response_Message.
  */
 void ServerToUser_Response_Message::serialize(
     std::vector<unsigned char> &data) {
   // Add message type.
   data.push_back((char)MessageType::ServerToUser_Response_Message);
 
-  // Add fields.
-  put_string(chvec2str(ciphertext_to_chvec(this->response)), data);
+  // Add version and instance.
+  int idx = data.size();
+  data.resize(idx + 2 * sizeof(std::uint64_t));
+  std::memcpy(&data[idx], &this->version, sizeof(std::uint64_t));
+  std::memcpy(&data[idx + sizeof(std::uint64_t)], &this->instance,
+              sizeof(std::uint64_t));
+
+  // Add packing stride and number of ciphertexts
+  idx = data.size();
+  data.resize(idx + 2 * sizeof(size_t));
+  std::memcpy(&data[idx], &this->stride, sizeof(size_t));
+  size_t response_size = this->response.size();
+  std::memcpy(&data[idx + sizeof(size_t)], &response_size, sizeof(size_t));
+
+  // Put the ciphertexts in.
+  for (int i = 0; i < response_size; i++)
+    put_string(chvec2str(ciphertext_to_chvec(this->response[i])), data);
 }
 
 /**
- * deserialize UserToServer_Query_Message.
+ * deserialize ServerToUser_Response_Message.
  */
 int ServerToUser_Response_Message::deserialize(std::vector<unsigned char> &data,
                                                seal::SEALContext ctx) {
   // Check correct message type.
   assert(data[0] == MessageType::ServerToUser_Response_Message);
 
+  // Get version and instance.
+  int n = 1;
+  std::memcpy(&this->version, &data[n], sizeof(std::uint64_t));
+  n += sizeof(std::uint64_t);
+  std::memcpy(&this->instance, &data[n], sizeof(std::uint64_t));
+  n += sizeof(std::uint64_t);
+
+  // Get packing stride and number of ciphertexts.
+  std::memcpy(&this->stride, &data[n], sizeof(size_t));
+  n += sizeof(size_t);
+  size_t response_size;
+  std::memcpy(&response_size, &data[n], sizeof(size_t));
+  n += sizeof(size_t);
+
+  // Get each ciphertext.
+  for (int i = 0; i < response_size; i++) {
+    std::string response_str;
+    n += get_string(&response_str, data, n);
+    this->response.push_back(
+        chvec_to_ciphertext(ctx, str2chvec(response_str)));
+  }
+  return n;
+}
+
+/**
+ * serialize UserToServer_XorQuery_Message.
+ */
+void UserToServer_XorQuery_Message::serialize(
+    std::vector<unsigned char> &data) {
+  // Add message type.
+  data.push_back((char)MessageType::UserToServer_XorQuery_Message);
+
+  // Add database.
+  put_string(this->database, data);
+
+  // Add number of selections
+  int idx = data.size();
+  data.resize(idx + sizeof(size_t));
+  size_t selections_size = this->selections.size();
+  std::memcpy(&data[idx], &selections_size, sizeof(size_t));
+
+  // Put the selections in.
+  for (int i = 0; i < selections_size; i++)
+    put_string(chvec2str(this->selections[i]), data);
+}
+
+/**
+ * deserialize UserToServer_XorQuery_Message.
+ */
+int UserToServer_XorQuery_Message::deserialize(
+    std::vector<unsigned char> &data) {
+  // Check correct message type.
+  assert(data[0] == MessageType::UserToServer_XorQuery_Message);
+
+  // Get database.
+  int n = 1;
+  n += get_string(&this->database, data, n);
+
+  // Get number of selections.
+  size_t selections_size;
+  std::memcpy(&selections_size, &data[n], sizeof(size_t));
+  n += sizeof(size_t);
+
+  // Get each selection.
+  for (int i = 0; i < selections_size; i++) {
+    std::string selection_str;
+    n += get_string(&selection_str, data, n);
+    this->selections.push_back(str2chvec(selection_str));
+  }
+  return n;
+}
+
+/**
+ * serialize ServerToUser_XorResponse_Message.
+ */
+void ServerToUser_XorResponse_Message::serialize(
+    std::vector<unsigned char> &data) {
+  // Add message type.
+  data.push_back((char)MessageType::ServerToUser_XorResponse_Message);
+
+  // Add version and instance.
+  int idx = data.size();
+  data.resize(idx + 2 * sizeof(std::uint64_t));
+  std::memcpy(&data[idx], &this->version, sizeof(std::uint64_t));
+  std::memcpy(&data[idx + sizeof(std::uint64_t)], &this->instance,
+              sizeof(std::uint64_t));
+
+  // Add number of answers
+  idx = data.size();
+  data.resize(idx + sizeof(size_t));
+  size_t answers_size = this->answers.size();
+  std::memcpy(&data[idx], &answers_size, sizeof(size_t));
+
+  // Put the answers in.
+  for (int i = 0; i < answers_size; i++)
+    put_string(chvec2str(this->answers[i]), data);
+}
+
+/**
+ * deserialize ServerToUser_XorResponse_Message.
+ */
+int ServerToUser_XorResponse_Message::deserialize(
+    std::vector<unsigned char> &data) {
+  // Check correct message type.
+  assert(data[0] == MessageType::ServerToUser_XorResponse_Message);
+
+  // Get version and instance.
+  int n = 1;
+  std::memcpy(&this->version, &data[n], sizeof(std::uint64_t));
+  n += sizeof(std::uint64_t);
+  std::memcpy(&this->instance, &data[n], sizeof(std::uint64_t));
+  n += sizeof(std::uint64_t);
+
+  // Get number of answers.
+  size_t answers_size;
+  std::memcpy(&answers_size, &data[n], sizeof(size_t));
+  n += sizeof(size_t);
+
+  // Get each answer.
+  for (int i = 0; i < answers_size; i++) {
+    std::string answer_str;
+    n += get_string(&answer_str, data, n);
+    this->answers.push_back(str2chvec(answer_str));
+  }
+  return n;
+}
+
+/**
+ * serialize UserToServer_Insert_Message.
+ */
+void UserToServer_Insert_Message::serialize(std::vector<unsigned char> &data) {
+  // Add message type.
+  data.push_back((char)MessageType::UserToServer_Insert_Message);
+
+  // Add fields.
+  put_string(this->database, data);
+  int idx = data.size();
+  data.resize(idx + sizeof(int) + sizeof(std::uint64_t));
+  std::memcpy(&data[idx], &this->index, sizeof(int));
+  std::memcpy(&data[idx + sizeof(int)], &this->value, sizeof(std::uint64_t));
+}
+
+/**
+ * deserialize UserToServer_Insert_Message.
+ */
+int UserToServer_Insert_Message::deserialize(std::vector<unsigned char> &data) {
+  // Check correct message type.
+  assert(data[0] == MessageType::UserToServer_Insert_Message);
+
+  // Get fields.
+  int n = 1;
+  n += get_string(&this->database, data, n);
+  std::memcpy(&this->index, &data[n], sizeof(int));
+  n += sizeof(int);
+  std::memcpy(&this->value, &data[n], sizeof(std::uint64_t));
+  n += sizeof(std::uint64_t);
+  return n;
+}
+
+/**
+ * serialize ServerToUser_InsertResult_Message.
+ */
+void ServerToUser_InsertResult_Message::serialize(
+    std::vector<unsigned char> &data) {
+  // Add message type.
+  data.push_back((char)MessageType::ServerToUser_InsertResult_Message);
+
+  // Add fields.
+  put_bool(this->accepted, data);
+}
+
+/**
+ * deserialize ServerToUser_InsertResult_Message.
+ */
+int ServerToUser_InsertResult_Message::deserialize(
+    std::vector<unsigned char> &data) {
+  // Check correct message type.
+  assert(data[0] == MessageType::ServerToUser_InsertResult_Message);
+
+  // Get fields.
+  int n = 1;
+  n += get_bool(&this->accepted, data, n);
+  return n;
+}
+
+/**
+ * serialize UserToServer_Update_Message.
+ */
+void UserToServer_Update_Message::serialize(std::vector<unsigned char> &data) {
+  // Add message type.
+  data.push_back((char)MessageType::UserToServer_Update_Message);
+
+  // Add fields.
+  put_string(this->database, data);
+  put_string(this->token, data);
+  int idx = data.size();
+  data.resize(idx + sizeof(std::uint64_t) + sizeof(size_t));
+  std::memcpy(&data[idx], &this->base_version, sizeof(std::uint64_t));
+  size_t mutations_size = this->mutations.size();
+  std::memcpy(&data[idx + sizeof(std::uint64_t)], &mutations_size,
+              sizeof(size_t));
+
+  // Put each mutation in: op, index, count, then its values and records.
+  for (UpdateMutation &mutation : this->mutations) {
+    data.push_back((char)mutation.op);
+    idx = data.size();
+    size_t values_size = mutation.values.size();
+    size_t records_size = mutation.records.size();
+    data.resize(idx + 2 * sizeof(int) + 2 * sizeof(size_t) +
+                values_size * sizeof(std::uint64_t));
+    std::memcpy(&data[idx], &mutation.index, sizeof(int));
+    idx += sizeof(int);
+    std::memcpy(&data[idx], &mutation.count, sizeof(int));
+    idx += sizeof(int);
+    std::memcpy(&data[idx], &values_size, sizeof(size_t));
+    idx += sizeof(size_t);
+    if (values_size > 0)
+      std::memcpy(&data[idx], mutation.values.data(),
+                  values_size * sizeof(std::uint64_t));
+    idx += values_size * sizeof(std::uint64_t);
+    std::memcpy(&data[idx], &records_size, sizeof(size_t));
+    for (auto &record : mutation.records)
+      put_string(chvec2str(record), data);
+  }
+}
+
+/**
+ * deserialize UserToServer_Update_Message. Updates come from outside the
+ * cloud, so every length is checked against the data before it is read.
+ */
+int UserToServer_Update_Message::deserialize(std::vector<unsigned char> &data) {
+  // Check correct message type.
+  assert(data[0] == MessageType::UserToServer_Update_Message);
+
+  auto need = [&data](std::size_t n, std::size_t bytes) {
+    if (n > data.size() || bytes > data.size() - n)
+      throw std::runtime_error("Truncated update message");
+  };
+  auto checked_string = [&data, &need](std::string *s, int n) {
+    need(n, sizeof(size_t));
+    size_t str_size;
+    std::memcpy(&str_size, &data[n], sizeof(size_t));
+    need(n + sizeof(size_t), str_size);
+    return get_string(s, data, n);
+  };
+
+  // Get fields.
+  int n = 1;
+  n += checked_string(&this->database, n);
+  n += checked_string(&this->token, n);
+  need(n, sizeof(std::uint64_t) + sizeof(size_t));
+  std::memcpy(&this->base_version, &data[n], sizeof(std::uint64_t));
+  n += sizeof(std::uint64_t);
+  size_t mutations_size;
+  std::memcpy(&mutations_size, &data[n], sizeof(size_t));
+  n += sizeof(size_t);
+
+  // Get each mutation.
+  this->mutations.clear();
+  for (size_t i = 0; i < mutations_size; i++) {
+    UpdateMutation mutation;
+    need(n, 1 + 2 * sizeof(int) + sizeof(size_t));
+    if (data[n] > UpdateOp::REPLACE)
+      throw std::runtime_error("Unknown update operation");
+    mutation.op = (UpdateOp::T)data[n];
+    n += 1;
+    std::memcpy(&mutation.index, &data[n], sizeof(int));
+    n += sizeof(int);
+    std::memcpy(&mutation.count, &data[n], sizeof(int));
+    n += sizeof(int);
+    size_t values_size;
+    std::memcpy(&values_size, &data[n], sizeof(size_t));
+    n += sizeof(size_t);
+    if (values_size > (data.size() - n) / sizeof(std::uint64_t))
+      throw std::runtime_error("Truncated update message");
+    mutation.values.resize(values_size);
+    if (values_size > 0)
+      std::memcpy(mutation.values.data(), &data[n],
+                  values_size * sizeof(std::uint64_t));
+    n += values_size * sizeof(std::uint64_t);
+    need(n, sizeof(size_t));
+    size_t records_size;
+    std::memcpy(&records_size, &data[n], sizeof(size_t));
+    n += sizeof(size_t);
+    for (size_t k = 0; k < records_size; k++) {
+      std::string record_str;
+      n += checked_string(&record_str, n);
+      mutation.records.push_back(str2chvec(record_str));
+    }
+    this->mutations.push_back(std::move(mutation));
+  }
+  return n;
+}
+
+/**
+ * serialize ServerToUser_UpdateResult_Message.
+ */
+void ServerToUser_UpdateResult_Message::serialize(
+    std::vector<unsigned char> &data) {
+  // Add message type.
+  data.push_back((char)MessageType::ServerToUser_UpdateResult_Message);
+
+  // Add fields.
+  put_bool(this->accepted, data);
+  int idx = data.size();
+  data.resize(idx + sizeof(std::uint64_t));
+  std::memcpy(&data[idx], &this->version, sizeof(std::uint64_t));
+  put_string(this->error, data);
+}
+
+/**
+ * deserialize ServerToUser_UpdateResult_Message.
+ */
+int ServerToUser_UpdateResult_Message::deserialize(
+    std::vector<unsigned char> &data) {
+  // Check correct message type.
+  assert(data[0] == MessageType::ServerToUser_UpdateResult_Message);
+
+  // Get fields.
+  int n = 1;
+  n += get_bool(&this->accepted, data, n);
+  std::memcpy(&this->version, &data[n], sizeof(std::uint64_t));
+  n += sizeof(std::uint64_t);
+  n += get_string(&this->error, data, n);
+  return n;
+}
+
+/**
+ * serialize UserToServer_Epoch_Message.
+ */
+void UserToServer_Epoch_Message::serialize(std::vector<unsigned char> &data) {
+  // Add message type.
+  data.push_back((char)MessageType::UserToServer_Epoch_Message);
+
+  // Add fields.
+  put_string(this->database, data);
+}
+
+/**
+ * deserialize UserToServer_Epoch_Message.
+ */
+int UserToServer_Epoch_Message::deserialize(std::vector<unsigned char> &data) {
+  // Check correct message type.
+  assert(data[0] == MessageType::UserToServer_Epoch_Message);
+
+  // Get fields.
+  int n = 1;
+  n += get_string(&this->database, data, n);
+  return n;
+}
+
+/**
+ * serialize ServerToUser_Epoch_Message.
+ */
+void ServerToUser_Epoch_Message::serialize(std::vector<unsigned char> &data) {
+  // Add message type.
+  data.push_back((char)MessageType::ServerToUser_Epoch_Message);
+
+  // Add fields.
+  int idx = data.size();
+  data.resize(idx + 2 * sizeof(std::uint64_t));
+  std::memcpy(&data[idx], &this->epoch.instance, sizeof(std::uint64_t));
+  std::memcpy(&data[idx + sizeof(std::uint64_t)], &this->epoch.version,
+              sizeof(std::uint64_t));
+}
+
+/**
+ * deserialize ServerToUser_Epoch_Message.
+ */
+int ServerToUser_Epoch_Message::deserialize(std::vector<unsigned char> &data) {
+  // Check correct message type.
+  assert(data[0] == MessageType::ServerToUser_Epoch_Message);
+
   // Get fields.
-  std::string response_str;
   int n = 1;
-  n += get_string(&response_str, data, n);
-  this->response = chvec_to_ciphertext(ctx, str2chvec(response_str));
+  std::memcpy(&this->epoch.instance, &data[n], sizeof(std::uint64_t));
+  n += sizeof(std::uint64_t);
+  std::memcpy(&this->epoch.version, &data[n], sizeof(std::uint64_t));
+  n += sizeof(std::uint64_t);
   return n;
 }
@@ -0,0 +1,89 @@
+#include <sstream>
+
+#include "../include-shared/traffic.hpp"
+
+void TrafficCounter::merge(const TrafficCounter &other) {
+  this->bytes_sent += other.bytes_sent;
+  this->bytes_received += other.bytes_received;
+  this->messages_sent += other.messages_sent;
+  this->messages_received += other.messages_received;
+}
+
+void TrafficStats::record_send(const std::string &label, std::uint64_t bytes) {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  TrafficCounter &counter = this->by_label[label];
+  counter.bytes_sent += bytes;
+  counter.messages_sent++;
+}
+
+void TrafficStats::record_read(const std::string &label, std::uint64_t bytes) {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  TrafficCounter &counter = this->by_label[label];
+  counter.bytes_received += bytes;
+  counter.messages_received++;
+}
+
+void TrafficStats::record_round_trip() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  this->trips++;
+}
+
+/**
+ * Add another set of counters to this one.
+ */
+void TrafficStats::merge(const TrafficStats &other) {
+  std::map<std::string, TrafficCounter> counters = other.counters();
+  std::uint64_t trips = other.round_trips();
+  std::unique_lock<std::mutex> lck(this->mtx);
+  for (auto &entry : counters)
+    this->by_label[entry.first].merge(entry.second);
+  this->trips += trips;
+}
+
+std::map<std::string, TrafficCounter> TrafficStats::counters() const {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  return this->by_label;
+}
+
+TrafficCounter TrafficStats::get(const std::string &label) const {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  auto it = this->by_label.find(label);
+  return it == this->by_label.end() ? TrafficCounter() : it->second;
+}
+
+TrafficCounter TrafficStats::total() const {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  TrafficCounter total;
+  for (auto &entry : this->by_label)
+    total.merge(entry.second);
+  return total;
+}
+
+std::uint64_t TrafficStats::round_trips() const {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  return this->trips;
+}
+
+/**
+ * One line per label: bytes and messages in each direction.
+ */
+std::string TrafficStats::summary() const {
+  std::ostringstream out;
+  for (auto &entry : this->counters())
+    out << entry.first << ": sent " << entry.second.bytes_sent << " B in "
+        << entry.second.messages_sent << " msgs, received "
+        << entry.second.bytes_received << " B in "
+        << entry.second.messages_received << " msgs" << std::endl;
+  out << "round trips: " << this->round_trips();
+  return out.str();
+}
+
+TrafficStats &process_traffic() {
+  static TrafficStats stats;
+  return stats;
+}
+
+TrafficStats &process_message_traffic() {
+  static TrafficStats stats;
+  return stats;
+}
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "../include-shared/util.hpp"
 
 /**
@@ -154,6 +156,156 @@ seal::RelinKeys chvec_to_relinkeys(seal::SEALContext ctx,
   return rk;
 }
 
+/**
+ * Encryption parameters for the given scheme: SEAL's default coefficient
+ * modulus chain for the degree, which for BGV leaves room to switch down a
+ * level after each ciphertext multiplication.
+ */
+seal::EncryptionParameters make_parameters(seal::scheme_type scheme,
+                                           std::size_t poly_modulus_degree,
+                                           std::uint64_t plain_modulus) {
+  if (scheme != seal::scheme_type::bfv && scheme != seal::scheme_type::bgv)
+    throw std::runtime_error("Unsupported scheme");
+  seal::EncryptionParameters parms(scheme);
+  parms.set_poly_modulus_degree(poly_modulus_degree);
+  parms.set_coeff_modulus(seal::CoeffModulus::BFVDefault(poly_modulus_degree));
+  parms.set_plain_modulus(plain_modulus);
+  return parms;
+}
+
+/**
+ * Name of a scheme: "bfv" or "bgv".
+ */
+std::string scheme_name(seal::scheme_type scheme) {
+  return scheme == seal::scheme_type::bgv ? "bgv" : "bfv";
+}
+
+/**
+ * Scheme with the given name.
+ */
+seal::scheme_type scheme_from_name(const std::string &name) {
+  if (name == "bfv")
+    return seal::scheme_type::bfv;
+  if (name == "bgv")
+    return seal::scheme_type::bgv;
+  throw std::runtime_error("Unknown scheme " + name);
+}
+
+/**
+ * Number of bits that fit in one plaintext coefficient mod t.
+ */
+int plain_bits(std::uint64_t t) {
+  int bits = 0;
+  while ((std::uint64_t(1) << (bits + 1)) <= t && bits < 63)
+    bits++;
+  return bits;
+}
+
+/**
+ * Number of coefficients needed for a record of up to record_size bytes,
+ * including its length header.
+ */
+std::size_t record_coeff_count(std::size_t record_size, int bits) {
+  std::size_t total_bits = (RECORD_HEADER_SIZE + record_size) * 8;
+  return (total_bits + bits - 1) / bits;
+}
+
+/**
+ * Bit-pack a length-prefixed record into coefficients of the given width.
+ */
+std::vector<std::uint64_t>
+encode_record(const std::vector<unsigned char> &record, int bits) {
+  std::vector<unsigned char> framed(RECORD_HEADER_SIZE);
+  std::uint32_t length = record.size();
+  for (int i = 0; i < RECORD_HEADER_SIZE; i++)
+    framed[i] = (length >> (8 * i)) & 0xff;
+  framed.insert(framed.end(), record.begin(), record.end());
+
+  std::vector<std::uint64_t> coeffs;
+  coeffs.reserve(record_coeff_count(record.size(), bits));
+  std::uint64_t acc = 0;
+  int acc_bits = 0;
+  std::uint64_t mask = (std::uint64_t(1) << bits) - 1;
+  for (unsigned char byte : framed) {
+    acc |= std::uint64_t(byte) << acc_bits;
+    acc_bits += 8;
+    while (acc_bits >= bits) {
+      coeffs.push_back(acc & mask);
+      acc >>= bits;
+      acc_bits -= bits;
+    }
+  }
+  if (acc_bits > 0)
+    coeffs.push_back(acc & mask);
+  return coeffs;
+}
+
+/**
+ * Recover a record from its bit-packed coefficients.
+ */
+std::vector<unsigned char> decode_record(const std::vector<std::uint64_t> &coeffs,
+                                         int bits) {
+  std::vector<unsigned char> framed;
+  std::uint64_t acc = 0;
+  int acc_bits = 0;
+  std::uint64_t mask = (std::uint64_t(1) << bits) - 1;
+  for (std::uint64_t coeff : coeffs) {
+    acc |= (coeff & mask) << acc_bits;
+    acc_bits += bits;
+    while (acc_bits >= 8) {
+      framed.push_back(acc & 0xff);
+      acc >>= 8;
+      acc_bits -= 8;
+    }
+  }
+
+  if (framed.size() < RECORD_HEADER_SIZE)
+    throw std::runtime_error("Malformed record");
+  std::uint32_t length = 0;
+  for (int i = 0; i < RECORD_HEADER_SIZE; i++)
+    length |= std::uint32_t(framed[i]) << (8 * i);
+  if (length > framed.size() - RECORD_HEADER_SIZE)
+    throw std::runtime_error("Malformed record");
+  return std::vector<unsigned char>(framed.begin() + RECORD_HEADER_SIZE,
+                                    framed.begin() + RECORD_HEADER_SIZE +
+                                        length);
+}
+
+/**
+ * Recover a record from decrypted plaintexts. Plaintext i holds coefficients
+ * [i * coeffs_per_plaintext, (i + 1) * coeffs_per_plaintext) of the record.
+ */
+std::vector<unsigned char>
+decode_record(const std::vector<seal::Plaintext> &plaintexts, int bits,
+              std::size_t coeffs_per_plaintext) {
+  std::vector<std::uint64_t> coeffs;
+  coeffs.reserve(plaintexts.size() * coeffs_per_plaintext);
+  for (const seal::Plaintext &plaintext : plaintexts)
+    for (std::size_t k = 0; k < coeffs_per_plaintext; k++)
+      coeffs.push_back(k < plaintext.coeff_count() ? plaintext[k] : 0);
+  return decode_record(coeffs, bits);
+}
+
+/**
+ * Copy one entry out of a packed plaintext: the stride coefficients starting
+ * at slot * stride, with trailing zeros trimmed.
+ */
+seal::Plaintext unpack_plaintext(const seal::Plaintext &packed,
+                                 std::size_t slot, std::size_t stride) {
+  std::size_t begin = slot * stride;
+  std::size_t end = std::min(begin + stride, packed.coeff_count());
+  std::size_t used = end > begin ? end - begin : 0;
+  while (used > 0 && packed[begin + used - 1] == 0)
+    used--;
+  seal::Plaintext plaintext;
+  if (used > 0) {
+    plaintext.resize(used);
+    for (std::size_t k = 0; k < used; k++)
+      plaintext[k] = packed[begin + k];
+  }
+  return plaintext;
+}
+
 /**
  * Read CSV file
  * @param filename
@@ -182,3 +334,19 @@ std::vector<int> read_csv_values(const std::string &filename) {
 
   return values;
 }
+
+/**
+ * Read a secret kept in a file: its first line, without trailing whitespace.
+ * Throws if the file cannot be read or the secret is empty.
+ */
+std::string read_secret(const std::string &filename) {
+  std::ifstream file(filename);
+  if (!file.is_open())
+    throw std::runtime_error("Unable to open file: " + filename);
+  std::string secret;
+  std::getline(file, secret);
+  secret.erase(secret.find_last_not_of(" \t\r\n") + 1);
+  if (secret.empty())
+    throw std::runtime_error("No secret in " + filename);
+  return secret;
+}
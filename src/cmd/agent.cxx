@@ -9,24 +9,57 @@
 
 /*
  * Usage: ./pir_agent
+ * Extra <address>:<port> arguments name further shards, in index order.
+ * With --xor, the two endpoints are replicas queried with XOR shares.
+ * With --db, queries go to that named database instead of the default one.
  */
 int main(int argc, char *argv[]) {
   // Initialize logger
   initLogger();
 
   // Parse args
-  if (argc != 5) {
-    std::cout << "Usage: ./pir_agent <address> <port> <dimension> <sidelength>"
+  PirMode mode = PirMode::BFV;
+  if (argc > 1 && std::string(argv[1]) == "--xor") {
+    mode = PirMode::XOR;
+    argv++;
+    argc--;
+  } else if (argc > 1 && std::string(argv[1]) == "--bgv") {
+    mode = PirMode::BGV;
+    argv++;
+    argc--;
+  }
+  std::string database;
+  if (argc > 2 && std::string(argv[1]) == "--db") {
+    database = argv[2];
+    argv += 2;
+    argc -= 2;
+  }
+  if (argc < 5) {
+    std::cout << "Usage: ./pir_agent [--xor|--bgv] [--db <name>] <address> "
+                 "<port> <dimension> "
+                 "<sidelength>[x...] [<address>:<port> ...]"
               << std::endl;
     return 1;
   }
-  std::string address = argv[1];
-  int port = std::stoi(argv[2]);
-  int d = std::stoi(argv[3]);
-  int s = std::stoi(argv[4]);
+  std::vector<std::pair<std::string, int>> shards;
+  shards.push_back({argv[1], std::stoi(argv[2])});
+  std::vector<int> sides = parse_sides(std::stoi(argv[3]), argv[4]);
+  for (int i = 5; i < argc; i++) {
+    std::string shard = argv[i];
+    std::size_t colon = shard.rfind(':');
+    if (colon == std::string::npos) {
+      std::cout << "Invalid shard " << shard << ", expected <address>:<port>"
+                << std::endl;
+      return 1;
+    }
+    shards.push_back(
+        {shard.substr(0, colon), std::stoi(shard.substr(colon + 1))});
+  }
 
   // Create client object and run
-  AgentClient agent = AgentClient(address, port, d, s);
+  AgentClient agent = AgentClient(shards, sides, mode);
+  if (!database.empty())
+    agent.SetDatabase(database);
   agent.run();
   return 0;
 }
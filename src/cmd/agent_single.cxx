@@ -16,19 +16,18 @@ int main(int argc, char *argv[]) {
 
     // Parse args
     if (argc != 6) {
-        std::cout << "Usage: ./pir_agent <address> <port> <dimension> <sidelength>"
+        std::cout << "Usage: ./pir_agent <address> <port> <dimension> <sidelength>[x...] <key>"
                   << std::endl;
         return 1;
     }
     std::string address = argv[1];
     int port = std::stoi(argv[2]);
-    int d = std::stoi(argv[3]);
-    int s = std::stoi(argv[4]);
+    std::vector<int> sides = parse_sides(std::stoi(argv[3]), argv[4]);
 
     std::string command = "get ";
     command += argv[5];
     // Create client object and run
-    AgentClient agent = AgentClient(address, port, d, s);
+    AgentClient agent = AgentClient({{address, port}}, sides);
     agent.HandleRetrieve(command);
     //agent.run();
     return 0;
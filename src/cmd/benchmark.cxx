@@ -1,71 +1,254 @@
 //
 // Created by TJANUSZEWICZ on 09/07/2025.
 //
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <string>
 #include <chrono>
+#include <vector>
 
 #include "../../include-shared/logger.hpp"
+#include "../../include-shared/util.hpp"
 #include "../../include/drivers/hypercube_driver.hpp"
 #include "../../include/pkg/benchmark.hpp"
 
-double averageRetrievalTime(int d, int s, int iter, int idx) {
-    using clock = std::chrono::high_resolution_clock;
-    using nanoseconds = std::chrono::nanoseconds;
+namespace {
+/**
+ * One benchmarked configuration and the samples of each of its phases.
+ */
+struct BenchmarkResult {
+    std::string mode;
+    std::string profile;
+    std::vector<int> sides;
+    std::map<std::string, std::vector<double>> samples;
+    // Smallest noise budget left over all timed queries, in bits; -1 for XOR.
+    int noise_budget = -1;
+};
+
+std::string budgetText(int noise_budget) {
+    return noise_budget < 0 ? "n/a" : std::to_string(noise_budget);
+}
+
+/**
+ * The common side length, or "" if the sides differ.
+ */
+std::string sidelengthText(const std::vector<int> &sides) {
+    for (int side : sides)
+        if (side != sides[0])
+            return "";
+    return std::to_string(sides[0]);
+}
+
+/**
+ * Run warmup untimed queries, then iters timed ones, collecting per-phase
+ * samples. "total" is the wall time of the whole query.
+ */
+BenchmarkResult runBenchmark(const std::string &mode, const ParameterProfile &profile,
+                             const std::vector<int> &sides, int warmup, int iters,
+                             int idx) {
+    BenchmarkClient client = BenchmarkClient(
+        sides, profile,
+        mode == "bgv" ? seal::scheme_type::bgv : seal::scheme_type::bfv);
+    bool xor_mode = mode == "xor";
+    BenchmarkResult result = {mode, profile.name, sides, {}, -1};
 
-    BenchmarkClient client = BenchmarkClient(d,s);
-    long long totalNanoseconds = 0;
-    int result = 0;  // This variable stores the addition result
+    for (int i = 0; i < warmup; ++i) {
+        PhaseTimings ignored;
+        xor_mode ? client.get_xor_timed(idx, ignored) : client.get_timed(idx, ignored);
+    }
+    for (int i = 0; i < iters; ++i) {
+        PhaseTimings timings;
+        auto start = std::chrono::steady_clock::now();
+        xor_mode ? client.get_xor_timed(idx, timings) : client.get_timed(idx, timings);
+        timings["total"] = std::chrono::duration<double, std::milli>(
+                               std::chrono::steady_clock::now() - start).count();
+        for (auto &phase : timings)
+            result.samples[phase.first].push_back(phase.second);
+        int budget = client.last_noise_budget();
+        if (budget >= 0)
+            result.noise_budget = result.noise_budget < 0
+                                      ? budget : std::min(result.noise_budget, budget);
+    }
+    return result;
+}
+
+void writeTable(std::ostream &out, const std::vector<BenchmarkResult> &results) {
+    out << std::left << std::setw(5) << "mode" << std::setw(16) << "profile"
+        << std::setw(12) << "shape" << std::setw(16) << "phase" << std::right
+        << std::setw(12) << "mean ms" << std::setw(12) << "p50 ms"
+        << std::setw(12) << "p95 ms" << std::setw(12) << "p99 ms"
+        << std::setw(14) << "budget bits" << std::endl;
+    out << std::fixed << std::setprecision(3);
+    for (const BenchmarkResult &result : results) {
+        std::string geometry = shape_name(result.sides);
+        for (auto &phase : result.samples) {
+            PhaseSummary summary = summarize(phase.second);
+            out << std::left << std::setw(5) << result.mode << std::setw(16)
+                << result.profile << std::setw(12) << geometry << std::setw(16)
+                << phase.first << std::right << std::setw(12) << summary.mean
+                << std::setw(12) << summary.p50 << std::setw(12) << summary.p95
+                << std::setw(12) << summary.p99 << std::setw(14)
+                << budgetText(result.noise_budget) << std::endl;
+        }
+    }
+}
 
-    //std::cout << std::endl;
-    // Run the addition iter times
-    for (int i = 0; i < iter; ++i) {
-        auto start = clock::now();
-        result = client.get(idx);    // Perform the addition
-        auto end = clock::now();
+void writeCsv(std::ostream &out, const std::vector<BenchmarkResult> &results) {
+    out << "mode,profile,dimension,sidelength,shape,phase,count,mean_ms,min_ms,"
+           "max_ms,p50_ms,p95_ms,p99_ms,noise_budget_bits" << std::endl;
+    for (const BenchmarkResult &result : results)
+        for (auto &phase : result.samples) {
+            PhaseSummary summary = summarize(phase.second);
+            out << result.mode << "," << result.profile << ","
+                << result.sides.size() << "," << sidelengthText(result.sides)
+                << "," << shape_name(result.sides) << "," << phase.first << "," << summary.count << "," << summary.mean
+                << "," << summary.min << "," << summary.max << ","
+                << summary.p50 << "," << summary.p95 << "," << summary.p99
+                << "," << (result.noise_budget < 0 ? "" : budgetText(result.noise_budget))
+                << std::endl;
+        }
+}
 
-        // Calculate the duration in nanoseconds
-        auto duration = std::chrono::duration_cast<nanoseconds>(end - start).count();
-        //std::cout << duration << " ";
-        totalNanoseconds += duration;
+void writeJson(std::ostream &out, const std::vector<BenchmarkResult> &results) {
+    out << "[" << std::endl;
+    for (int i = 0; i < results.size(); i++) {
+        const BenchmarkResult &result = results[i];
+        out << "  {\"mode\": \"" << result.mode << "\", \"profile\": \""
+            << result.profile << "\", \"dimension\": " << result.sides.size()
+            << ", \"sidelength\": "
+            << (sidelengthText(result.sides).empty() ? "null"
+                                                     : sidelengthText(result.sides))
+            << ", \"shape\": \"" << shape_name(result.sides) << "\""
+            << ", \"noise_budget_bits\": "
+            << (result.noise_budget < 0 ? "null" : budgetText(result.noise_budget))
+            << ", \"phases\": {";
+        int j = 0;
+        for (auto &phase : result.samples) {
+            PhaseSummary summary = summarize(phase.second);
+            out << (j++ ? ", " : "") << std::endl
+                << "    \"" << phase.first << "\": {\"count\": " << summary.count
+                << ", \"mean_ms\": " << summary.mean << ", \"min_ms\": "
+                << summary.min << ", \"max_ms\": " << summary.max
+                << ", \"p50_ms\": " << summary.p50 << ", \"p95_ms\": "
+                << summary.p95 << ", \"p99_ms\": " << summary.p99 << "}";
+        }
+        out << std::endl << "  }}" << (i + 1 < results.size() ? "," : "") << std::endl;
     }
-    //std::cout << totalNanoseconds << std::endl;
+    out << "]" << std::endl;
+}
 
-    // Compute and return the average time per addition in nanoseconds.
-    return static_cast<double>(totalNanoseconds) / double(iter);
+void usage() {
+    std::cout << "Usage: ./pir_benchmark [--geometry <d>x<s>]... [--shape <s0>x<s1>...]..."
+                 " [--profile <name>]..."
+                 " [--mode bfv|bgv|xor|both|all] [--iters <n>] [--warmup <n>] [--index <i>]"
+                 " [--format table|json|csv] [--output <file>]" << std::endl;
+    std::cout << "Profiles:";
+    for (const ParameterProfile &profile : ParameterProfile::all())
+        std::cout << " " << profile.name;
+    std::cout << std::endl;
 }
+} // namespace
 
 /*
- * Usage: ./pir_agent_single
+ * Usage: ./pir_benchmark
  */
 int main(int argc, char *argv[]) {
     // Initialize logger
     initLogger();
 
-    /**
     // Parse args
-    if (argc != 5) {
-        std::cout << "Usage: ./pir_agent <address> <port> <dimension> <sidelength>"
-                  << std::endl;
-        return 1;
-    }
-    int d = std::stoi(argv[1]);
-    int s = std::stoi(argv[2]);
-    int iters = std::stoi(argv[3]);
-    int index = std::stoi(argv[4]);
-    **/
-
+    std::vector<std::vector<int>> geometries;
+    std::vector<ParameterProfile> profiles;
+    std::vector<std::string> modes = {"bfv"};
     int iters = 10;
+    int warmup = 2;
     int index = 0;
-
-    for (int d = 1; d < 3; d++) {
-        for (int s = 1; s < 100; s++) {
-            std::cout << "Timing for side length " << s << " and dimension "<< d << " " << averageRetrievalTime(d, s, iters, index) << std::endl;
+    std::string format = "table";
+    std::string output;
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (i + 1 >= argc) {
+                usage();
+                return 1;
+            }
+            std::string value = argv[++i];
+            if (arg == "--geometry") {
+                std::vector<std::string> parts = string_split(value, 'x');
+                if (parts.size() != 2) {
+                    usage();
+                    return 1;
+                }
+                geometries.push_back(
+                    std::vector<int>(std::stoi(parts[0]), std::stoi(parts[1])));
+            } else if (arg == "--shape") {
+                int d = std::count(value.begin(), value.end(), 'x') + 1;
+                geometries.push_back(parse_sides(d, value));
+            } else if (arg == "--profile") {
+                profiles.push_back(ParameterProfile::find(value));
+            } else if (arg == "--mode") {
+                if (value == "both")
+                    modes = {"bfv", "xor"};
+                else if (value == "all")
+                    modes = {"bfv", "bgv", "xor"};
+                else if (value == "bfv" || value == "bgv" || value == "xor")
+                    modes = {value};
+                else {
+                    usage();
+                    return 1;
+                }
+            } else if (arg == "--iters") {
+                iters = std::stoi(value);
+            } else if (arg == "--warmup") {
+                warmup = std::stoi(value);
+            } else if (arg == "--index") {
+                index = std::stoi(value);
+            } else if (arg == "--format") {
+                format = value;
+            } else if (arg == "--output") {
+                output = value;
+            } else {
+                usage();
+                return 1;
+            }
         }
+    } catch (std::exception &e) {
+        std::cout << e.what() << std::endl;
+        usage();
+        return 1;
     }
-    return 0;
-}
+    if (geometries.empty())
+        geometries = {{9}, {9, 9}};
+    if (profiles.empty())
+        profiles = {ParameterProfile::standard()};
 
+    std::vector<BenchmarkResult> results;
+    for (const std::string &mode : modes)
+        for (const ParameterProfile &profile : profiles)
+            for (const std::vector<int> &sides : geometries) {
+                // XOR PIR does no homomorphic work, so one profile is enough.
+                if (mode == "xor" && profile.name != profiles[0].name)
+                    continue;
+                std::cerr << "Running " << mode << " " << profile.name << " "
+                          << shape_name(sides) << std::endl;
+                results.push_back(runBenchmark(mode, profile, sides, warmup, iters,
+                                               index));
+            }
 
+    std::ofstream file;
+    if (!output.empty())
+        file.open(output);
+    std::ostream &out = output.empty() ? std::cout : file;
+    if (format == "json")
+        writeJson(out, results);
+    else if (format == "csv")
+        writeCsv(out, results);
+    else
+        writeTable(out, results);
+    return 0;
+}
@@ -2,29 +2,97 @@
 #include <cstdlib>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "../../include-shared/logger.hpp"
+#include "../../include-shared/util.hpp"
 #include "../../include/pkg/cloud.hpp"
 
 /*
  * Usage: ./pir_cloud
+ * Each --db hosts another named database next to the default one.
+ * --keywords, or a trailing :keywords on a --db, makes a record database a
+ * keyword database, written with kwinsert only.
+ * With --update-token-file, bulk updates carrying the token in that file are
+ * accepted (see pir_update).
  */
 int main(int argc, char *argv[]) {
   // Initialize logger
   initLogger();
 
   // Parse args
-  if (!(argc == 4)) {
-    std::cout << "Usage: ./pir_cloud <port> <dimension> <sidelength>"
+  bool remote_inserts = false;
+  bool keywords = false;
+  std::string metrics_file;
+  int slow_query_ms = 0;
+  std::string data_path;
+  std::vector<std::string> databases;
+  std::string token_file;
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--remote-inserts")
+      remote_inserts = true;
+    else if (arg == "--keywords")
+      keywords = true;
+    else if (arg == "--metrics" && i + 1 < argc)
+      metrics_file = argv[++i];
+    else if (arg == "--trace-slow" && i + 1 < argc)
+      slow_query_ms = std::stoi(argv[++i]);
+    else if (arg == "--data" && i + 1 < argc)
+      data_path = argv[++i];
+    else if (arg == "--update-token-file" && i + 1 < argc)
+      token_file = argv[++i];
+    else if (arg == "--db" && i + 1 < argc)
+      databases.push_back(argv[++i]);
+    else
+      args.push_back(arg);
+  }
+  if (!(args.size() == 3 || args.size() == 4)) {
+    std::cout << "Usage: ./pir_cloud <port> <dimension> <sidelength>[x...] "
+                 "[record_size] [--keywords] [--remote-inserts] "
+                 "[--metrics <file>] [--trace-slow <ms>] [--data <path>] "
+                 "[--db <name>:<dimension>:<sidelength>[x...]"
+                 "[:record_size[:keywords]]]... "
+                 "[--update-token-file <file>]"
               << std::endl;
     return 1;
   }
-  int port = std::stoi(argv[1]);
-  int d = std::stoi(argv[2]);
-  int s = std::stoi(argv[3]);
+  int port = std::stoi(args[0]);
+  std::vector<int> sides = parse_sides(std::stoi(args[1]), args[2]);
+  int record_size = args.size() == 4 ? std::stoi(args[3]) : 0;
 
   // Create a cloud object and run.
-  CloudClient cloud = CloudClient(d, s);
+  CloudClient cloud = CloudClient(sides, record_size, remote_inserts, keywords);
+  for (std::string &database : databases) {
+    std::vector<std::string> parts = string_split(database, ':');
+    if (parts.size() < 3 || parts.size() > 5 ||
+        (parts.size() == 5 && parts[4] != "keywords")) {
+      std::cout << "Invalid database " << database
+                << ", expected <name>:<dimension>:<sidelength>[x...]"
+                   "[:record_size[:keywords]]"
+                << std::endl;
+      return 1;
+    }
+    cloud.AddDatabase(parts[0], parse_sides(std::stoi(parts[1]), parts[2]),
+                      parts.size() >= 4 ? std::stoi(parts[3]) : 0,
+                      parts.size() == 5);
+  }
+  if (!token_file.empty()) {
+    try {
+      cloud.SetUpdateToken(read_secret(token_file));
+    } catch (std::exception &e) {
+      std::cout << e.what() << std::endl;
+      return 1;
+    }
+  }
+  if (!data_path.empty())
+    std::cout << "Restored version " << cloud.EnablePersistence(data_path)
+              << " from " << data_path << std::endl;
+  if (!metrics_file.empty())
+    cloud.StartMetricsDump(metrics_file);
+  if (slow_query_ms > 0)
+    cloud.SetSlowQueryThreshold(std::chrono::milliseconds(slow_query_ms));
   cloud.run(port);
   return 0;
 }
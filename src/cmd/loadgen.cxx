@@ -0,0 +1,98 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../../include-shared/logger.hpp"
+#include "../../include/pkg/loadgen.hpp"
+
+namespace {
+void usage() {
+  std::cout << "Usage: ./pir_loadgen [--xor|--bgv] <address> <port> <dimension> "
+               "<sidelength>[x...] [<address>:<port> ...] [--open <rate>] "
+               "[--sessions <n>] [--duration <seconds>] [--updates <fraction>] "
+               "[--zipf <exponent>]"
+            << std::endl;
+}
+} // namespace
+
+/*
+ * Usage: ./pir_loadgen
+ * Without --open, each session issues its next operation as soon as the last
+ * one finishes. Updates need the cloud started with --remote-inserts.
+ */
+int main(int argc, char *argv[]) {
+  // Initialize logger
+  initLogger();
+
+  // Parse args
+  PirMode mode = PirMode::BFV;
+  if (argc > 1 && std::string(argv[1]) == "--xor") {
+    mode = PirMode::XOR;
+    argv++;
+    argc--;
+  } else if (argc > 1 && std::string(argv[1]) == "--bgv") {
+    mode = PirMode::BGV;
+    argv++;
+    argc--;
+  }
+  if (argc < 5) {
+    usage();
+    return 1;
+  }
+  std::vector<std::pair<std::string, int>> shards;
+  LoadConfig config;
+  double zipf = 0;
+  std::vector<int> sides;
+  try {
+    shards.push_back({argv[1], std::stoi(argv[2])});
+    sides = parse_sides(std::stoi(argv[3]), argv[4]);
+    for (int i = 5; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg.rfind("--", 0) != 0) {
+        std::size_t colon = arg.rfind(':');
+        if (colon == std::string::npos) {
+          usage();
+          return 1;
+        }
+        shards.push_back(
+            {arg.substr(0, colon), std::stoi(arg.substr(colon + 1))});
+        continue;
+      }
+      if (i + 1 >= argc) {
+        usage();
+        return 1;
+      }
+      std::string value = argv[++i];
+      if (arg == "--open") {
+        config.open_loop = true;
+        config.rate = std::stod(value);
+      } else if (arg == "--sessions") {
+        config.sessions = std::stoi(value);
+      } else if (arg == "--duration") {
+        config.duration = std::stod(value);
+      } else if (arg == "--updates") {
+        config.update_fraction = std::stod(value);
+      } else if (arg == "--zipf") {
+        zipf = std::stod(value);
+      } else {
+        usage();
+        return 1;
+      }
+    }
+  } catch (std::exception &e) {
+    std::cout << e.what() << std::endl;
+    usage();
+    return 1;
+  }
+
+  auto agent = std::make_shared<AgentClient>(shards, sides, mode);
+  // Every operation should reach the cloud.
+  agent->SetResultCache(0, std::chrono::milliseconds(0));
+  config.keys = zipf > 0 ? KeyDistribution::zipf(agent->size(), zipf)
+                         : KeyDistribution::uniform(agent->size());
+  LoadGenerator generator(config, LoadGenerator::agent_operation(agent));
+  generator.run().print(std::cout);
+  return 0;
+}
@@ -0,0 +1,155 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../../include-shared/logger.hpp"
+#include "../../include-shared/util.hpp"
+#include "../../include/pkg/agent.hpp"
+
+namespace {
+void usage() {
+  std::cout << "Usage: ./pir_update [--xor] <address> <port> <dimension> "
+               "<sidelength>[x...] [<address>:<port> ...] --token-file <file> "
+               "[--db <name>] [--base <version>] < mutations"
+            << std::endl;
+  std::cout << "Mutations, one per line: upsert <index> <value> | "
+               "delete <index> [count] | replace <index> <value>... | "
+               "record <index> <text>"
+            << std::endl;
+}
+
+/**
+ * Parse one line of the mutation stream. Indices are global, as for the
+ * agent.
+ */
+UpdateMutation parse_mutation(const std::string &line) {
+  std::vector<std::string> parts = string_split(line, ' ');
+  if (parts.size() < 2)
+    throw std::runtime_error("Invalid mutation: " + line);
+  UpdateMutation mutation;
+  mutation.index = std::stoi(parts[1]);
+  if (parts[0] == "upsert" && parts.size() == 3) {
+    mutation.op = UpdateOp::UPSERT;
+    mutation.values.push_back(std::stoull(parts[2]));
+  } else if (parts[0] == "delete" && parts.size() <= 3) {
+    mutation.op = UpdateOp::DELETE;
+    mutation.count = parts.size() == 3 ? std::stoi(parts[2]) : 1;
+  } else if (parts[0] == "replace" && parts.size() > 2) {
+    mutation.op = UpdateOp::REPLACE;
+    for (int i = 2; i < parts.size(); i++)
+      mutation.values.push_back(std::stoull(parts[i]));
+  } else if (parts[0] == "record" && parts.size() > 2) {
+    // Everything after the index is the record, as for the cloud's record.
+    std::size_t offset = parts[0].size() + parts[1].size() + 2;
+    mutation.op = UpdateOp::UPSERT;
+    mutation.records.push_back(str2chvec(line.substr(offset)));
+  } else {
+    throw std::runtime_error("Invalid mutation: " + line);
+  }
+  return mutation;
+}
+} // namespace
+
+/*
+ * Usage: ./pir_update
+ * Reads mutations from stdin and sends them as one bulk update. Each cloud
+ * applies its part as a single new version and replies with that version.
+ * Clouds only accept bulk updates when started with --update-token-file.
+ * --base only applies to updates that touch a single shard.
+ */
+int main(int argc, char *argv[]) {
+  // Initialize logger
+  initLogger();
+
+  // Parse args
+  PirMode mode = PirMode::BFV;
+  if (argc > 1 && std::string(argv[1]) == "--xor") {
+    mode = PirMode::XOR;
+    argv++;
+    argc--;
+  }
+  if (argc < 5) {
+    usage();
+    return 1;
+  }
+  std::vector<std::pair<std::string, int>> shards;
+  std::vector<int> sides;
+  std::string token_file;
+  std::string database;
+  std::uint64_t base_version = UPDATE_ANY_VERSION;
+  std::vector<UpdateMutation> mutations;
+  try {
+    shards.push_back({argv[1], std::stoi(argv[2])});
+    sides = parse_sides(std::stoi(argv[3]), argv[4]);
+    for (int i = 5; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg.rfind("--", 0) != 0) {
+        std::size_t colon = arg.rfind(':');
+        if (colon == std::string::npos) {
+          usage();
+          return 1;
+        }
+        shards.push_back(
+            {arg.substr(0, colon), std::stoi(arg.substr(colon + 1))});
+        continue;
+      }
+      if (i + 1 >= argc) {
+        usage();
+        return 1;
+      }
+      std::string value = argv[++i];
+      if (arg == "--token-file") {
+        token_file = value;
+      } else if (arg == "--db") {
+        database = value;
+      } else if (arg == "--base") {
+        base_version = std::stoull(value);
+      } else {
+        usage();
+        return 1;
+      }
+    }
+    if (token_file.empty()) {
+      usage();
+      return 1;
+    }
+
+    std::string line;
+    while (std::getline(std::cin, line))
+      if (!line.empty() && line[0] != '#')
+        mutations.push_back(parse_mutation(line));
+  } catch (std::exception &e) {
+    std::cout << e.what() << std::endl;
+    usage();
+    return 1;
+  }
+
+  // Send the update and report each cloud's new version.
+  bool accepted = true;
+  try {
+    AgentClient agent = AgentClient(shards, sides, mode);
+    if (!database.empty())
+      agent.SetDatabase(database);
+    auto results = agent.DoUpdate(std::make_shared<NetworkDriverImpl>(),
+                                  std::make_shared<CryptoDriver>(),
+                                  read_secret(token_file), mutations,
+                                  base_version);
+    for (auto &result : results) {
+      std::string cloud = shards[result.first].first + ":" +
+                          std::to_string(shards[result.first].second);
+      if (result.second.accepted) {
+        std::cout << cloud << " at version " << result.second.version
+                  << std::endl;
+      } else {
+        std::cout << cloud << " rejected the update: " << result.second.error
+                  << std::endl;
+        accepted = false;
+      }
+    }
+  } catch (std::exception &e) {
+    std::cout << e.what() << std::endl;
+    return 1;
+  }
+  return accepted ? 0 : 1;
+}
@@ -45,6 +45,7 @@ CryptoDriver::encrypt_and_tag(SecByteBlock AES_key, SecByteBlock HMAC_key,
   // Serialize the HMAC and payload.
   std::vector<unsigned char> payload_data;
   msg.serialize(payload_data);
+  this->account(true, plaintext, payload_data.size());
   return payload_data;
 }
 
@@ -74,6 +75,7 @@ CryptoDriver::encrypt_and_tag(SecByteBlock AES_key, SecByteBlock HMAC_key,
   // Serialize the HMAC and payload.
   std::vector<unsigned char> payload_data;
   msg.serialize(payload_data);
+  this->account(true, plaintext, payload_data.size());
   return payload_data;
 }
 
@@ -98,9 +100,38 @@ CryptoDriver::decrypt_and_verify(SecByteBlock AES_key, SecByteBlock HMAC_key,
   std::string plaintext =
       this->AES_decrypt(AES_key, ciphertext.iv, chvec2str(ciphertext.payload));
   std::vector<unsigned char> plaintext_data = str2chvec(plaintext);
+  this->account(false, plaintext_data, ciphertext_data.size());
   return std::make_pair(plaintext_data, valid);
 }
 
+/**
+ * Message traffic through this driver.
+ */
+TrafficStats &CryptoDriver::traffic() { return this->stats; }
+
+/**
+ * Attribute a wrapped message to its type, and the wrapping to "aead", both
+ * here and in the process totals.
+ */
+void CryptoDriver::account(bool sent,
+                           const std::vector<unsigned char> &plaintext,
+                           std::size_t wrapped_size) {
+  std::string type = plaintext.empty()
+                         ? "Empty_Message"
+                         : message_type_name((MessageType::T)plaintext[0]);
+  std::size_t overhead =
+      wrapped_size > plaintext.size() ? wrapped_size - plaintext.size() : 0;
+  for (TrafficStats *stats : {&this->stats, &process_message_traffic()}) {
+    if (sent) {
+      stats->record_send(type, plaintext.size());
+      stats->record_send("aead", overhead);
+    } else {
+      stats->record_read(type, plaintext.size());
+      stats->record_read("aead", overhead);
+    }
+  }
+}
+
 /**
  * @brief Generate DH keypair.
  */
@@ -0,0 +1,307 @@
+#include <chrono>
+#include <stdexcept>
+
+#include "../../include/drivers/evaluator_driver.hpp"
+
+/**
+ * Lease an idle workspace, or a new one. The pool must be owned by a
+ * shared_ptr.
+ */
+std::shared_ptr<EvaluationWorkspace> WorkspacePool::acquire() {
+  std::unique_ptr<EvaluationWorkspace> workspace;
+  {
+    std::unique_lock<std::mutex> lck(this->mtx);
+    if (this->idle.empty()) {
+      workspace = std::make_unique<EvaluationWorkspace>();
+      this->pools.push_back(workspace->pool);
+    } else {
+      workspace = std::move(this->idle.back());
+      this->idle.pop_back();
+    }
+  }
+  std::weak_ptr<WorkspacePool> owner = this->shared_from_this();
+  return std::shared_ptr<EvaluationWorkspace>(
+      workspace.release(), [owner](EvaluationWorkspace *returned) {
+        std::unique_ptr<EvaluationWorkspace> held(returned);
+        if (std::shared_ptr<WorkspacePool> pool = owner.lock()) {
+          std::unique_lock<std::mutex> lck(pool->mtx);
+          pool->idle.push_back(std::move(held));
+        }
+      });
+}
+
+/**
+ * Bytes allocated by the pools of all workspaces.
+ */
+std::size_t WorkspacePool::alloc_byte_count() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  std::size_t bytes = 0;
+  for (seal::MemoryPoolHandle &pool : this->pools)
+    bytes += pool.alloc_byte_count();
+  return bytes;
+}
+
+/**
+ * Constructor. The plan comes from the hypercube geometry and is shared
+ * between queries. Evaluations allocate from the workspace, if given.
+ */
+EvaluatorDriver::EvaluatorDriver(seal::SEALContext context,
+                                 std::shared_ptr<const EvaluationPlan> plan,
+                                 EvaluationWorkspace *workspace)
+    : context(context), evaluator(context), plan(plan), workspace(workspace),
+      bgv(context.first_context_data()->parms().scheme() ==
+          seal::scheme_type::bgv) {
+  if (!this->workspace) {
+    this->own_workspace = std::make_unique<EvaluationWorkspace>();
+    this->workspace = this->own_workspace.get();
+  }
+}
+
+/**
+ * Record a span for every fold step of later evaluations, tagged with the
+ * given query id.
+ */
+void EvaluatorDriver::set_trace(TraceDriver *trace, std::uint64_t query) {
+  this->trace = trace;
+  this->trace_query = query;
+  this->fold_names.clear();
+  for (const FoldStep &step : this->plan->folds)
+    this->fold_names.push_back(
+        trace_name("fold_dim" + std::to_string(step.dimension)));
+}
+
+namespace {
+double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+} // namespace
+
+/**
+ * Homomorphically select entries of the snapshot. The query holds one or
+ * more selector sets back to back; for each set, returns one ciphertext per
+ * plaintext the entry is split into. If timings is given, time spent in each
+ * fold ("evaluate_dim<k>") and in relinearization ("relinearize") is added
+ * to it. Under BGV, every result is switched to the last level of the
+ * modulus chain, which only the decryptor needs, to shrink the response.
+ */
+std::vector<seal::Ciphertext>
+EvaluatorDriver::evaluate(const HypercubeSnapshot &snapshot,
+                          const std::vector<seal::Ciphertext> &query,
+                          const seal::RelinKeys &relin_keys,
+                          PhaseTimings *timings) {
+  if (query.empty() || query.size() % this->plan->query_size != 0 ||
+      snapshot.size() != this->plan->entries)
+    throw std::runtime_error("Query does not match hypercube geometry");
+
+  std::vector<seal::Ciphertext> result;
+  for (std::size_t offset = 0; offset < query.size();
+       offset += this->plan->query_size)
+    for (std::size_t part = 0; part < snapshot.layout.parts; part++)
+      result.push_back(
+          this->fold(snapshot, part, &query[offset], relin_keys, timings));
+  if (this->bgv)
+    for (seal::Ciphertext &ciphertext : result)
+      this->evaluator.mod_switch_to_inplace(
+          ciphertext, this->context.last_parms_id(), this->workspace->pool);
+  return result;
+}
+
+/**
+ * Pack a batch of single-plaintext results into as few ciphertexts as the
+ * polynomial degree allows: result i is multiplied by the monomial
+ * x^((i % per) * stride), per = degree / stride, and summed into ciphertext
+ * i / per. A monomial only moves coefficients around, so the noise does not
+ * grow. Returns the stride, the layout's coefficients per entry; returns 0
+ * and leaves the results alone when there is nothing to pack or entries
+ * span several plaintexts.
+ */
+std::size_t EvaluatorDriver::pack(std::vector<seal::Ciphertext> &results,
+                                  const RecordLayout &layout) {
+  std::size_t degree =
+      this->context.first_context_data()->parms().poly_modulus_degree();
+  std::size_t stride = layout.coeffs;
+  if (results.size() < 2 || layout.parts != 1 || stride * 2 > degree)
+    return 0;
+
+  std::size_t per = degree / stride;
+  std::vector<seal::Ciphertext> packed((results.size() + per - 1) / per);
+  seal::Ciphertext &shifted = this->workspace->product;
+  for (std::size_t i = 0; i < results.size(); i++) {
+    std::size_t offset = (i % per) * stride;
+    if (offset == 0) {
+      packed[i / per] = std::move(results[i]);
+      continue;
+    }
+    seal::Plaintext monomial;
+    monomial.resize(offset + 1);
+    monomial[offset] = 1;
+    this->evaluator.multiply_plain(results[i], monomial, shifted,
+                                   this->workspace->pool);
+    this->evaluator.add_inplace(packed[i / per], shifted);
+  }
+  results = std::move(packed);
+  return stride;
+}
+
+/**
+ * Select one part of one entry. Follows the plan's fold order: the first
+ * fold multiplies selectors by the preprocessed plaintexts of the occupied
+ * entries only, every later fold multiplies selectors into the previous
+ * fold's results. Each fold keeps an occupancy map of its outputs, so
+ * sub-cubes that fold down to nothing are skipped entirely. Each fold's
+ * outputs are written into the workspace's ciphertexts from earlier folds
+ * and queries, so steady-state evaluation allocates nothing. Under BGV, each
+ * ciphertext-ciphertext fold's outputs are switched to the next level, which
+ * drops the noise added by the multiplication along with one prime.
+ */
+seal::Ciphertext
+EvaluatorDriver::fold(const HypercubeSnapshot &snapshot, std::size_t part,
+                      const seal::Ciphertext *query,
+                      const seal::RelinKeys &relin_keys,
+                      PhaseTimings *timings) {
+  EvaluationWorkspace &workspace = *this->workspace;
+  std::vector<seal::Ciphertext> &cube = workspace.cube;
+  std::vector<seal::Ciphertext> &folded = workspace.folded;
+  seal::Ciphertext &product = workspace.product;
+  std::vector<bool> present;
+  for (std::size_t k = 0; k < this->plan->folds.size(); k++) {
+    const FoldStep &step = this->plan->folds[k];
+    auto fold_start = std::chrono::steady_clock::now();
+    double relin_ms = 0;
+    while (folded.size() < step.out_count)
+      folded.emplace_back(workspace.pool);
+    std::vector<bool> folded_present(step.out_count, false);
+    // The first product into an output lands there directly; later ones are
+    // added to it.
+    auto target = [&](std::size_t r) -> seal::Ciphertext & {
+      return folded_present[r] ? product : folded[r];
+    };
+    auto accumulate = [&](std::size_t r) {
+      if (folded_present[r])
+        this->evaluator.add_inplace(folded[r], product);
+      folded_present[r] = true;
+    };
+
+    if (step.dimension == 0) {
+      // Empty entries have no plaintext to multiply; walk each page's
+      // occupancy list instead of the whole cube.
+      for (std::size_t p = 0; p < snapshot.pages.size(); p++) {
+        const SnapshotPage &page = *snapshot.pages[p];
+        for (std::uint16_t local : page.occupied) {
+          const seal::Plaintext &plaintext =
+              page.plaintexts[local * snapshot.layout.parts + part];
+          if (plaintext.is_zero())
+            continue;
+          std::size_t in = p * HypercubeSnapshot::PAGE_ENTRIES + local;
+          std::size_t r = in % step.out_count;
+          this->evaluator.multiply_plain(
+              query[step.selectors[in / step.out_count]], plaintext,
+              target(r), workspace.pool);
+          accumulate(r);
+        }
+      }
+    } else {
+      // Every input sits at the same level; find it from any present one.
+      seal::parms_id_type level = query[0].parms_id();
+      for (std::size_t in = 0; in < present.size(); in++)
+        if (present[in]) {
+          level = cube[in].parms_id();
+          break;
+        }
+      std::vector<const seal::Ciphertext *> selectors =
+          this->fold_selectors(query, step, level);
+      for (std::size_t r = 0; r < step.out_count; r++) {
+        for (int c = 0; c < step.selectors.size(); c++) {
+          std::size_t in = c * step.out_count + r;
+          if (!present[in])
+            continue;
+          this->evaluator.multiply(cube[in], *selectors[c], target(r),
+                                   workspace.pool);
+          accumulate(r);
+        }
+        // Relinearize once per output instead of once per product.
+        if (folded_present[r]) {
+          auto relin_start = std::chrono::steady_clock::now();
+          this->evaluator.relinearize_inplace(folded[r], relin_keys,
+                                              workspace.pool);
+          if (timings)
+            relin_ms += elapsed_ms(relin_start);
+          this->mod_switch_down(folded[r]);
+        }
+      }
+    }
+    if (timings) {
+      (*timings)["evaluate_dim" + std::to_string(step.dimension)] +=
+          elapsed_ms(fold_start) - relin_ms;
+      (*timings)["relinearize"] += relin_ms;
+    }
+    if (this->trace)
+      this->trace->record(this->fold_names[k], this->trace_query, fold_start,
+                          std::chrono::steady_clock::now());
+    // This fold's outputs feed the next; the old inputs become its outputs.
+    std::swap(cube, folded);
+    present = std::move(folded_present);
+  }
+
+  if (!present[0])
+    return this->encrypted_zero(query[0]);
+  return cube[0];
+}
+
+/**
+ * The selectors of a ciphertext-ciphertext fold, at the level of its inputs.
+ * BFV selectors, and BGV selectors already at that level, are used as they
+ * are; others are switched down into the workspace, once per fold.
+ */
+std::vector<const seal::Ciphertext *>
+EvaluatorDriver::fold_selectors(const seal::Ciphertext *query,
+                                const FoldStep &step,
+                                seal::parms_id_type parms_id) {
+  std::vector<seal::Ciphertext> &switched = this->workspace->selectors;
+  while (switched.size() < step.selectors.size())
+    switched.emplace_back(this->workspace->pool);
+  std::vector<const seal::Ciphertext *> selectors;
+  for (std::size_t c = 0; c < step.selectors.size(); c++) {
+    const seal::Ciphertext &original = query[step.selectors[c]];
+    if (!this->bgv || original.parms_id() == parms_id) {
+      selectors.push_back(&original);
+      continue;
+    }
+    this->evaluator.mod_switch_to(original, parms_id, switched[c],
+                                  this->workspace->pool);
+    selectors.push_back(&switched[c]);
+  }
+  return selectors;
+}
+
+/**
+ * Under BGV, switch a ciphertext to the next level of the modulus chain, if
+ * there is one.
+ */
+void EvaluatorDriver::mod_switch_down(seal::Ciphertext &ciphertext) {
+  if (!this->bgv ||
+      !this->context.get_context_data(ciphertext.parms_id())
+           ->next_context_data())
+    return;
+  this->evaluator.mod_switch_to_next_inplace(ciphertext,
+                                             this->workspace->pool);
+}
+
+/**
+ * An encryption of zero derived from a query ciphertext. SEAL refuses
+ * transparent ciphertexts, so compute c * (t - 1) + c instead of c - c.
+ */
+seal::Ciphertext
+EvaluatorDriver::encrypted_zero(const seal::Ciphertext &selector) {
+  std::uint64_t t =
+      this->context.first_context_data()->parms().plain_modulus().value();
+  seal::Plaintext minus_one;
+  minus_one = t - 1;
+  seal::Ciphertext zero;
+  this->evaluator.multiply_plain(selector, minus_one, zero,
+                                 this->workspace->pool);
+  this->evaluator.add_inplace(zero, selector);
+  return zero;
+}
@@ -1,77 +1,573 @@
-#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
+#include "../../include-shared/util.hpp"
 #include "../../include/drivers/hypercube_driver.hpp"
 
+/**
+ * Constructor. Picks the narrowest entry width that holds every value
+ * mod q and fills all entries with the given value.
+ */
+PackedValueStore::PackedValueStore(std::size_t size, std::uint64_t q,
+                                   std::uint64_t fill) {
+  std::uint64_t max_value = q - 1;
+  if (max_value <= UINT8_MAX)
+    this->bytes_per_entry = 1;
+  else if (max_value <= UINT16_MAX)
+    this->bytes_per_entry = 2;
+  else if (max_value <= UINT32_MAX)
+    this->bytes_per_entry = 4;
+  else
+    this->bytes_per_entry = 8;
+
+  this->count = size;
+  this->bytes.resize(size * this->bytes_per_entry);
+  for (std::size_t i = 0; i < size; i++)
+    this->set(i, fill);
+}
+
+/**
+ * Get the value at the given idx.
+ */
+std::uint64_t PackedValueStore::get(std::size_t idx) const {
+  const unsigned char *src = &this->bytes[idx * this->bytes_per_entry];
+  switch (this->bytes_per_entry) {
+  case 1:
+    return *src;
+  case 2: {
+    std::uint16_t x;
+    std::memcpy(&x, src, sizeof(x));
+    return x;
+  }
+  case 4: {
+    std::uint32_t x;
+    std::memcpy(&x, src, sizeof(x));
+    return x;
+  }
+  default: {
+    std::uint64_t x;
+    std::memcpy(&x, src, sizeof(x));
+    return x;
+  }
+  }
+}
+
+/**
+ * Set the value at the given idx. The caller is responsible for x fitting in
+ * the entry width.
+ */
+void PackedValueStore::set(std::size_t idx, std::uint64_t x) {
+  unsigned char *dst = &this->bytes[idx * this->bytes_per_entry];
+  switch (this->bytes_per_entry) {
+  case 1:
+    *dst = static_cast<std::uint8_t>(x);
+    break;
+  case 2: {
+    std::uint16_t v = static_cast<std::uint16_t>(x);
+    std::memcpy(dst, &v, sizeof(v));
+    break;
+  }
+  case 4: {
+    std::uint32_t v = static_cast<std::uint32_t>(x);
+    std::memcpy(dst, &v, sizeof(v));
+    break;
+  }
+  default:
+    std::memcpy(dst, &x, sizeof(x));
+    break;
+  }
+}
+
+/**
+ * Overwrite every entry with size() * width() bytes in the store's own
+ * layout, e.g. a page read back from a snapshot file.
+ */
+void PackedValueStore::assign(const unsigned char *src) {
+  std::memcpy(this->bytes.data(), src, this->bytes.size());
+}
+
+/**
+ * Layout with one value per entry, stored as a constant plaintext.
+ */
+RecordLayout RecordLayout::scalar(std::uint64_t q) {
+  RecordLayout layout;
+  layout.bits_per_coeff = plain_bits(q);
+  return layout;
+}
+
+/**
+ * Layout for records of up to record_size bytes, split into plaintexts of
+ * poly_degree coefficients.
+ */
+RecordLayout RecordLayout::records(std::size_t record_size, std::uint64_t q,
+                                   std::size_t poly_degree) {
+  RecordLayout layout;
+  layout.record_size = record_size;
+  layout.bits_per_coeff = plain_bits(q);
+  layout.coeffs = record_coeff_count(record_size, layout.bits_per_coeff);
+  layout.coeffs_per_plaintext = poly_degree;
+  layout.parts = (layout.coeffs + poly_degree - 1) / poly_degree;
+  return layout;
+}
+
+/**
+ * Decode the record stored at the given idx.
+ */
+std::vector<unsigned char> HypercubeSnapshot::record(std::size_t idx) const {
+  const PackedValueStore &values = this->pages[idx / PAGE_ENTRIES]->values;
+  std::size_t base = (idx % PAGE_ENTRIES) * this->layout.coeffs;
+  std::vector<std::uint64_t> coeffs(this->layout.coeffs);
+  for (std::size_t k = 0; k < this->layout.coeffs; k++)
+    coeffs[k] = values.get(base + k);
+  return decode_record(coeffs, this->layout.bits_per_coeff);
+}
+
+namespace {
+/**
+ * Encode the coefficients of entry idx into its layout.parts plaintexts.
+ * Trailing zero coefficients are trimmed; an all-zero part is left as an
+ * empty plaintext so evaluators can skip it.
+ */
+void encode_entry(const PackedValueStore &values, const RecordLayout &layout,
+                  std::size_t idx, std::vector<seal::Plaintext> &plaintexts) {
+  std::size_t base = idx * layout.coeffs;
+  for (std::size_t part = 0; part < layout.parts; part++) {
+    std::size_t begin = part * layout.coeffs_per_plaintext;
+    std::size_t end =
+        std::min(begin + layout.coeffs_per_plaintext, layout.coeffs);
+    std::size_t used = end - begin;
+    while (used > 0 && values.get(base + begin + used - 1) == 0)
+      used--;
+
+    seal::Plaintext plaintext;
+    if (used > 0) {
+      plaintext.resize(used);
+      for (std::size_t k = 0; k < used; k++)
+        plaintext[k] = values.get(base + begin + k);
+    }
+    plaintexts[idx * layout.parts + part] = std::move(plaintext);
+  }
+}
+
+/**
+ * Rebuild the occupancy list of a page: an entry is occupied when any of its
+ * plaintexts is non-zero.
+ */
+void index_occupancy(SnapshotPage &page, const RecordLayout &layout) {
+  page.occupied.clear();
+  std::size_t n = page.plaintexts.size() / layout.parts;
+  for (std::size_t i = 0; i < n; i++)
+    for (std::size_t part = 0; part < layout.parts; part++)
+      if (!page.plaintexts[i * layout.parts + part].is_zero()) {
+        page.occupied.push_back(static_cast<std::uint16_t>(i));
+        break;
+      }
+}
+
+/**
+ * A page of n empty entries.
+ */
+std::shared_ptr<const SnapshotPage>
+empty_page(std::size_t n, std::uint64_t q, const RecordLayout &layout) {
+  auto page = std::make_shared<SnapshotPage>();
+  page->values = PackedValueStore(n * layout.coeffs, q, 0);
+  page->plaintexts.resize(n * layout.parts);
+  return page;
+}
+
+/**
+ * Number of entries on page p of a database with the given number of entries.
+ */
+std::size_t page_entries(std::size_t entries, std::size_t p) {
+  return std::min(HypercubeSnapshot::PAGE_ENTRIES,
+                  entries - p * HypercubeSnapshot::PAGE_ENTRIES);
+}
+
+/**
+ * Build every page with fill(p, page) and encode its entries, splitting the
+ * pages across threads. Full pages for which fill returns false are left
+ * empty and share one empty page.
+ */
+std::vector<std::shared_ptr<const SnapshotPage>>
+build_pages(std::size_t entries, std::uint64_t q, const RecordLayout &layout,
+            int threads,
+            const std::function<bool(std::size_t, PackedValueStore &)> &fill) {
+  std::size_t count = (entries + HypercubeSnapshot::PAGE_ENTRIES - 1) /
+                      HypercubeSnapshot::PAGE_ENTRIES;
+  std::vector<std::shared_ptr<const SnapshotPage>> pages(count);
+  std::shared_ptr<const SnapshotPage> empty =
+      empty_page(HypercubeSnapshot::PAGE_ENTRIES, q, layout);
+  if (threads <= 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  std::size_t chunk = (count + threads - 1) / threads;
+  std::vector<std::thread> workers;
+  for (std::size_t begin = 0; begin < count; begin += chunk) {
+    std::size_t end = std::min(begin + chunk, count);
+    workers.emplace_back([&, begin, end]() {
+      for (std::size_t p = begin; p < end; p++) {
+        std::size_t n = page_entries(entries, p);
+        auto page = std::make_shared<SnapshotPage>();
+        page->values = PackedValueStore(n * layout.coeffs, q, 0);
+        if (!fill(p, page->values) && n == HypercubeSnapshot::PAGE_ENTRIES) {
+          pages[p] = empty;
+          continue;
+        }
+        page->plaintexts.resize(n * layout.parts);
+        for (std::size_t i = 0; i < n; i++)
+          encode_entry(page->values, layout, i, page->plaintexts);
+        index_occupancy(*page, layout);
+        pages[p] = page;
+      }
+    });
+  }
+  for (std::thread &worker : workers)
+    worker.join();
+  return pages;
+}
+} // namespace
+
 /**
  * Constructor. Makes a hypercube of dimension d with side length s
  * that stores integers mod q.
  */
-HypercubeDriver::HypercubeDriver(int d, int s, CryptoPP::Integer q) {
-  this->d = d;
-  this->s = s;
-  this->q = q;
-  this->data =
-      std::vector<CryptoPP::Integer>(std::pow(s, d), CryptoPP::Integer::One());
+HypercubeDriver::HypercubeDriver(int d, int s, CryptoPP::Integer q)
+    : HypercubeDriver(d, s, q,
+                      RecordLayout::scalar(
+                          static_cast<std::uint64_t>(q.ConvertToLong()))) {}
+
+/**
+ * Constructor. Makes a hypercube of dimension d with side length s whose
+ * entries follow the given layout.
+ */
+HypercubeDriver::HypercubeDriver(int d, int s, CryptoPP::Integer q,
+                                 RecordLayout layout)
+    : HypercubeDriver(std::vector<int>(std::max(d, 0), s), q, layout) {}
+
+/**
+ * Constructor. Makes a hypercube with the given side length in each
+ * dimension whose entries follow the given layout. Every entry starts empty
+ * (all coefficients zero), so all full pages share a single empty page until
+ * they are first written.
+ */
+HypercubeDriver::HypercubeDriver(std::vector<int> sides, CryptoPP::Integer q,
+                                 RecordLayout layout)
+    : geom(sides), record_layout(layout) {
+  this->q = static_cast<std::uint64_t>(q.ConvertToLong());
+
+  auto snapshot = std::make_shared<HypercubeSnapshot>();
+  snapshot->version = 0;
+  snapshot->entries = this->geom.size();
+  snapshot->layout = layout;
+  std::size_t count =
+      (snapshot->entries + HypercubeSnapshot::PAGE_ENTRIES - 1) /
+      HypercubeSnapshot::PAGE_ENTRIES;
+  std::shared_ptr<const SnapshotPage> empty =
+      empty_page(HypercubeSnapshot::PAGE_ENTRIES, this->q, layout);
+  for (std::size_t p = 0; p < count; p++) {
+    std::size_t n = page_entries(snapshot->entries, p);
+    snapshot->pages.push_back(n == HypercubeSnapshot::PAGE_ENTRIES
+                                  ? empty
+                                  : empty_page(n, this->q, layout));
+  }
+  this->current = snapshot;
 }
 
 /**
  * Insert x mod q at the given idx
  */
 void HypercubeDriver::insert(int idx, CryptoPP::Integer x) {
-  // Lock db driver.
-  std::unique_lock<std::mutex> lck(this->mtx);
+  CryptoPP::Integer reduced = x % CryptoPP::Integer((signed long)this->q);
+  this->insert(idx, static_cast<std::uint64_t>(reduced.ConvertToLong()));
+}
+
+/**
+ * Insert x mod q at the given idx, without going through CryptoPP::Integer.
+ * Publishes a new snapshot.
+ */
+void HypercubeDriver::insert(int idx, std::uint64_t x) {
+  this->insert_many({{idx, x}});
+}
+
+/**
+ * Apply all updates (idx, x mod q) and publish them as a single new snapshot.
+ */
+void HypercubeDriver::insert_many(
+    const std::vector<std::pair<int, std::uint64_t>> &updates) {
+  std::vector<std::pair<int, std::vector<std::uint64_t>>> coeffs;
+  coeffs.reserve(updates.size());
+  for (auto &update : updates)
+    coeffs.push_back({update.first, this->value_coeffs(update.second)});
+  this->apply(coeffs);
+}
+
+/**
+ * Store a byte string at the given idx. Publishes a new snapshot.
+ */
+void HypercubeDriver::insert_record(int idx,
+                                    const std::vector<unsigned char> &record) {
+  this->insert_records({{idx, record}});
+}
+
+/**
+ * Store all records and publish them as a single new snapshot.
+ */
+void HypercubeDriver::insert_records(
+    const std::vector<std::pair<int, std::vector<unsigned char>>> &records) {
+  std::vector<std::pair<int, std::vector<std::uint64_t>>> coeffs;
+  coeffs.reserve(records.size());
+  for (auto &record : records)
+    coeffs.push_back({record.first, this->record_coeffs(record.second)});
+  this->apply(coeffs);
+}
+
+/**
+ * The coefficients an entry holding the scalar x is stored as.
+ */
+std::vector<std::uint64_t> HypercubeDriver::value_coeffs(std::uint64_t x) const {
+  return {x % this->q};
+}
+
+/**
+ * The coefficients an entry holding the given record is stored as.
+ */
+std::vector<std::uint64_t> HypercubeDriver::record_coeffs(
+    const std::vector<unsigned char> &record) const {
+  if (this->record_layout.record_size == 0)
+    throw std::runtime_error("Hypercube does not store records");
+  if (record.size() > this->record_layout.record_size)
+    throw std::runtime_error("Record too large");
+  return encode_record(record, this->record_layout.bits_per_coeff);
+}
 
-  if (idx > std::pow(this->s, this->d))
+/**
+ * Overwrite the coefficients of each updated entry (missing trailing
+ * coefficients become zero), re-encode its plaintexts and publish the result
+ * as one new snapshot. Only the pages holding updated entries are copied;
+ * every other page is shared with the previous snapshot. Queries already
+ * running keep evaluating against the snapshot they pinned. The journal, if
+ * any, is told before the version is published; if it throws, nothing is
+ * published. Unless base_version is
+ * UPDATE_ANY_VERSION, the updates are only applied if the database is still
+ * at that version. Nothing is published if any update is rejected. Returns
+ * the version published.
+ */
+std::uint64_t HypercubeDriver::apply(
+    const std::vector<std::pair<int, std::vector<std::uint64_t>>> &updates,
+    std::uint64_t base_version) {
+  // Serialize writers; readers never take this lock.
+  std::unique_lock<std::mutex> lck(this->write_mtx);
+  std::shared_ptr<const HypercubeSnapshot> current = this->snapshot();
+  if (base_version != UPDATE_ANY_VERSION && base_version != current->version)
+    throw std::runtime_error("Database is at version " +
+                             std::to_string(current->version) + ", not " +
+                             std::to_string(base_version));
+  std::vector<std::shared_ptr<const SnapshotPage>> pages = current->pages;
+  this->patch(pages, updates);
+  std::uint64_t version = current->version + 1;
+  if (this->journal)
+    this->journal(version, &updates);
+  this->install(std::move(pages), version);
+  if (this->building > 0)
+    this->concurrent_updates.push_back(updates);
+  return version;
+}
+
+/**
+ * Write the updates into copies of the pages they touch and re-encode those
+ * entries. Must be called with write_mtx held.
+ */
+void HypercubeDriver::patch(
+    std::vector<std::shared_ptr<const SnapshotPage>> &pages,
+    const EntryUpdates &updates) {
+  const RecordLayout &layout = this->record_layout;
+  for (auto &update : updates)
+    if (update.first < 0 || update.first >= this->geom.size() ||
+        update.second.size() > layout.coeffs)
+      throw std::runtime_error("Hypercube out of bounds");
+
+  // Copy on write, one page at a time.
+  std::unordered_map<std::size_t, std::shared_ptr<SnapshotPage>> copies;
+  for (auto &update : updates) {
+    std::size_t p = update.first / HypercubeSnapshot::PAGE_ENTRIES;
+    std::shared_ptr<SnapshotPage> &page = copies[p];
+    if (!page)
+      page = std::make_shared<SnapshotPage>(*pages[p]);
+    std::size_t idx = update.first % HypercubeSnapshot::PAGE_ENTRIES;
+    std::size_t offset = idx * layout.coeffs;
+    for (std::size_t k = 0; k < layout.coeffs; k++)
+      page->values.set(offset + k,
+                       k < update.second.size() ? update.second[k] : 0);
+    encode_entry(page->values, layout, idx, page->plaintexts);
+  }
+  for (auto &copy : copies) {
+    index_occupancy(*copy.second, layout);
+    pages[copy.first] = copy.second;
+  }
+}
+
+/**
+ * Replace the whole database with the given values (entries * layout.coeffs
+ * coefficients, already reduced mod q). The pages are built and encoded in
+ * parallel without holding the write lock, so neither queries nor other
+ * writers wait on the build. Updates published while it runs are applied
+ * again on top of the new pages before they are swapped in, so none is lost.
+ */
+void HypercubeDriver::replace(std::shared_ptr<const PackedValueStore> values,
+                              int threads) {
+  std::size_t entries = this->geom.size();
+  std::size_t coeffs = this->record_layout.coeffs;
+  if (values->size() != entries * coeffs)
     throw std::runtime_error("Hypercube out of bounds");
 
-  this->data[idx] = x % this->q;
+  std::unique_lock<std::mutex> lck(this->write_mtx);
+  std::size_t first_update = this->concurrent_updates.size();
+  this->building++;
+  lck.unlock();
+
+  std::vector<std::shared_ptr<const SnapshotPage>> pages;
+  try {
+    pages = build_pages(
+        entries, this->q, this->record_layout, threads,
+        [&values, coeffs](std::size_t p, PackedValueStore &page_values) {
+          std::size_t base = p * HypercubeSnapshot::PAGE_ENTRIES * coeffs;
+          for (std::size_t k = 0; k < page_values.size(); k++)
+            page_values.set(k, values->get(base + k));
+          return true;
+        });
+  } catch (...) {
+    lck.lock();
+    if (--this->building == 0)
+      this->concurrent_updates.clear();
+    throw;
+  }
+
+  lck.lock();
+  for (std::size_t i = first_update; i < this->concurrent_updates.size(); i++)
+    this->patch(pages, this->concurrent_updates[i]);
+  if (--this->building == 0)
+    this->concurrent_updates.clear();
+  this->publish(std::move(pages));
+  if (this->journal)
+    this->journal(this->snapshot()->version, nullptr);
+}
+
+/**
+ * Replace the whole database with a saved one: fill(p, values) supplies the
+ * coefficients of page p (returning false for a page with nothing in it),
+ * then the updates logged since are applied on top, and the result is
+ * published as the given version rather than the next one, so versions keep
+ * counting from where they were when saved. The journal is not told.
+ */
+void HypercubeDriver::restore(
+    std::uint64_t version,
+    const std::function<bool(std::size_t, PackedValueStore &)> &fill,
+    const EntryUpdates &updates, int threads) {
+  std::vector<std::shared_ptr<const SnapshotPage>> pages = build_pages(
+      this->geom.size(), this->q, this->record_layout, threads, fill);
+  std::unique_lock<std::mutex> lck(this->write_mtx);
+  this->patch(pages, updates);
+  this->install(std::move(pages), version);
+}
+
+/**
+ * Call journal with every version published from now on, while writers are
+ * still held off, so it sees versions in order.
+ */
+void HypercubeDriver::set_journal(HypercubeJournal journal) {
+  std::unique_lock<std::mutex> lck(this->write_mtx);
+  this->journal = journal;
+}
+
+/**
+ * Atomically replace the current snapshot with one made of the given pages,
+ * as the next version. Must be called with write_mtx held.
+ */
+void HypercubeDriver::publish(
+    std::vector<std::shared_ptr<const SnapshotPage>> pages) {
+  this->install(std::move(pages), this->snapshot()->version + 1);
+}
+
+/**
+ * Atomically replace the current snapshot with one made of the given pages,
+ * as the given version. Must be called with write_mtx held.
+ */
+void HypercubeDriver::install(
+    std::vector<std::shared_ptr<const SnapshotPage>> pages,
+    std::uint64_t version) {
+  auto next = std::make_shared<HypercubeSnapshot>();
+  next->version = version;
+  next->entries = this->geom.size();
+  next->layout = this->record_layout;
+  next->pages = std::move(pages);
+  for (auto &page : next->pages)
+    next->populated += page->occupied.size();
+  std::atomic_store(&this->current,
+                    std::shared_ptr<const HypercubeSnapshot>(next));
 }
 
 /**
  * Get the value at the given idx, mod q
  */
 CryptoPP::Integer HypercubeDriver::get(int idx) {
-  // Lock db driver.
-  std::unique_lock<std::mutex> lck(this->mtx);
+  return CryptoPP::Integer((signed long)this->get_value(idx));
+}
 
-  if (idx > std::pow(this->s, this->d))
+/**
+ * Get the value at the given idx, mod q, as a machine integer.
+ */
+std::uint64_t HypercubeDriver::get_value(int idx) {
+  std::shared_ptr<const HypercubeSnapshot> snapshot = this->snapshot();
+  if (idx < 0 || idx >= snapshot->size())
     throw std::runtime_error("Hypercube out of bounds");
 
-  return this->data[idx];
+  return snapshot->get(idx);
 }
 
+/**
+ * Get the record stored at the given idx.
+ */
+std::vector<unsigned char> HypercubeDriver::get_record(int idx) {
+  std::shared_ptr<const HypercubeSnapshot> snapshot = this->snapshot();
+  if (idx < 0 || idx >= snapshot->size())
+    throw std::runtime_error("Hypercube out of bounds");
+
+  return snapshot->record(idx);
+}
+
+/**
+ * Pin the current snapshot. Lock-free with respect to writers; the snapshot
+ * stays valid for as long as the caller holds it.
+ */
+std::shared_ptr<const HypercubeSnapshot> HypercubeDriver::snapshot() {
+  return std::atomic_load(&this->current);
+}
+
+/**
+ * Current database version. Bumped once per published snapshot.
+ */
+std::uint64_t HypercubeDriver::version() { return this->snapshot()->version; }
+
 /**
  * Convert index to coordinates
  */
 std::vector<int> HypercubeDriver::to_coords(int idx) {
-  if (idx > std::pow(this->s, this->d)-1)
+  if (!this->geom.contains(idx))
     throw std::runtime_error("Hypercube out of bounds");
-
-  std::vector<int> res;
-  res.resize(this->d);
-  for (int e = this->d - 1; e >= 0; e--) {
-    res[this->d - e - 1] = 0;
-    int step = std::pow(this->s, e);
-    while (idx >= step) {
-      idx -= step;
-      res[this->d - e - 1] += 1;
-    }
-  }
-  return res;
+  return this->geom.to_coords(idx);
 }
 
 /**
  * Convert coords to index
  */
 int HypercubeDriver::from_coords(std::vector<int> coords) {
-  for (int x : coords)
-    if (x >= this->s)
+  if (coords.size() != this->geom.dimension())
+    throw std::runtime_error("Hypercube out of bounds");
+  for (int i = 0; i < coords.size(); i++)
+    if (coords[i] < 0 || coords[i] >= this->geom.side(i))
       throw std::runtime_error("Hypercube out of bounds");
-
-  int res;
-  for (int e = this->d - 1; e >= 0; e--) {
-    int step = std::pow(this->s, e);
-    res += step * coords[this->d - e - 1];
-  }
-  return res;
+  return this->geom.from_coords(coords);
 }
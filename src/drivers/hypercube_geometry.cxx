@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "../../include/drivers/hypercube_geometry.hpp"
+
+namespace {
+using to_coords_fn = void (*)(std::size_t, int *);
+using from_coords_fn = std::size_t (*)(const int *);
+
+/**
+ * Use StaticGeometry<D, S> if it matches (d, s).
+ */
+template <int D, int S>
+bool use_static(int d, int s, to_coords_fn &to, from_coords_fn &from) {
+  if (d != D || s != S)
+    return false;
+  to = &StaticGeometry<D, S>::to_coords;
+  from = &StaticGeometry<D, S>::from_coords;
+  return true;
+}
+
+template <int D, int... S>
+bool use_static_sides(int d, int s, to_coords_fn &to, from_coords_fn &from) {
+  return (use_static<D, S>(d, s, to, from) || ...);
+}
+
+/**
+ * Shapes with a compiled specialization: d <= 3 with small or power-of-two
+ * side lengths.
+ */
+template <int D>
+bool use_static_dimension(int d, int s, to_coords_fn &to,
+                          from_coords_fn &from) {
+  return use_static_sides<D, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 16, 32, 64, 128,
+                          256>(d, s, to, from);
+}
+} // namespace
+
+/**
+ * Constructor. Makes an s^d cube.
+ */
+HypercubeGeometry::HypercubeGeometry(int d, int s)
+    : HypercubeGeometry(std::vector<int>(std::max(d, 0), s)) {}
+
+/**
+ * Constructor. Precomputes strides, selector offsets and the evaluation plan
+ * for a cube with the given side length in each dimension.
+ */
+HypercubeGeometry::HypercubeGeometry(std::vector<int> sides) {
+  if (sides.empty())
+    throw std::runtime_error("Invalid hypercube geometry");
+  for (int side : sides)
+    if (side < 1)
+      throw std::runtime_error("Invalid hypercube geometry");
+  this->d = sides.size();
+  this->sides = sides;
+
+  this->strides.resize(this->d);
+  this->offsets.resize(this->d);
+  this->total = 1;
+  for (int i = this->d - 1; i >= 0; i--) {
+    this->strides[i] = this->total;
+    this->total *= sides[i];
+  }
+  this->selectors = 0;
+  for (int i = 0; i < this->d; i++) {
+    this->offsets[i] = this->selectors;
+    this->selectors += sides[i];
+  }
+
+  // Only uniform shapes have a compiled specialization.
+  int s = sides[0];
+  bool uniform = std::all_of(sides.begin(), sides.end(),
+                             [s](int side) { return side == s; });
+  if (uniform &&
+      !use_static_dimension<1>(this->d, s, this->static_to_coords,
+                               this->static_from_coords) &&
+      !use_static_dimension<2>(this->d, s, this->static_to_coords,
+                               this->static_from_coords))
+    use_static_dimension<3>(this->d, s, this->static_to_coords,
+                            this->static_from_coords);
+
+  // Fold the most significant coordinate first; the remaining entries stay
+  // contiguous, so no coordinate math is needed while evaluating.
+  auto plan = std::make_shared<EvaluationPlan>();
+  plan->entries = this->total;
+  plan->query_size = this->selectors;
+  for (int i = 0; i < this->d; i++) {
+    FoldStep step;
+    step.dimension = i;
+    step.out_count = this->strides[i];
+    for (int c = 0; c < sides[i]; c++)
+      step.selectors.push_back(this->offsets[i] + c);
+    plan->folds.push_back(step);
+  }
+  this->eval_plan = plan;
+}
+
+/**
+ * Convert index to coordinates, writing d values into coords.
+ */
+void HypercubeGeometry::to_coords(std::size_t idx, int *coords) const {
+  if (this->static_to_coords) {
+    this->static_to_coords(idx, coords);
+    return;
+  }
+  for (int i = 0; i < this->d; i++) {
+    coords[i] = static_cast<int>(idx / this->strides[i]);
+    idx %= this->strides[i];
+  }
+}
+
+/**
+ * Convert index to coordinates.
+ */
+std::vector<int> HypercubeGeometry::to_coords(std::size_t idx) const {
+  std::vector<int> coords(this->d);
+  this->to_coords(idx, coords.data());
+  return coords;
+}
+
+/**
+ * Convert d coordinates to an index.
+ */
+std::size_t HypercubeGeometry::from_coords(const int *coords) const {
+  if (this->static_from_coords)
+    return this->static_from_coords(coords);
+  std::size_t idx = 0;
+  for (int i = 0; i < this->d; i++)
+    idx += this->strides[i] * coords[i];
+  return idx;
+}
+
+/**
+ * Convert coordinates to an index.
+ */
+std::size_t
+HypercubeGeometry::from_coords(const std::vector<int> &coords) const {
+  return this->from_coords(coords.data());
+}
+
+/**
+ * Parse side lengths: a single length repeated d times, or exactly d
+ * lengths separated by 'x'.
+ */
+std::vector<int> parse_sides(int d, const std::string &sides) {
+  std::vector<int> result;
+  std::size_t begin = 0;
+  while (true) {
+    std::size_t end = sides.find('x', begin);
+    result.push_back(std::stoi(sides.substr(begin, end - begin)));
+    if (end == std::string::npos)
+      break;
+    begin = end + 1;
+  }
+  if (result.size() == 1 && d > 0)
+    return std::vector<int>(d, result[0]);
+  if (result.size() != d)
+    throw std::runtime_error("Side lengths do not match the dimension");
+  return result;
+}
+
+/**
+ * Side lengths joined with 'x', such as "64x32x8".
+ */
+std::string shape_name(const std::vector<int> &sides) {
+  std::string name;
+  for (std::size_t i = 0; i < sides.size(); i++)
+    name += (i ? "x" : "") + std::to_string(sides[i]);
+  return name;
+}
@@ -0,0 +1,278 @@
+#include <cstring>
+#include <fcntl.h>
+#include <random>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <crypto++/sha.h>
+
+#include "../../include-shared/constants.hpp"
+#include "../../include-shared/util.hpp"
+#include "../../include/drivers/keyword_driver.hpp"
+#include "../../include/drivers/loader_driver.hpp"
+
+namespace {
+/**
+ * 64-bit hash of a key under the given seed.
+ */
+std::uint64_t keyword_hash(const std::vector<unsigned char> &key,
+                           unsigned char seed) {
+  std::vector<unsigned char> input;
+  input.reserve(key.size() + 1);
+  input.push_back(seed);
+  input.insert(input.end(), key.begin(), key.end());
+
+  CryptoPP::byte digest[CryptoPP::SHA256::DIGESTSIZE];
+  CryptoPP::SHA256().CalculateDigest(digest, input.data(), input.size());
+  std::uint64_t hash;
+  std::memcpy(&hash, digest, sizeof(hash));
+  return hash;
+}
+
+const unsigned char TAG_SEED = 0xff;
+} // namespace
+
+/**
+ * Keyword for a 64-bit id: its 8 little-endian bytes.
+ */
+std::vector<unsigned char> keyword_from_id(std::uint64_t id) {
+  std::vector<unsigned char> key(sizeof(id));
+  for (int i = 0; i < sizeof(id); i++)
+    key[i] = (id >> (8 * i)) & 0xff;
+  return key;
+}
+
+/**
+ * Keyword for a string: its bytes.
+ */
+std::vector<unsigned char> keyword_from_string(const std::string &key) {
+  return str2chvec(key);
+}
+
+/**
+ * The CUCKOO_HASH_COUNT slots the key may live in. Always returns the same
+ * number of slots, so the query reveals nothing about the key.
+ */
+std::vector<int> keyword_candidates(const std::vector<unsigned char> &key,
+                                    std::size_t table_size) {
+  std::vector<int> candidates;
+  for (int i = 0; i < CUCKOO_HASH_COUNT; i++)
+    candidates.push_back(keyword_hash(key, i) % table_size);
+  return candidates;
+}
+
+/**
+ * Prefix the value with the key's fingerprint.
+ */
+std::vector<unsigned char>
+keyword_tag_record(const std::vector<unsigned char> &key,
+                   const std::vector<unsigned char> &value) {
+  std::vector<unsigned char> record = keyword_from_id(keyword_hash(key, TAG_SEED));
+  record.resize(KEYWORD_TAG_SIZE);
+  record.insert(record.end(), value.begin(), value.end());
+  return record;
+}
+
+/**
+ * If the record belongs to the key, return its value.
+ */
+std::pair<std::vector<unsigned char>, bool>
+keyword_untag_record(const std::vector<unsigned char> &key,
+                     const std::vector<unsigned char> &record) {
+  std::vector<unsigned char> tag = keyword_from_id(keyword_hash(key, TAG_SEED));
+  tag.resize(KEYWORD_TAG_SIZE);
+  if (record.size() < KEYWORD_TAG_SIZE ||
+      !std::equal(tag.begin(), tag.end(), record.begin()))
+    return std::make_pair(std::vector<unsigned char>(), false);
+  return std::make_pair(
+      std::vector<unsigned char>(record.begin() + KEYWORD_TAG_SIZE,
+                                 record.end()),
+      true);
+}
+
+/**
+ * Constructor. The hypercube must use a record layout.
+ */
+KeywordDriver::KeywordDriver(std::shared_ptr<HypercubeDriver> hypercube_driver) {
+  if (hypercube_driver->layout().record_size <= KEYWORD_TAG_SIZE)
+    throw std::runtime_error("Keyword mode needs records larger than the tag");
+  this->hypercube_driver = hypercube_driver;
+}
+
+/**
+ * Destructor. Closes the key file, if any.
+ */
+KeywordDriver::~KeywordDriver() {
+  if (this->keys_fd >= 0)
+    close(this->keys_fd);
+}
+
+/**
+ * Read the keys saved at path, each an 8-byte length and its bytes, and put
+ * every key back in the candidate slot whose record carries its tag. Keys
+ * whose record is gone are dropped. A key cut short by a crash ends the
+ * file and is cut off it. From now on, new keys are appended to the file.
+ * Returns the number of keys placed.
+ */
+std::size_t KeywordDriver::restore(std::string path) {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  std::vector<std::string> keys;
+  std::size_t complete = 0, size = 0;
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0) {
+    MappedFile file(path);
+    const char *data = file.data();
+    size = file.size();
+    std::size_t n = 0;
+    std::uint64_t length;
+    while (size - n >= sizeof(length)) {
+      std::memcpy(&length, data + n, sizeof(length));
+      if (length > size - n - sizeof(length))
+        break;
+      keys.emplace_back(data + n + sizeof(length), length);
+      n += sizeof(length) + length;
+      complete = n;
+    }
+  }
+  if (complete < size && truncate(path.c_str(), complete) != 0)
+    throw std::runtime_error("Unable to truncate file: " + path);
+
+  std::shared_ptr<const HypercubeSnapshot> snapshot =
+      this->hypercube_driver->snapshot();
+  for (const std::string &key_str : keys) {
+    if (this->key_slots.count(key_str))
+      continue;
+    std::vector<unsigned char> key = str2chvec(key_str);
+    for (int slot : keyword_candidates(key, snapshot->size()))
+      if (!this->slot_keys.count(slot) &&
+          keyword_untag_record(key, snapshot->record(slot)).second) {
+        this->slot_keys[slot] = key_str;
+        this->key_slots[key_str] = slot;
+        break;
+      }
+  }
+
+  this->keys_path = path;
+  this->keys_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (this->keys_fd < 0)
+    throw std::runtime_error("Unable to open file: " + path);
+  return this->key_slots.size();
+}
+
+/**
+ * Save a new key, if restored from a file. The key is synced before its
+ * record is written, so a restore never finds a record it has no key for.
+ * Must be called with mtx held.
+ */
+void KeywordDriver::append_key(const std::string &key) {
+  if (this->keys_fd < 0)
+    return;
+  std::uint64_t length = key.size();
+  std::string bytes(reinterpret_cast<const char *>(&length), sizeof(length));
+  bytes += key;
+  std::size_t written = 0;
+  while (written < bytes.size()) {
+    ssize_t n = write(this->keys_fd, bytes.data() + written,
+                      bytes.size() - written);
+    if (n < 0)
+      throw std::runtime_error("Unable to write file: " + this->keys_path);
+    written += n;
+  }
+  if (fsync(this->keys_fd) != 0)
+    throw std::runtime_error("Unable to sync file: " + this->keys_path);
+}
+
+/**
+ * Insert or overwrite the value for key. New keys are placed by cuckoo
+ * hashing; every record moved along the eviction path is published in one
+ * snapshot, and nothing changes if no slot can be found.
+ */
+void KeywordDriver::insert(const std::vector<unsigned char> &key,
+                           const std::vector<unsigned char> &value) {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  std::vector<unsigned char> record = keyword_tag_record(key, value);
+  if (record.size() > this->hypercube_driver->layout().record_size)
+    throw std::runtime_error("Record too large");
+
+  std::string key_str = chvec2str(key);
+  auto existing = this->key_slots.find(key_str);
+  if (existing != this->key_slots.end()) {
+    this->hypercube_driver->insert_record(existing->second, record);
+    return;
+  }
+
+  std::shared_ptr<const HypercubeSnapshot> snapshot =
+      this->hypercube_driver->snapshot();
+  std::mt19937 rng(std::random_device{}());
+
+  // Placements along the eviction path, committed together at the end.
+  std::unordered_map<int, std::pair<std::string, std::vector<unsigned char>>>
+      placed;
+  auto occupied = [&](int slot) {
+    return placed.count(slot) || this->slot_keys.count(slot);
+  };
+
+  std::pair<std::string, std::vector<unsigned char>> current = {key_str,
+                                                                 record};
+  int last_slot = -1;
+  for (int kick = 0; kick < CUCKOO_MAX_KICKS; kick++) {
+    std::vector<int> candidates =
+        keyword_candidates(str2chvec(current.first), snapshot->size());
+    int free_slot = -1;
+    for (int slot : candidates)
+      if (!occupied(slot)) {
+        free_slot = slot;
+        break;
+      }
+
+    if (free_slot >= 0) {
+      placed[free_slot] = current;
+      this->append_key(key_str);
+      std::vector<std::pair<int, std::vector<unsigned char>>> records;
+      for (auto &placement : placed)
+        records.push_back({placement.first, placement.second.second});
+      this->hypercube_driver->insert_records(records);
+      for (auto &placement : placed) {
+        this->slot_keys[placement.first] = placement.second.first;
+        this->key_slots[placement.second.first] = placement.first;
+      }
+      return;
+    }
+
+    // Evict a random candidate, avoiding the slot we were just evicted from.
+    int slot = candidates[rng() % candidates.size()];
+    for (int tries = 0; slot == last_slot && tries < candidates.size(); tries++)
+      slot = candidates[(tries + 1) % candidates.size()];
+    std::pair<std::string, std::vector<unsigned char>> evicted;
+    if (placed.count(slot))
+      evicted = placed[slot];
+    else
+      evicted = {this->slot_keys[slot], snapshot->record(slot)};
+    placed[slot] = current;
+    current = evicted;
+    last_slot = slot;
+  }
+  throw std::runtime_error("Keyword table full");
+}
+
+/**
+ * Look up the value stored for key.
+ */
+std::pair<std::vector<unsigned char>, bool>
+KeywordDriver::get(const std::vector<unsigned char> &key) {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  auto existing = this->key_slots.find(chvec2str(key));
+  if (existing == this->key_slots.end())
+    return std::make_pair(std::vector<unsigned char>(), false);
+  return keyword_untag_record(
+      key, this->hypercube_driver->get_record(existing->second));
+}
+
+/**
+ * Number of keys stored.
+ */
+std::size_t KeywordDriver::size() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  return this->key_slots.size();
+}
@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../../include/drivers/loader_driver.hpp"
+
+namespace {
+/**
+ * Run fn(chunk) for chunks 0..chunks-1 on their own threads. The first
+ * exception thrown by any chunk is rethrown once all of them finish.
+ */
+void run_chunks(int chunks, const std::function<void(int)> &fn) {
+  std::vector<std::exception_ptr> errors(chunks);
+  std::vector<std::thread> workers;
+  for (int k = 0; k < chunks; k++)
+    workers.emplace_back([&fn, &errors, k]() {
+      try {
+        fn(k);
+      } catch (...) {
+        errors[k] = std::current_exception();
+      }
+    });
+  for (std::thread &worker : workers)
+    worker.join();
+  for (std::exception_ptr &error : errors)
+    if (error)
+      std::rethrow_exception(error);
+}
+
+bool is_separator(char c) {
+  return c == ',' || c == '\n' || c == '\r' || c == ' ' || c == '\t';
+}
+
+std::uint64_t read_le(const char *src, int width) {
+  std::uint64_t x = 0;
+  for (int b = 0; b < width; b++)
+    x |= static_cast<std::uint64_t>(static_cast<unsigned char>(src[b]))
+         << (8 * b);
+  return x;
+}
+
+void write_le(std::ostream &out, std::uint64_t x, int width) {
+  char bytes[8];
+  for (int b = 0; b < width; b++)
+    bytes[b] = static_cast<char>((x >> (8 * b)) & 0xff);
+  out.write(bytes, width);
+}
+} // namespace
+
+/**
+ * Write values mod q in the binary bulk format, using the narrowest width
+ * that holds q - 1.
+ */
+void write_bulk_values(const std::string &filename,
+                       const std::vector<std::uint64_t> &values,
+                       std::uint64_t q) {
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+    throw std::runtime_error("Unable to open file: " + filename);
+  int width = PackedValueStore(0, q, 0).width();
+  file.write(BULK_MAGIC, sizeof(BULK_MAGIC));
+  write_le(file, width, 4);
+  write_le(file, 0, 4);
+  write_le(file, values.size(), 8);
+  for (std::uint64_t x : values)
+    write_le(file, x % q, width);
+}
+
+/**
+ * Map the whole file read-only.
+ */
+MappedFile::MappedFile(const std::string &filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Unable to open file: " + filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("Unable to open file: " + filename);
+  }
+  this->length = st.st_size;
+  if (this->length > 0) {
+    void *addr = mmap(nullptr, this->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("Unable to map file: " + filename);
+    }
+    madvise(addr, this->length, MADV_SEQUENTIAL);
+    this->addr = static_cast<const char *>(addr);
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (this->addr)
+    munmap(const_cast<char *>(this->addr), this->length);
+}
+
+/**
+ * Constructor. threads <= 0 uses one thread per core.
+ */
+LoaderDriver::LoaderDriver(std::shared_ptr<HypercubeDriver> hypercube_driver,
+                           int threads) {
+  if (hypercube_driver->layout().record_size != 0)
+    throw std::runtime_error("Bulk loading needs a scalar hypercube");
+  this->hypercube_driver = hypercube_driver;
+  this->threads =
+      threads > 0 ? threads
+                  : std::max(1u, std::thread::hardware_concurrency());
+}
+
+/**
+ * Replace the database with the contents of the file. Entries past the end
+ * of the file are left empty. Returns the number of values read.
+ */
+std::size_t LoaderDriver::load(const std::string &filename) {
+  MappedFile file(filename);
+  std::size_t count;
+  std::shared_ptr<PackedValueStore> values =
+      this->parse(file.data(), file.size(), count);
+  this->hypercube_driver->replace(values, this->threads);
+  return count;
+}
+
+/**
+ * Parse a binary or CSV buffer into a full table of values mod q.
+ */
+std::shared_ptr<PackedValueStore>
+LoaderDriver::parse(const char *data, std::size_t size, std::size_t &count) {
+  auto values = std::make_shared<PackedValueStore>(
+      this->hypercube_driver->geometry().size(),
+      this->hypercube_driver->modulus(), 0);
+  if (size >= sizeof(BULK_MAGIC) &&
+      std::memcmp(data, BULK_MAGIC, sizeof(BULK_MAGIC)) == 0)
+    this->parse_binary(data, size, *values, count);
+  else
+    this->parse_csv(data, size, *values, count);
+  return values;
+}
+
+/**
+ * Binary values sit at fixed offsets, so every thread decodes its own range
+ * directly.
+ */
+void LoaderDriver::parse_binary(const char *data, std::size_t size,
+                                PackedValueStore &values, std::size_t &count) {
+  if (size < BULK_HEADER_SIZE)
+    throw std::runtime_error("Malformed value file");
+  int width = static_cast<int>(read_le(data + 8, 4));
+  std::uint64_t n = read_le(data + 16, 8);
+  if ((width != 1 && width != 2 && width != 4 && width != 8) ||
+      n > (size - BULK_HEADER_SIZE) / width)
+    throw std::runtime_error("Malformed value file");
+  if (n > values.size())
+    throw std::runtime_error("Hypercube out of bounds");
+
+  const char *body = data + BULK_HEADER_SIZE;
+  std::uint64_t q = this->hypercube_driver->modulus();
+  int chunks = this->threads;
+  run_chunks(chunks, [&](int k) {
+    std::size_t begin = n * k / chunks;
+    std::size_t end = n * (k + 1) / chunks;
+    for (std::size_t i = begin; i < end; i++)
+      values.set(i, read_le(body + i * width, width) % q);
+  });
+  count = n;
+}
+
+/**
+ * CSV is split into chunks at separators. A first pass counts the values in
+ * each chunk so the second pass knows where each chunk's values go; both
+ * passes run in parallel.
+ */
+void LoaderDriver::parse_csv(const char *data, std::size_t size,
+                             PackedValueStore &values, std::size_t &count) {
+  int chunks = this->threads;
+  std::vector<std::size_t> starts(chunks + 1);
+  starts[0] = 0;
+  starts[chunks] = size;
+  for (int k = 1; k < chunks; k++) {
+    std::size_t pos = std::max(size * k / chunks, starts[k - 1]);
+    while (pos > 0 && pos < size && !is_separator(data[pos - 1]))
+      pos++;
+    starts[k] = pos;
+  }
+
+  std::vector<std::size_t> counts(chunks, 0);
+  run_chunks(chunks, [&](int k) {
+    for (std::size_t i = starts[k]; i < starts[k + 1]; i++)
+      if (!is_separator(data[i]) && (i == 0 || is_separator(data[i - 1])))
+        counts[k]++;
+  });
+
+  std::vector<std::size_t> offsets(chunks + 1, 0);
+  for (int k = 0; k < chunks; k++)
+    offsets[k + 1] = offsets[k] + counts[k];
+  if (offsets[chunks] > values.size())
+    throw std::runtime_error("Hypercube out of bounds");
+
+  std::uint64_t q = this->hypercube_driver->modulus();
+  run_chunks(chunks, [&](int k) {
+    const char *p = data + starts[k];
+    const char *end = data + starts[k + 1];
+    std::size_t idx = offsets[k];
+    while (p < end) {
+      if (is_separator(*p)) {
+        p++;
+        continue;
+      }
+      std::uint64_t x;
+      auto result = std::from_chars(p, end, x);
+      if (result.ec != std::errc() ||
+          (result.ptr < end && !is_separator(*result.ptr)))
+        throw std::runtime_error("Malformed CSV value");
+      values.set(idx++, x % q);
+      p = result.ptr;
+    }
+  });
+  count = offsets[chunks];
+}
@@ -0,0 +1,343 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "../../include/drivers/metrics_driver.hpp"
+
+/**
+ * Every shard of one driver, and those free for reuse. Shared with the
+ * threads holding shards, which hand them back when they exit.
+ */
+struct MetricsDriver::Registry {
+  std::uint64_t id;
+  std::mutex mtx;
+  std::vector<std::shared_ptr<Shard>> shards;
+  std::vector<std::shared_ptr<Shard>> free;
+};
+
+namespace {
+std::atomic<std::uint64_t> next_registry_id{0};
+
+/**
+ * Shards this thread holds, one per metrics driver it has recorded into.
+ */
+struct ThreadShards {
+  struct Held {
+    std::uint64_t registry_id;
+    std::weak_ptr<MetricsDriver::Registry> registry;
+    std::shared_ptr<MetricsDriver::Shard> shard;
+  };
+  std::vector<Held> held;
+
+  ~ThreadShards() {
+    for (Held &h : this->held)
+      if (auto registry = h.registry.lock()) {
+        std::unique_lock<std::mutex> lck(registry->mtx);
+        registry->free.push_back(h.shard);
+      }
+  }
+};
+thread_local ThreadShards thread_shards;
+
+const std::size_t BUCKET_COUNT = LATENCY_BUCKETS_MS.size() + 1;
+
+std::string format_bound(double ms) {
+  std::ostringstream out;
+  out << ms / 1000;
+  return out.str();
+}
+} // namespace
+
+std::string server_phase_name(ServerPhase phase) {
+  switch (phase) {
+  case ServerPhase::HANDSHAKE:
+    return "handshake";
+  case ServerPhase::DESERIALIZE:
+    return "deserialize";
+  case ServerPhase::EVALUATE:
+    return "evaluate";
+  case ServerPhase::RESPOND:
+    return "respond";
+  case ServerPhase::TOTAL:
+    return "total";
+  }
+  return "unknown";
+}
+
+std::uint64_t PhaseHistogram::count() const {
+  std::uint64_t count = 0;
+  for (std::uint64_t c : this->counts)
+    count += c;
+  return count;
+}
+
+/**
+ * Upper bound of the bucket holding the p-th percentile, in milliseconds.
+ * Samples in the unbounded bucket report the largest bound.
+ */
+double PhaseHistogram::percentile(double p) const {
+  std::uint64_t total = this->count();
+  if (total == 0)
+    return 0;
+  std::uint64_t rank = std::max<std::uint64_t>(
+      1, static_cast<std::uint64_t>(std::ceil(p / 100.0 * total)));
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < LATENCY_BUCKETS_MS.size(); i++) {
+    seen += this->counts[i];
+    if (seen >= rank)
+      return LATENCY_BUCKETS_MS[i];
+  }
+  return LATENCY_BUCKETS_MS.back();
+}
+
+std::uint64_t MetricsSnapshot::active_connections() const {
+  return this->connections_opened - this->connections_closed;
+}
+
+/**
+ * Human-readable summary for the REPL.
+ */
+std::string MetricsSnapshot::summary() const {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(2);
+  out << "connections: " << this->active_connections() << " active, "
+      << this->connections_opened << " total" << std::endl;
+  out << "queries: " << this->queries << " total, " << this->queries_per_second
+      << "/s, " << this->errors << " errors" << std::endl;
+  out << "evaluation: " << this->evaluation_seconds << " s total, "
+      << this->evaluation_utilization << " threads busy on average"
+      << std::endl;
+  for (int k = 0; k < SERVER_PHASE_COUNT; k++) {
+    const PhaseHistogram &histogram = this->phases[k];
+    std::uint64_t count = histogram.count();
+    if (count == 0)
+      continue;
+    out << server_phase_name(static_cast<ServerPhase>(k)) << ": mean "
+        << histogram.sum_ms / count << " ms, p50 <= "
+        << histogram.percentile(50) << " ms, p99 <= "
+        << histogram.percentile(99) << " ms" << std::endl;
+  }
+  for (auto &gauge : this->gauges)
+    out << gauge.first << ": " << gauge.second << std::endl;
+  return out.str();
+}
+
+/**
+ * Prometheus text exposition format.
+ */
+std::string MetricsSnapshot::prometheus() const {
+  std::ostringstream out;
+  auto metric = [&out](const std::string &name, const std::string &type,
+                       const std::string &help, double value) {
+    out << "# HELP " << name << " " << help << std::endl;
+    out << "# TYPE " << name << " " << type << std::endl;
+    out << name << " " << value << std::endl;
+  };
+  metric("pir_connections_total", "counter", "Connections accepted.",
+         this->connections_opened);
+  metric("pir_active_connections", "gauge", "Connections being served.",
+         this->active_connections());
+  metric("pir_queries_total", "counter", "Queries answered.", this->queries);
+  metric("pir_errors_total", "counter", "Connections that failed.",
+         this->errors);
+  metric("pir_queries_per_second", "gauge",
+         "Query rate since the previous read.", this->queries_per_second);
+  metric("pir_evaluation_seconds_total", "counter",
+         "Time spent evaluating queries.", this->evaluation_seconds);
+  metric("pir_evaluation_utilization", "gauge",
+         "Average evaluating threads since the previous read.",
+         this->evaluation_utilization);
+
+  std::string name = "pir_phase_latency_seconds";
+  out << "# HELP " << name << " Time spent in each phase of a connection."
+      << std::endl;
+  out << "# TYPE " << name << " histogram" << std::endl;
+  for (int k = 0; k < SERVER_PHASE_COUNT; k++) {
+    const PhaseHistogram &histogram = this->phases[k];
+    std::string phase = server_phase_name(static_cast<ServerPhase>(k));
+    std::uint64_t cumulative = 0;
+    for (std::size_t i = 0; i < BUCKET_COUNT; i++) {
+      cumulative += histogram.counts[i];
+      std::string le = i < LATENCY_BUCKETS_MS.size()
+                           ? format_bound(LATENCY_BUCKETS_MS[i])
+                           : "+Inf";
+      out << name << "_bucket{phase=\"" << phase << "\",le=\"" << le << "\"} "
+          << cumulative << std::endl;
+    }
+    out << name << "_sum{phase=\"" << phase << "\"} "
+        << histogram.sum_ms / 1000 << std::endl;
+    out << name << "_count{phase=\"" << phase << "\"} " << cumulative
+        << std::endl;
+  }
+
+  for (auto &gauge : this->gauges) {
+    out << "# TYPE " << gauge.first << " gauge" << std::endl;
+    out << gauge.first << " " << gauge.second << std::endl;
+  }
+  return out.str();
+}
+
+/**
+ * Constructor.
+ */
+MetricsDriver::MetricsDriver()
+    : registry(std::make_shared<Registry>()),
+      last_read(std::chrono::steady_clock::now()) {
+  this->registry->id = next_registry_id++;
+}
+
+/**
+ * Destructor. Stops the dump thread, if any.
+ */
+MetricsDriver::~MetricsDriver() {
+  {
+    std::unique_lock<std::mutex> lck(this->dump_mtx);
+    this->stopping = true;
+  }
+  this->dump_wake.notify_all();
+  if (this->dumper.joinable())
+    this->dumper.join();
+}
+
+void MetricsDriver::connection_opened() {
+  this->local().connections_opened.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MetricsDriver::connection_closed() {
+  this->local().connections_closed.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MetricsDriver::query_served() {
+  this->local().queries.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MetricsDriver::error() {
+  this->local().errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Record how long one phase took.
+ */
+void MetricsDriver::observe(ServerPhase phase,
+                            std::chrono::steady_clock::duration elapsed) {
+  double ms = std::chrono::duration<double, std::milli>(elapsed).count();
+  std::size_t bucket =
+      std::lower_bound(LATENCY_BUCKETS_MS.begin(), LATENCY_BUCKETS_MS.end(),
+                       ms) -
+      LATENCY_BUCKETS_MS.begin();
+  Shard &shard = this->local();
+  int k = static_cast<int>(phase);
+  shard.phase_counts[k][bucket].fetch_add(1, std::memory_order_relaxed);
+  shard.phase_sum_us[k].fetch_add(
+      std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count(),
+      std::memory_order_relaxed);
+}
+
+/**
+ * Merge every shard into one snapshot. Shards keep the counts of every
+ * thread that has held them.
+ */
+MetricsSnapshot MetricsDriver::read() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  MetricsSnapshot total;
+  {
+    std::unique_lock<std::mutex> registry_lck(this->registry->mtx);
+    for (auto &shard : this->registry->shards)
+      add(total, *shard);
+  }
+  total.evaluation_seconds =
+      total.phases[static_cast<int>(ServerPhase::EVALUATE)].sum_ms / 1000;
+
+  auto now = std::chrono::steady_clock::now();
+  double interval =
+      std::chrono::duration<double>(now - this->last_read).count();
+  if (interval > 0) {
+    total.queries_per_second = (total.queries - this->last_queries) / interval;
+    total.evaluation_utilization =
+        (total.evaluation_seconds - this->last_evaluation_seconds) / interval;
+  }
+  this->last_read = now;
+  this->last_queries = total.queries;
+  this->last_evaluation_seconds = total.evaluation_seconds;
+  return total;
+}
+
+/**
+ * Number of shards, held or free.
+ */
+std::size_t MetricsDriver::shard_count() {
+  std::unique_lock<std::mutex> lck(this->registry->mtx);
+  return this->registry->shards.size();
+}
+
+/**
+ * Every interval, write render() to filename. The file is replaced
+ * atomically, so a scraper never sees a partial write.
+ */
+void MetricsDriver::start_dump(std::string filename,
+                               std::function<std::string()> render,
+                               std::chrono::milliseconds interval) {
+  if (this->dumper.joinable())
+    throw std::runtime_error("Metrics dump already running");
+  this->dumper = std::thread([this, filename, render, interval]() {
+    std::unique_lock<std::mutex> lck(this->dump_mtx);
+    while (!this->dump_wake.wait_for(lck, interval,
+                                     [this] { return this->stopping; })) {
+      lck.unlock();
+      std::string tmp = filename + ".tmp";
+      {
+        std::ofstream file(tmp, std::ios::trunc);
+        file << render();
+      }
+      if (std::rename(tmp.c_str(), filename.c_str()) != 0)
+        std::cerr << "Failed to write metrics to " << filename << std::endl;
+      lck.lock();
+    }
+  });
+}
+
+/**
+ * This thread's shard: one it already holds, a free one, or a new one.
+ */
+MetricsDriver::Shard &MetricsDriver::local() {
+  for (ThreadShards::Held &held : thread_shards.held)
+    if (held.registry_id == this->registry->id)
+      return *held.shard;
+
+  std::shared_ptr<Shard> shard;
+  {
+    std::unique_lock<std::mutex> lck(this->registry->mtx);
+    if (!this->registry->free.empty()) {
+      shard = this->registry->free.back();
+      this->registry->free.pop_back();
+    } else {
+      shard = std::make_shared<Shard>();
+      this->registry->shards.push_back(shard);
+    }
+  }
+  thread_shards.held.push_back({this->registry->id, this->registry, shard});
+  return *shard;
+}
+
+/**
+ * Add one shard's counters to a snapshot.
+ */
+void MetricsDriver::add(MetricsSnapshot &total, const Shard &shard) {
+  total.connections_opened +=
+      shard.connections_opened.load(std::memory_order_relaxed);
+  total.connections_closed +=
+      shard.connections_closed.load(std::memory_order_relaxed);
+  total.queries += shard.queries.load(std::memory_order_relaxed);
+  total.errors += shard.errors.load(std::memory_order_relaxed);
+  for (int k = 0; k < SERVER_PHASE_COUNT; k++) {
+    for (std::size_t i = 0; i < BUCKET_COUNT; i++)
+      total.phases[k].counts[i] +=
+          shard.phase_counts[k][i].load(std::memory_order_relaxed);
+    total.phases[k].sum_ms +=
+        shard.phase_sum_us[k].load(std::memory_order_relaxed) / 1000.0;
+  }
+}
@@ -51,6 +51,9 @@ void NetworkDriverImpl::send(std::vector<unsigned char> data) {
   int length = htonl(data.size());
   boost::asio::write(*this->socket, boost::asio::buffer(&length, sizeof(int)));
   boost::asio::write(*this->socket, boost::asio::buffer(data));
+  this->stats.record_send(this->phase, sizeof(int) + data.size());
+  process_traffic().record_send(this->phase, sizeof(int) + data.size());
+  this->awaiting_reply = true;
 }
 
 /**
@@ -77,6 +80,14 @@ std::vector<unsigned char> NetworkDriverImpl::read() {
   if (error) {
     throw std::runtime_error("Received EOF.");
   }
+  this->stats.record_read(this->phase, sizeof(int) + data.size());
+  process_traffic().record_read(this->phase, sizeof(int) + data.size());
+  // The first read after any number of sends completes a round trip.
+  if (this->awaiting_reply) {
+    this->stats.record_round_trip();
+    process_traffic().record_round_trip();
+    this->awaiting_reply = false;
+  }
   return data;
 }
 
@@ -87,3 +98,13 @@ std::string NetworkDriverImpl::get_remote_info() {
   return this->socket->remote_endpoint().address().to_string() + ":" +
          std::to_string(this->socket->remote_endpoint().port());
 }
+
+/**
+ * Attribute traffic from now on to the given phase.
+ */
+void NetworkDriverImpl::set_phase(std::string phase) { this->phase = phase; }
+
+/**
+ * Wire traffic of this connection.
+ */
+TrafficStats &NetworkDriverImpl::traffic() { return this->stats; }
@@ -0,0 +1,392 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../../include/drivers/loader_driver.hpp"
+#include "../../include/drivers/persistence_driver.hpp"
+
+namespace {
+void write_u64(std::ostream &out, std::uint64_t x) {
+  out.write(reinterpret_cast<const char *>(&x), sizeof(x));
+}
+
+/**
+ * Read the 8-byte field at offset n and advance past it, or return false if
+ * the buffer ends first.
+ */
+bool read_u64(const char *data, std::size_t size, std::size_t &n,
+              std::uint64_t &x) {
+  if (size < sizeof(x) || n > size - sizeof(x))
+    return false;
+  std::memcpy(&x, data + n, sizeof(x));
+  n += sizeof(x);
+  return true;
+}
+
+bool file_exists(const std::string &filename) {
+  struct stat st;
+  return stat(filename.c_str(), &st) == 0;
+}
+
+/**
+ * Flush a file, or a directory's entries, to disk.
+ */
+void sync_path(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  bool synced = fd >= 0 && fsync(fd) == 0;
+  if (fd >= 0)
+    close(fd);
+  if (!synced)
+    throw std::runtime_error("Unable to sync file: " + path);
+}
+
+/**
+ * Directory holding path, for syncing a rename into it.
+ */
+std::string parent_directory(const std::string &path) {
+  std::size_t slash = path.rfind('/');
+  if (slash == std::string::npos)
+    return ".";
+  return slash == 0 ? "/" : path.substr(0, slash);
+}
+} // namespace
+
+/**
+ * Constructor. The snapshot lives at path and the log at path.log. Nothing
+ * is read or written until restore().
+ */
+PersistenceDriver::PersistenceDriver(
+    std::shared_ptr<HypercubeDriver> hypercube_driver, std::string path,
+    std::size_t max_log_bytes, int threads) {
+  this->hypercube_driver = hypercube_driver;
+  this->snapshot_path = path;
+  this->log_path = path + ".log";
+  this->max_log_bytes = max_log_bytes;
+  this->threads = threads;
+}
+
+/**
+ * Destructor. Stops logging and waits for a snapshot being written, if any.
+ */
+PersistenceDriver::~PersistenceDriver() {
+  this->hypercube_driver->set_journal(nullptr);
+  {
+    std::unique_lock<std::mutex> lck(this->mtx);
+    this->stopping = true;
+  }
+  this->wake.notify_all();
+  if (this->compactor.joinable())
+    this->compactor.join();
+  if (this->log_fd >= 0)
+    close(this->log_fd);
+}
+
+/**
+ * Load the snapshot and replay the log written since, if they exist, then
+ * log every version published from now on. The database keeps the version
+ * it had when last logged. Returns that version.
+ */
+std::uint64_t PersistenceDriver::restore() {
+  const HypercubeGeometry &geometry = this->hypercube_driver->geometry();
+  const RecordLayout &layout = this->hypercube_driver->layout();
+  std::uint64_t q = this->hypercube_driver->modulus();
+  std::size_t entries = geometry.size();
+  std::size_t page_count = (entries + HypercubeSnapshot::PAGE_ENTRIES - 1) /
+                           HypercubeSnapshot::PAGE_ENTRIES;
+
+  std::unique_ptr<MappedFile> snapshot;
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> pages;
+  std::uint64_t version = 0;
+  if (file_exists(this->snapshot_path)) {
+    snapshot = std::make_unique<MappedFile>(this->snapshot_path);
+    const char *data = snapshot->data();
+    std::size_t size = snapshot->size();
+    std::size_t n = sizeof(SNAPSHOT_MAGIC);
+    if (size < n || std::memcmp(data, SNAPSHOT_MAGIC, n) != 0)
+      throw std::runtime_error("Not a snapshot file: " + this->snapshot_path);
+
+    std::vector<std::uint64_t> expected = {
+        q, (std::uint64_t)PackedValueStore(0, q, 0).width(), layout.coeffs,
+        entries, (std::uint64_t)geometry.dimension()};
+    for (int side : geometry.shape())
+      expected.push_back(side);
+    expected.push_back(page_count);
+    std::uint64_t field;
+    if (!read_u64(data, size, n, version))
+      throw std::runtime_error("Truncated snapshot: " + this->snapshot_path);
+    for (std::uint64_t want : expected) {
+      if (!read_u64(data, size, n, field))
+        throw std::runtime_error("Truncated snapshot: " + this->snapshot_path);
+      if (field != want)
+        throw std::runtime_error("Snapshot does not match database shape: " +
+                                 this->snapshot_path);
+    }
+
+    for (std::size_t p = 0; p < page_count; p++) {
+      std::size_t page_bytes =
+          std::min(HypercubeSnapshot::PAGE_ENTRIES,
+                   entries - p * HypercubeSnapshot::PAGE_ENTRIES) *
+          layout.coeffs * PackedValueStore(0, q, 0).width();
+      std::uint64_t offset, populated;
+      if (!read_u64(data, size, n, offset) ||
+          !read_u64(data, size, n, populated) ||
+          (populated > 0 &&
+           (offset > size || size - offset < page_bytes)))
+        throw std::runtime_error("Truncated snapshot: " + this->snapshot_path);
+      pages.push_back({offset, populated});
+    }
+  }
+
+  // Updates logged after the snapshot, oldest first. A record cut short by a
+  // crash ends the log, and is cut off it so later records follow the last
+  // complete one.
+  EntryUpdates updates;
+  std::size_t log_end = 0, log_complete = 0;
+  if (file_exists(this->log_path)) {
+    MappedFile log(this->log_path);
+    const char *data = log.data();
+    std::size_t size = log.size();
+    std::size_t n = 0;
+    log_end = size;
+    std::uint64_t record_version, count;
+    while (read_u64(data, size, n, record_version) &&
+           read_u64(data, size, n, count)) {
+      EntryUpdates record;
+      bool complete = true;
+      for (std::uint64_t i = 0; complete && i < count; i++) {
+        std::uint64_t idx, coeff_count;
+        complete = read_u64(data, size, n, idx) &&
+                   read_u64(data, size, n, coeff_count) &&
+                   coeff_count <= layout.coeffs;
+        std::vector<std::uint64_t> coeffs(complete ? coeff_count : 0);
+        for (std::uint64_t &coeff : coeffs)
+          complete = complete && read_u64(data, size, n, coeff);
+        record.push_back({(int)idx, std::move(coeffs)});
+      }
+      if (!complete)
+        break;
+      log_complete = n;
+      if (record_version <= version)
+        continue;
+      version = record_version;
+      updates.insert(updates.end(), std::make_move_iterator(record.begin()),
+                     std::make_move_iterator(record.end()));
+    }
+  }
+
+  if (snapshot || !updates.empty()) {
+    const char *data = snapshot ? snapshot->data() : nullptr;
+    this->hypercube_driver->restore(
+        version,
+        [&](std::size_t p, PackedValueStore &values) {
+          if (!data || pages[p].second == 0)
+            return false;
+          values.assign(
+              reinterpret_cast<const unsigned char *>(data + pages[p].first));
+          return true;
+        },
+        updates, this->threads);
+  }
+
+  if (log_complete < log_end) {
+    if (truncate(this->log_path.c_str(), log_complete) != 0)
+      throw std::runtime_error("Unable to truncate file: " + this->log_path);
+    sync_path(this->log_path);
+  }
+  {
+    std::unique_lock<std::mutex> lck(this->mtx);
+    this->open_log(false);
+  }
+  this->compactor = std::thread(&PersistenceDriver::run, this);
+  this->hypercube_driver->set_journal(
+      [this](std::uint64_t version, const EntryUpdates *updates) {
+        this->append(version, updates);
+      });
+  return version;
+}
+
+/**
+ * Write a snapshot of the current database and start a new log. Returns the
+ * version saved.
+ */
+std::uint64_t PersistenceDriver::save() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  return this->write_snapshot();
+}
+
+/**
+ * Size of the log since the last snapshot.
+ */
+std::size_t PersistenceDriver::log_bytes() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  return this->log_size;
+}
+
+/**
+ * Open the log for appending, emptying it first if asked. Must be called
+ * with mtx held.
+ */
+void PersistenceDriver::open_log(bool empty) {
+  if (this->log_fd >= 0)
+    close(this->log_fd);
+  this->log_fd = open(this->log_path.c_str(),
+                      O_WRONLY | O_CREAT | O_APPEND | (empty ? O_TRUNC : 0),
+                      0644);
+  if (this->log_fd < 0)
+    throw std::runtime_error("Unable to open file: " + this->log_path);
+  off_t end = lseek(this->log_fd, 0, SEEK_END);
+  this->log_size = end > 0 ? end : 0;
+}
+
+/**
+ * Journal callback: log the updates of a version about to be published, so
+ * a version is only published once it is on disk. A replaced database,
+ * already published, cannot be logged entry by entry, so it is snapshotted
+ * before any later version is published. If the log cannot be written, the
+ * driver fails: every later update is refused, leaving the database
+ * read-only rather than ahead of what is on disk.
+ */
+void PersistenceDriver::append(std::uint64_t version,
+                               const EntryUpdates *updates) {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  if (this->failed)
+    throw std::runtime_error("Persistence failed; database is read-only");
+  if (!updates) {
+    try {
+      this->write_snapshot();
+    } catch (std::exception &e) {
+      this->failed = true;
+      std::cerr << "Failed to write snapshot: " << e.what() << std::endl;
+    }
+    return;
+  }
+  std::ostringstream record;
+  write_u64(record, version);
+  write_u64(record, updates->size());
+  for (auto &update : *updates) {
+    write_u64(record, update.first);
+    write_u64(record, update.second.size());
+    for (std::uint64_t coeff : update.second)
+      write_u64(record, coeff);
+  }
+  std::string bytes = record.str();
+  std::size_t written = 0;
+  while (written < bytes.size()) {
+    ssize_t n = write(this->log_fd, bytes.data() + written,
+                      bytes.size() - written);
+    if (n < 0)
+      break;
+    written += n;
+  }
+  if (written < bytes.size() || fsync(this->log_fd) != 0) {
+    // Take back what was written, so the refused version is not replayed.
+    if (ftruncate(this->log_fd, this->log_size) != 0 ||
+        fsync(this->log_fd) != 0)
+      std::cerr << "Unable to truncate file: " << this->log_path << std::endl;
+    this->failed = true;
+    throw std::runtime_error("Unable to write file: " + this->log_path);
+  }
+  this->log_size += bytes.size();
+  this->logged_version = version;
+  if (this->log_size >= this->max_log_bytes && !this->compacting) {
+    this->compacting = true;
+    this->wake.notify_all();
+  }
+}
+
+/**
+ * Write the current snapshot to a temporary file, move it over the old one
+ * and truncate the log. Must be called with mtx held; versions published in
+ * the meantime wait to be logged until the new log is in place.
+ */
+std::uint64_t PersistenceDriver::write_snapshot() {
+  // The last version logged is published right after it is logged; the new
+  // snapshot must include it before the log is emptied.
+  std::shared_ptr<const HypercubeSnapshot> snapshot =
+      this->hypercube_driver->snapshot();
+  while (snapshot->version < this->logged_version) {
+    std::this_thread::yield();
+    snapshot = this->hypercube_driver->snapshot();
+  }
+  const HypercubeGeometry &geometry = this->hypercube_driver->geometry();
+  std::uint64_t q = this->hypercube_driver->modulus();
+  std::string temp_path = this->snapshot_path + ".tmp";
+  std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+    throw std::runtime_error("Unable to open file: " + temp_path);
+
+  file.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  write_u64(file, snapshot->version);
+  write_u64(file, q);
+  write_u64(file, PackedValueStore(0, q, 0).width());
+  write_u64(file, snapshot->layout.coeffs);
+  write_u64(file, snapshot->entries);
+  write_u64(file, geometry.dimension());
+  for (int side : geometry.shape())
+    write_u64(file, side);
+  write_u64(file, snapshot->pages.size());
+
+  // Lay the non-empty pages out after the page table.
+  auto align = [](std::uint64_t offset) {
+    return (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT *
+           SNAPSHOT_ALIGNMENT;
+  };
+  std::uint64_t offset = align((std::uint64_t)file.tellp() +
+                               snapshot->pages.size() * 2 * sizeof(offset));
+  std::vector<std::uint64_t> offsets;
+  for (auto &page : snapshot->pages) {
+    bool empty = page->occupied.empty();
+    offsets.push_back(empty ? 0 : offset);
+    write_u64(file, empty ? 0 : offset);
+    write_u64(file, page->occupied.size());
+    if (!empty)
+      offset = align(offset + page->values.size() * page->values.width());
+  }
+  for (std::size_t p = 0; p < snapshot->pages.size(); p++) {
+    const PackedValueStore &values = snapshot->pages[p]->values;
+    if (offsets[p] == 0)
+      continue;
+    while ((std::uint64_t)file.tellp() < offsets[p])
+      file.put(0);
+    file.write(reinterpret_cast<const char *>(values.data()),
+               values.size() * values.width());
+  }
+  file.close();
+  if (!file)
+    throw std::runtime_error("Unable to write file: " + temp_path);
+  // The snapshot must be on disk before it replaces the old one, and the
+  // rename before the log it makes redundant is emptied.
+  sync_path(temp_path);
+  if (std::rename(temp_path.c_str(), this->snapshot_path.c_str()) != 0)
+    throw std::runtime_error("Unable to write file: " + this->snapshot_path);
+  sync_path(parent_directory(this->snapshot_path));
+
+  this->open_log(true);
+  return snapshot->version;
+}
+
+/**
+ * Compactor loop. Writes a snapshot whenever the log grows too large.
+ */
+void PersistenceDriver::run() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  while (true) {
+    this->wake.wait(lck, [this] { return this->stopping || this->compacting; });
+    if (this->stopping)
+      return;
+    try {
+      this->write_snapshot();
+    } catch (std::exception &e) {
+      std::cerr << "Failed to write snapshot: " << e.what() << std::endl;
+    }
+    this->compacting = false;
+  }
+}
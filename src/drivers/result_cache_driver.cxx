@@ -0,0 +1,112 @@
+#include "../../include/drivers/result_cache_driver.hpp"
+
+/**
+ * Constructor. A capacity of zero disables the cache.
+ */
+ResultCacheDriver::ResultCacheDriver(std::size_t capacity,
+                                     std::chrono::milliseconds max_age)
+    : capacity(capacity), max_age(max_age) {}
+
+/**
+ * Whether any result, current or not, is cached for key. Lets the caller
+ * skip asking for epochs when a lookup is bound to miss.
+ */
+bool ResultCacheDriver::contains(int key) {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  return this->index.count(key) > 0;
+}
+
+/**
+ * Copy the cached result for key into result, if it is still current: it
+ * came from the given cloud at its current epoch and is not too old. Stale
+ * results are dropped.
+ */
+bool ResultCacheDriver::lookup(int key, int cloud, const CloudEpoch &epoch,
+                               std::vector<seal::Plaintext> &result) {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  auto found = this->index.find(key);
+  if (found == this->index.end()) {
+    this->miss_count++;
+    return false;
+  }
+  std::list<Entry>::iterator entry = found->second;
+  if (entry->cloud != cloud || entry->epoch != epoch ||
+      std::chrono::steady_clock::now() - entry->stored > this->max_age) {
+    this->entries.erase(entry);
+    this->index.erase(found);
+    this->miss_count++;
+    return false;
+  }
+  this->entries.splice(this->entries.begin(), this->entries, entry);
+  result = entry->result;
+  this->hit_count++;
+  return true;
+}
+
+/**
+ * Cache a result the cloud computed at the given epoch.
+ */
+void ResultCacheDriver::store(int key, int cloud, const CloudEpoch &epoch,
+                              std::vector<seal::Plaintext> result) {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  if (this->capacity == 0)
+    return;
+  auto found = this->index.find(key);
+  if (found != this->index.end()) {
+    this->entries.erase(found->second);
+    this->index.erase(found);
+  }
+  this->entries.push_front({key, cloud, epoch,
+                            std::chrono::steady_clock::now(),
+                            std::move(result)});
+  this->index[key] = this->entries.begin();
+  while (this->entries.size() > this->capacity) {
+    this->index.erase(this->entries.back().key);
+    this->entries.pop_back();
+  }
+}
+
+/**
+ * Forget the result for key, e.g. after writing to it.
+ */
+void ResultCacheDriver::invalidate(int key) {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  auto found = this->index.find(key);
+  if (found == this->index.end())
+    return;
+  this->entries.erase(found->second);
+  this->index.erase(found);
+}
+
+/**
+ * Drop every result, e.g. when the agent moves to another database.
+ */
+void ResultCacheDriver::clear() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  this->entries.clear();
+  this->index.clear();
+}
+
+/**
+ * Number of cached results, current or not.
+ */
+std::size_t ResultCacheDriver::size() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  return this->entries.size();
+}
+
+/**
+ * Lookups served from the cache.
+ */
+std::uint64_t ResultCacheDriver::hits() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  return this->hit_count;
+}
+
+/**
+ * Lookups that had to go to the cloud.
+ */
+std::uint64_t ResultCacheDriver::misses() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  return this->miss_count;
+}
@@ -0,0 +1,105 @@
+#include <algorithm>
+
+#include "../../include/drivers/thread_pool_driver.hpp"
+
+/**
+ * Constructor. Starts threads - 1 workers; the thread calling run() is the
+ * last one. Zero means one per hardware thread.
+ */
+ThreadPoolDriver::ThreadPoolDriver(int threads) {
+  if (threads <= 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  for (int i = 1; i < threads; i++)
+    this->workers.emplace_back(&ThreadPoolDriver::work, this);
+}
+
+/**
+ * Destructor. Stops and joins the workers.
+ */
+ThreadPoolDriver::~ThreadPoolDriver() {
+  {
+    std::unique_lock<std::mutex> lck(this->mtx);
+    this->stopping = true;
+  }
+  this->wake.notify_all();
+  for (std::thread &worker : this->workers)
+    worker.join();
+}
+
+/**
+ * Call fn(begin, end) over ranges covering [0, count), in parallel, and wait
+ * for all of them. The first exception thrown by any range is rethrown once
+ * every range has finished.
+ */
+void ThreadPoolDriver::run(
+    std::size_t count,
+    const std::function<void(std::size_t, std::size_t)> &fn) {
+  if (count == 0)
+    return;
+  if (count == 1 || this->workers.empty()) {
+    fn(0, count);
+    return;
+  }
+
+  std::unique_lock<std::mutex> run_lck(this->run_mtx);
+  std::unique_lock<std::mutex> lck(this->mtx);
+  this->job = &fn;
+  this->count = count;
+  this->chunks = std::min<std::size_t>(count, this->size());
+  this->next_chunk = 0;
+  this->finished = 0;
+  this->error = nullptr;
+  this->wake.notify_all();
+  while (this->run_chunk(lck))
+    ;
+  this->done.wait(lck, [this] { return this->finished == this->chunks; });
+  this->job = nullptr;
+  std::exception_ptr error = this->error;
+  lck.unlock();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+/**
+ * Claim and run the next range of the current loop, if any is left. Must be
+ * called with mtx held; it is released while the range runs.
+ */
+bool ThreadPoolDriver::run_chunk(std::unique_lock<std::mutex> &lck) {
+  if (!this->job || this->next_chunk >= this->chunks)
+    return false;
+  std::size_t k = this->next_chunk++;
+  std::size_t begin = this->count * k / this->chunks;
+  std::size_t end = this->count * (k + 1) / this->chunks;
+  const std::function<void(std::size_t, std::size_t)> *job = this->job;
+  lck.unlock();
+
+  std::exception_ptr error;
+  try {
+    (*job)(begin, end);
+  } catch (...) {
+    error = std::current_exception();
+  }
+
+  lck.lock();
+  if (error && !this->error)
+    this->error = error;
+  if (++this->finished == this->chunks)
+    this->done.notify_all();
+  return true;
+}
+
+/**
+ * Worker loop. Runs ranges of whichever loop is in progress.
+ */
+void ThreadPoolDriver::work() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  while (true) {
+    this->wake.wait(lck, [this] {
+      return this->stopping ||
+             (this->job && this->next_chunk < this->chunks);
+    });
+    if (this->stopping)
+      return;
+    this->run_chunk(lck);
+  }
+}
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "../../include/drivers/trace_driver.hpp"
+
+/**
+ * Fixed-size ring of spans written by one thread at a time. A slot's
+ * sequence number is odd while it is being written and 2 * (n + 1) once it
+ * holds the n-th span written to the ring.
+ */
+struct TraceDriver::Ring {
+  struct Slot {
+    std::atomic<std::uint64_t> sequence{0};
+    std::atomic<std::uint32_t> name{0};
+    std::atomic<std::uint64_t> query{0};
+    std::atomic<std::int64_t> start_ns{0};
+    std::atomic<std::int64_t> end_ns{0};
+  };
+
+  Ring(std::size_t capacity, int thread)
+      : slots(new Slot[capacity]), capacity(capacity), thread(thread) {}
+
+  std::unique_ptr<Slot[]> slots;
+  std::size_t capacity;
+  int thread;
+  std::atomic<std::uint64_t> head{0};
+};
+
+/**
+ * Every ring of one driver, and those free for reuse. Shared with the
+ * threads holding rings, which hand them back when they exit.
+ */
+struct TraceDriver::Registry {
+  std::uint64_t id;
+  std::size_t ring_events;
+  std::mutex mtx;
+  std::vector<std::shared_ptr<Ring>> rings;
+  std::vector<std::shared_ptr<Ring>> free;
+};
+
+namespace {
+std::atomic<std::uint64_t> next_registry_id{0};
+
+std::mutex names_mtx;
+std::vector<std::string> &names() {
+  static std::vector<std::string> names;
+  return names;
+}
+
+/**
+ * Rings this thread holds, one per trace driver it has recorded into.
+ */
+struct ThreadRings {
+  struct Held {
+    std::uint64_t registry_id;
+    std::weak_ptr<TraceDriver::Registry> registry;
+    std::shared_ptr<TraceDriver::Ring> ring;
+  };
+  std::vector<Held> held;
+
+  ~ThreadRings() {
+    for (Held &h : this->held)
+      if (auto registry = h.registry.lock()) {
+        std::unique_lock<std::mutex> lck(registry->mtx);
+        registry->free.push_back(h.ring);
+      }
+  }
+};
+thread_local ThreadRings thread_rings;
+
+std::string json_escape(const std::string &s) {
+  std::string out;
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      out += '\\';
+    out += c;
+  }
+  return out;
+}
+} // namespace
+
+std::uint32_t trace_name(const std::string &name) {
+  std::unique_lock<std::mutex> lck(names_mtx);
+  std::vector<std::string> &table = names();
+  auto it = std::find(table.begin(), table.end(), name);
+  if (it != table.end())
+    return it - table.begin();
+  table.push_back(name);
+  return table.size() - 1;
+}
+
+std::string trace_name_text(std::uint32_t id) {
+  std::unique_lock<std::mutex> lck(names_mtx);
+  return id < names().size() ? names()[id] : "unknown";
+}
+
+/**
+ * Constructor.
+ */
+TraceDriver::TraceDriver(std::size_t ring_events)
+    : registry(std::make_shared<Registry>()), epoch(clock::now()) {
+  if (ring_events == 0)
+    throw std::runtime_error("Trace rings need at least one event");
+  this->registry->id = next_registry_id++;
+  this->registry->ring_events = ring_events;
+}
+
+/**
+ * A fresh id to tag one query's spans with. Ids start at 1.
+ */
+std::uint64_t TraceDriver::next_query() { return ++this->queries; }
+
+/**
+ * Record one span into this thread's ring.
+ */
+void TraceDriver::record(std::uint32_t name, std::uint64_t query,
+                         clock::time_point start, clock::time_point end) {
+  Ring &ring = this->local();
+  std::uint64_t n = ring.head.load(std::memory_order_relaxed);
+  Ring::Slot &slot = ring.slots[n % ring.capacity];
+  slot.sequence.store(2 * n + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.name.store(name, std::memory_order_relaxed);
+  slot.query.store(query, std::memory_order_relaxed);
+  slot.start_ns.store(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(start - this->epoch)
+          .count(),
+      std::memory_order_relaxed);
+  slot.end_ns.store(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - this->epoch)
+          .count(),
+      std::memory_order_relaxed);
+  slot.sequence.store(2 * n + 2, std::memory_order_release);
+  ring.head.store(n + 1, std::memory_order_release);
+}
+
+/**
+ * Copy out the spans still buffered, ordered by start time. A nonzero query
+ * keeps only that query's spans.
+ */
+std::vector<TraceEvent> TraceDriver::events(std::uint64_t query) {
+  std::vector<std::shared_ptr<Ring>> rings;
+  {
+    std::unique_lock<std::mutex> lck(this->registry->mtx);
+    rings = this->registry->rings;
+  }
+  std::vector<TraceEvent> events;
+  for (std::shared_ptr<Ring> &ring : rings) {
+    std::uint64_t head = ring->head.load(std::memory_order_acquire);
+    std::uint64_t first = head > ring->capacity ? head - ring->capacity : 0;
+    for (std::uint64_t n = first; n < head; n++) {
+      Ring::Slot &slot = ring->slots[n % ring->capacity];
+      std::uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+      if (sequence != 2 * n + 2)
+        continue;
+      std::uint32_t name = slot.name.load(std::memory_order_relaxed);
+      std::uint64_t span_query = slot.query.load(std::memory_order_relaxed);
+      std::int64_t start = slot.start_ns.load(std::memory_order_relaxed);
+      std::int64_t end = slot.end_ns.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+        continue;
+      if (query != 0 && span_query != query)
+        continue;
+      events.push_back(
+          {trace_name_text(name), span_query, ring->thread, start, end});
+    }
+  }
+  std::sort(events.begin(), events.end(),
+            [](const TraceEvent &a, const TraceEvent &b) {
+              return a.start_ns < b.start_ns;
+            });
+  return events;
+}
+
+/**
+ * Buffered spans in Chrome trace-event JSON, loadable in chrome://tracing
+ * or Perfetto.
+ */
+std::string TraceDriver::chrome_json(std::uint64_t query) {
+  std::ostringstream out;
+  out << "{\"traceEvents\": [";
+  std::vector<TraceEvent> events = this->events(query);
+  for (std::size_t i = 0; i < events.size(); i++) {
+    const TraceEvent &event = events[i];
+    out << (i ? "," : "") << std::endl
+        << "  {\"name\": \"" << json_escape(event.name)
+        << "\", \"cat\": \"pir\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+        << event.thread << ", \"ts\": " << event.start_ns / 1000.0
+        << ", \"dur\": " << (event.end_ns - event.start_ns) / 1000.0
+        << ", \"args\": {\"query\": " << event.query << "}}";
+  }
+  out << std::endl << "], \"displayTimeUnit\": \"ms\"}" << std::endl;
+  return out.str();
+}
+
+/**
+ * Write chrome_json(query) to a file.
+ */
+void TraceDriver::dump(const std::string &filename, std::uint64_t query) {
+  std::ofstream file(filename, std::ios::trunc);
+  if (!file.is_open())
+    throw std::runtime_error("Unable to open file: " + filename);
+  file << this->chrome_json(query);
+}
+
+/**
+ * Dump the spans of every query slower than threshold to
+ * slow-query-<id>.json. Zero turns this off.
+ */
+void TraceDriver::set_slow_threshold(std::chrono::milliseconds threshold) {
+  this->slow_threshold_ms = threshold.count();
+}
+
+/**
+ * Record the span covering a whole query, and dump the query's spans if it
+ * was slow.
+ */
+void TraceDriver::finish_query(std::uint64_t query, clock::time_point start,
+                               clock::time_point end) {
+  static const std::uint32_t QUERY = trace_name("query");
+  this->record(QUERY, query, start, end);
+  std::int64_t threshold = this->slow_threshold_ms;
+  if (threshold > 0 && end - start >= std::chrono::milliseconds(threshold)) {
+    std::string filename = "slow-query-" + std::to_string(query) + ".json";
+    try {
+      this->dump(filename, query);
+    } catch (std::exception &e) {
+      std::cerr << "Failed to dump trace: " << e.what() << std::endl;
+    }
+  }
+}
+
+/**
+ * This thread's ring: one it already holds, a free one, or a new one.
+ */
+TraceDriver::Ring &TraceDriver::local() {
+  for (ThreadRings::Held &held : thread_rings.held)
+    if (held.registry_id == this->registry->id)
+      return *held.ring;
+
+  std::shared_ptr<Ring> ring;
+  {
+    std::unique_lock<std::mutex> lck(this->registry->mtx);
+    if (!this->registry->free.empty()) {
+      ring = this->registry->free.back();
+      this->registry->free.pop_back();
+    } else {
+      ring = std::make_shared<Ring>(this->registry->ring_events,
+                                    this->registry->rings.size());
+      this->registry->rings.push_back(ring);
+    }
+  }
+  thread_rings.held.push_back({this->registry->id, this->registry, ring});
+  return *ring;
+}
+
+TraceSpan::TraceSpan(TraceDriver *trace, std::uint32_t name,
+                     std::uint64_t query)
+    : trace(trace), name(name), query(query),
+      start(TraceDriver::clock::now()) {}
+
+TraceSpan::~TraceSpan() {
+  if (this->trace)
+    this->trace->record(this->name, this->query, this->start,
+                        TraceDriver::clock::now());
+}
@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "../../include-shared/util.hpp"
+#include "../../include/drivers/update_driver.hpp"
+
+/**
+ * Constructor. Starts the publisher thread.
+ */
+UpdateDriver::UpdateDriver(std::shared_ptr<HypercubeDriver> hypercube_driver,
+                           std::chrono::milliseconds debounce,
+                           std::chrono::milliseconds max_delay,
+                           std::size_t max_batch)
+    : hypercube_driver(hypercube_driver), debounce(debounce),
+      max_delay(max_delay), max_batch(std::max<std::size_t>(1, max_batch)) {
+  this->publisher = std::thread(&UpdateDriver::run, this);
+}
+
+/**
+ * Destructor. Publishes whatever is still pending, then stops the publisher.
+ */
+UpdateDriver::~UpdateDriver() {
+  {
+    std::unique_lock<std::mutex> lck(this->mtx);
+    this->stopping = true;
+  }
+  this->wake.notify_all();
+  this->publisher.join();
+}
+
+/**
+ * Queue x mod q for the given idx.
+ */
+void UpdateDriver::submit(int idx, std::uint64_t x) {
+  if (this->hypercube_driver->layout().record_size != 0)
+    throw std::runtime_error("Hypercube stores records");
+  this->enqueue(idx, {x % this->hypercube_driver->modulus()});
+}
+
+/**
+ * Queue a record for the given idx.
+ */
+void UpdateDriver::submit_record(int idx,
+                                 const std::vector<unsigned char> &record) {
+  const RecordLayout &layout = this->hypercube_driver->layout();
+  if (layout.record_size == 0)
+    throw std::runtime_error("Hypercube does not store records");
+  if (record.size() > layout.record_size)
+    throw std::runtime_error("Record too large");
+  this->enqueue(idx, encode_record(record, layout.bits_per_coeff));
+}
+
+/**
+ * Publish everything queued so far and wait until it is visible.
+ */
+void UpdateDriver::flush() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  this->flushes++;
+  this->wake.notify_all();
+  this->published.wait(lck, [this] {
+    return this->pending.empty() && !this->publishing;
+  });
+  this->flushes--;
+}
+
+/**
+ * Number of updates queued but not yet published.
+ */
+std::size_t UpdateDriver::pending_count() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  return this->pending.size();
+}
+
+/**
+ * Validate an update and add it to the pending batch. Bounds are checked
+ * here so the caller sees the error, not the publisher thread.
+ */
+void UpdateDriver::enqueue(int idx, std::vector<std::uint64_t> coeffs) {
+  if (!this->hypercube_driver->geometry().contains(idx))
+    throw std::runtime_error("Hypercube out of bounds");
+
+  std::unique_lock<std::mutex> lck(this->mtx);
+  auto now = std::chrono::steady_clock::now();
+  bool was_empty = this->pending.empty();
+  if (was_empty)
+    this->first_update = now;
+  this->last_update = now;
+  this->pending[idx] = std::move(coeffs);
+  // The publisher recomputes its deadline on its own; only wake it when a
+  // batch starts or fills up.
+  if (was_empty || this->pending.size() >= this->max_batch)
+    this->wake.notify_all();
+}
+
+/**
+ * Publisher loop. Waits for a burst of updates to go quiet (bounded by
+ * max_delay and max_batch), then publishes the whole batch as one snapshot
+ * while new updates keep queueing.
+ */
+void UpdateDriver::run() {
+  std::unique_lock<std::mutex> lck(this->mtx);
+  while (true) {
+    this->wake.wait(lck, [this] {
+      return this->stopping || !this->pending.empty();
+    });
+    if (this->pending.empty())
+      return;
+
+    auto deadline = this->first_update + this->max_delay;
+    while (!this->stopping && this->flushes == 0 &&
+           this->pending.size() < this->max_batch) {
+      auto until = std::min(this->last_update + this->debounce, deadline);
+      if (std::chrono::steady_clock::now() >= until)
+        break;
+      this->wake.wait_until(lck, until);
+    }
+
+    std::vector<std::pair<int, std::vector<std::uint64_t>>> batch(
+        std::make_move_iterator(this->pending.begin()),
+        std::make_move_iterator(this->pending.end()));
+    this->pending.clear();
+    this->publishing = true;
+    lck.unlock();
+    try {
+      this->hypercube_driver->apply(batch);
+    } catch (std::exception &e) {
+      std::cerr << "Failed to publish updates: " << e.what() << std::endl;
+    }
+    lck.lock();
+    this->publishing = false;
+    this->published.notify_all();
+  }
+}
@@ -0,0 +1,93 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "../../include/drivers/xor_driver.hpp"
+
+// Pages start on a byte boundary of the selection vector.
+static_assert(HypercubeSnapshot::PAGE_ENTRIES % 8 == 0);
+
+namespace {
+/**
+ * dst ^= src over n bytes, a word at a time so the compiler can vectorize.
+ */
+void xor_into(unsigned char *__restrict dst,
+              const unsigned char *__restrict src, std::size_t n) {
+  std::size_t i = 0;
+  for (; i + sizeof(std::uint64_t) <= n; i += sizeof(std::uint64_t)) {
+    std::uint64_t a, b;
+    std::memcpy(&a, dst + i, sizeof(a));
+    std::memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    std::memcpy(dst + i, &a, sizeof(a));
+  }
+  for (; i < n; i++)
+    dst[i] ^= src[i];
+}
+} // namespace
+
+/**
+ * Shares of the selection vector for entry idx. The first share is uniformly
+ * random; the second is the first with bit idx flipped.
+ */
+std::pair<std::vector<unsigned char>, std::vector<unsigned char>>
+xor_share_selection(std::size_t entries, std::size_t idx,
+                    CryptoPP::RandomNumberGenerator &rng) {
+  if (idx >= entries)
+    throw std::runtime_error("Hypercube out of bounds");
+  std::vector<unsigned char> a((entries + 7) / 8);
+  rng.GenerateBlock(a.data(), a.size());
+  // Keep padding bits zero so both shares are well formed.
+  if (entries % 8 != 0)
+    a.back() &= (1u << (entries % 8)) - 1;
+  std::vector<unsigned char> b = a;
+  b[idx / 8] ^= 1u << (idx % 8);
+  return std::make_pair(a, b);
+}
+
+/**
+ * XOR two answers and unpack little-endian coefficients of width bytes.
+ */
+std::vector<std::uint64_t> xor_combine(const std::vector<unsigned char> &a,
+                                       const std::vector<unsigned char> &b,
+                                       int width) {
+  if (a.size() != b.size() || a.size() % width != 0)
+    throw std::runtime_error("Mismatched XOR answers");
+  std::vector<unsigned char> bytes = a;
+  xor_into(bytes.data(), b.data(), bytes.size());
+  std::vector<std::uint64_t> coeffs(bytes.size() / width);
+  for (std::size_t k = 0; k < coeffs.size(); k++)
+    for (int j = 0; j < width; j++)
+      coeffs[k] |= static_cast<std::uint64_t>(bytes[k * width + j]) << (8 * j);
+  return coeffs;
+}
+
+/**
+ * XOR the rows of every entry whose bit is set. Rows are read straight from
+ * the pages' packed storage; zero bytes of the selection are skipped.
+ */
+std::vector<unsigned char>
+XorEvaluatorDriver::evaluate(const HypercubeSnapshot &snapshot,
+                             const std::vector<unsigned char> &selection) {
+  if (selection.size() != (snapshot.size() + 7) / 8)
+    throw std::runtime_error("Query does not match hypercube geometry");
+
+  std::size_t coeffs = snapshot.layout.coeffs;
+  std::size_t stride = coeffs * snapshot.pages[0]->values.width();
+  std::vector<unsigned char> answer(stride, 0);
+  for (std::size_t p = 0; p < snapshot.pages.size(); p++) {
+    const PackedValueStore &values = snapshot.pages[p]->values;
+    const unsigned char *rows = values.data();
+    std::size_t base = p * HypercubeSnapshot::PAGE_ENTRIES;
+    std::size_t n = values.size() / coeffs;
+    for (std::size_t byte = 0; byte * 8 < n; byte++) {
+      unsigned bits = selection[base / 8 + byte];
+      while (bits) {
+        std::size_t i = byte * 8 + __builtin_ctz(bits);
+        bits &= bits - 1;
+        if (i < n)
+          xor_into(answer.data(), rows + i * stride, stride);
+      }
+    }
+  }
+  return answer;
+}
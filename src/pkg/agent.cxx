@@ -1,9 +1,17 @@
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <sstream>
+#include <thread>
+
 #include "../../include/pkg/agent.hpp"
 #include "../../include-shared/constants.hpp"
 #include "../../include-shared/logger.hpp"
 #include "../../include-shared/util.hpp"
-#include "../../include/drivers/hypercube_driver.hpp"
+#include "../../include/drivers/hypercube_geometry.hpp"
+#include "../../include/drivers/keyword_driver.hpp"
 #include "../../include/drivers/repl_driver.hpp"
+#include "../../include/drivers/xor_driver.hpp"
 #include "../drivers/repl_driver.cxx"
 
 using namespace seal;
@@ -14,19 +22,100 @@ See logger.hpp for more modes besides 'debug'
 */
 namespace {
 src::severity_logger<logging::trivial::severity_level> lg;
+
+/**
+ * Split one connection's traffic into the parts of a QueryTraffic. The
+ * drivers must have been used for this connection only.
+ */
+QueryTraffic connection_traffic(std::shared_ptr<NetworkDriver> network_driver,
+                                std::shared_ptr<CryptoDriver> crypto_driver,
+                                const std::string &query_type,
+                                const std::string &response_type,
+                                std::uint64_t rks_size) {
+  TrafficStats &wire = network_driver->traffic();
+  TrafficStats &messages = crypto_driver->traffic();
+  QueryTraffic traffic;
+  traffic.bytes["handshake"] = wire.get("handshake").bytes();
+  traffic.bytes["relin_keys"] = rks_size;
+  traffic.bytes["selectors"] =
+      messages.get(query_type).bytes_sent - rks_size;
+  traffic.bytes["response"] = messages.get(response_type).bytes_received;
+  traffic.bytes["aead"] = messages.get("aead").bytes();
+  std::uint64_t accounted = traffic.total();
+  std::uint64_t total = wire.total().bytes();
+  traffic.bytes["framing"] = total > accounted ? total - accounted : 0;
+  traffic.round_trips = wire.round_trips();
+  return traffic;
+}
+} // namespace
+
+std::uint64_t QueryTraffic::total() const {
+  std::uint64_t total = 0;
+  for (auto &part : this->bytes)
+    total += part.second;
+  return total;
+}
+
+void QueryTraffic::merge(const QueryTraffic &other) {
+  for (auto &part : other.bytes)
+    this->bytes[part.first] += part.second;
+  this->round_trips += other.round_trips;
+}
+
+std::string QueryReport::summary() const {
+  if (this->cached)
+    return "Served from the result cache";
+  std::string summary = "Traffic: " + this->traffic.summary();
+  if (this->noise_budget >= 0)
+    summary += ", noise budget " + std::to_string(this->noise_budget) + " bits";
+  return summary;
+}
+
+std::string QueryTraffic::summary() const {
+  std::ostringstream out;
+  out << this->total() << " B in " << this->round_trips << " round trips (";
+  int i = 0;
+  for (auto &part : this->bytes)
+    out << (i++ ? ", " : "") << part.first << " " << part.second;
+  out << ")";
+  return out.str();
 }
 
 /**
  * Constructor
  */
-AgentClient::AgentClient(std::string address, int port, int d, int s) {
-  this->address = address;
-  this->port = port;
-  this->dimension = d;
-  this->sidelength = s;
+AgentClient::AgentClient(std::string address, int port, int d, int s)
+    : AgentClient({{address, port}}, d, s) {}
 
-  this->hypercube_driver = std::make_shared<HypercubeDriver>(
-      d, s, CryptoPP::Integer(PLAINTEXT_MODULUS));
+/**
+ * Constructor for a sharded deployment of s^d cubes.
+ */
+AgentClient::AgentClient(std::vector<std::pair<std::string, int>> shards,
+                         int d, int s, PirMode mode)
+    : AgentClient(shards, std::vector<int>(std::max(d, 0), s), mode) {}
+
+/**
+ * Constructor for a sharded deployment. Every shard holds a cube with the
+ * given side lengths, of n entries; shard k serves global indices
+ * [k * n, (k + 1) * n) from its own cube. In XOR mode, the two endpoints are
+ * replicas of the same cube instead.
+ */
+AgentClient::AgentClient(std::vector<std::pair<std::string, int>> shards,
+                         std::vector<int> sides, PirMode mode) {
+  if (shards.empty())
+    throw std::runtime_error("No shards given");
+  if (mode == PirMode::XOR && shards.size() != 2)
+    throw std::runtime_error("XOR mode needs exactly two replicas");
+  this->shards = shards;
+  this->mode = mode;
+  this->address = shards[0].first;
+  this->port = shards[0].second;
+
+  this->geometry = std::make_shared<HypercubeGeometry>(sides);
+  this->pool_driver = std::make_shared<ThreadPoolDriver>();
+  this->selector_zero = seal::Plaintext("0");
+  this->selector_one = seal::Plaintext("1");
+  this->cache_driver = std::make_shared<ResultCacheDriver>();
   this->cli_driver = std::make_shared<CLIDriver>();
   this->cli_driver->init();
   initLogger();
@@ -38,6 +127,12 @@ AgentClient::AgentClient(std::string address, int port, int d, int s) {
 void AgentClient::run() {
   REPLDriver<AgentClient> repl = REPLDriver<AgentClient>(this);
   repl.add_action("get", "get <key>", &AgentClient::HandleRetrieve);
+  repl.add_action("getrecord", "getrecord <key>",
+                  &AgentClient::HandleRetrieveRecord);
+  repl.add_action("kwget", "kwget <keyword>",
+                  &AgentClient::HandleKeywordRetrieve);
+  repl.add_action("traffic", "traffic", &AgentClient::HandleTraffic);
+  repl.add_action("cache", "cache", &AgentClient::HandleCache);
   repl.run();
 }
 
@@ -92,101 +187,412 @@ void AgentClient::HandleRetrieve(std::string input) {
   std::shared_ptr<CryptoDriver> crypto_driver =
       std::make_shared<CryptoDriver>();
   this->DoRetrieve(network_driver, crypto_driver, key);
+  this->cli_driver->print_info(this->last_query_report().summary());
 }
 
 /**
- * Privately retrieve a value from the cloud. This function should:
- * 0) Connect and handle key exchange.
- * 1) Generate parameters, context, and keys. See constants.hpp.
- * 2) Generate a selection vector based on the key's coordinates.
- * 3) Send the selection vector to the server and decode the response.
+ * Privately retrieve a record from the cloud.
  */
-CryptoPP::Integer
-AgentClient::DoRetrieve(std::shared_ptr<NetworkDriver> network_driver,
-                        std::shared_ptr<CryptoDriver> crypto_driver, int query) {
-  // Initialize drivers.
-  network_driver->connect(this->address, this->port);
+void AgentClient::HandleRetrieveRecord(std::string input) {
+  // Parse input.
+  std::vector<std::string> input_split = string_split(input, ' ');
+  if (input_split.size() != 2) {
+    this->cli_driver->print_left("invalid number of arguments.");
+    return;
+  }
+  int key = std::stoi(input_split[1]);
 
-  // Key exchange with server. From here on out, any outgoing messages should
-  // be encrypted and MAC tagged. Incoming messages should be decrypted and have
-  // their MAC checked.
-  auto keys = this->HandleKeyExchange(crypto_driver, network_driver);
-  //std::cout << "Connected and handled key exchange" << std::endl;
+  // Call retrieve
+  std::shared_ptr<NetworkDriver> network_driver =
+      std::make_shared<NetworkDriverImpl>();
+  std::shared_ptr<CryptoDriver> crypto_driver =
+      std::make_shared<CryptoDriver>();
+  std::vector<unsigned char> record =
+      this->DoRetrieveRecord(network_driver, crypto_driver, key);
+  this->cli_driver->print_success("Record: " + chvec2str(record));
+  this->cli_driver->print_info(this->last_query_report().summary());
+}
+
+/**
+ * Privately retrieve the value stored under a keyword.
+ */
+void AgentClient::HandleKeywordRetrieve(std::string input) {
+  // Parse input.
+  std::vector<std::string> input_split = string_split(input, ' ');
+  if (input_split.size() != 2) {
+    this->cli_driver->print_left("invalid number of arguments.");
+    return;
+  }
 
-  EncryptionParameters parms(scheme_type::bfv);
+  // Call retrieve
+  std::shared_ptr<NetworkDriver> network_driver =
+      std::make_shared<NetworkDriverImpl>();
+  std::shared_ptr<CryptoDriver> crypto_driver =
+      std::make_shared<CryptoDriver>();
+  auto value = this->DoKeywordRetrieve(
+      network_driver, crypto_driver, keyword_from_string(input_split[1]));
+  if (!value.second) {
+    this->cli_driver->print_warning("Keyword not found");
+    return;
+  }
+  this->cli_driver->print_success("Value: " + chvec2str(value.first));
+  this->cli_driver->print_info(this->last_query_report().summary());
+}
 
-  parms.set_poly_modulus_degree(POLY_MODULUS_DEGREE);
-  parms.set_coeff_modulus(CoeffModulus::BFVDefault(POLY_MODULUS_DEGREE));
-  parms.set_plain_modulus((PLAINTEXT_MODULUS));
+/**
+ * Print the traffic of every connection this process has made, by phase on
+ * the wire and by message type.
+ */
+void AgentClient::HandleTraffic(std::string input) {
+  this->cli_driver->print_left("Wire traffic by phase:\n" +
+                               process_traffic().summary());
+  this->cli_driver->print_left("Message traffic by type:\n" +
+                               process_message_traffic().summary());
+}
 
-  SEALContext context(parms);
+/**
+ * Print the result cache's size and hit rate.
+ */
+void AgentClient::HandleCache(std::string input) {
+  this->cli_driver->print_left(
+      "Result cache: " + std::to_string(this->cache_driver->size()) +
+      " results, " + std::to_string(this->cache_driver->hits()) + " hits, " +
+      std::to_string(this->cache_driver->misses()) + " misses");
+}
 
-  KeyGenerator keygen(context);
-  SecretKey secretKey = keygen.secret_key();
+/**
+ * Replace the result cache. A capacity of zero turns caching off, e.g. to
+ * measure the cloud rather than the cache.
+ */
+void AgentClient::SetResultCache(std::size_t capacity,
+                                 std::chrono::milliseconds max_age) {
+  this->cache_driver = std::make_shared<ResultCacheDriver>(capacity, max_age);
+}
 
-  seal::PublicKey publicKey;
-  keygen.create_public_key(publicKey);
-  seal::RelinKeys relinKeys;
-  keygen.create_relin_keys(relinKeys);
+/**
+ * Query and update another of the clouds' databases. Its geometry must match
+ * the one this agent was built with. Cached results belong to the old
+ * database, so the cache is emptied.
+ */
+void AgentClient::SetDatabase(std::string name) {
+  this->database = name;
+  this->cache_driver->clear();
+}
 
-  seal::Encryptor encryptor(context, publicKey);
-  seal::Decryptor decryptor(context, secretKey);
-  //std::cout << "Generated parameters, context, and keys" << std::endl;
+/**
+ * Privately retrieve a value from the cloud. The value is the constant
+ * coefficient of the first response plaintext.
+ */
+CryptoPP::Integer
+AgentClient::DoRetrieve(std::shared_ptr<NetworkDriver> network_driver,
+                        std::shared_ptr<CryptoDriver> crypto_driver, int query) {
+  std::vector<seal::Plaintext> plaintexts =
+      this->DoQuery(network_driver, crypto_driver, query);
+  std::uint64_t value = plaintexts[0].coeff_count() > 0 ? plaintexts[0][0] : 0;
+  std::cout << "Decoded the response " << value << std::endl;
+  return CryptoPP::Integer((signed long)value);
+}
+
+/**
+ * Privately retrieve a record from the cloud and return its original bytes.
+ */
+std::vector<unsigned char>
+AgentClient::DoRetrieveRecord(std::shared_ptr<NetworkDriver> network_driver,
+                              std::shared_ptr<CryptoDriver> crypto_driver,
+                              int query) {
+  std::vector<seal::Plaintext> plaintexts =
+      this->DoQuery(network_driver, crypto_driver, query);
+  return decode_record(plaintexts, plain_bits(PLAINTEXT_MODULUS),
+                       POLY_MODULUS_DEGREE);
+}
 
-  std::vector<int> coordinates = this->hypercube_driver->to_coords((query));
-  std::vector<int> indices(this->dimension*this->sidelength,0);
+/**
+ * Privately query the cloud for a single entry.
+ */
+std::vector<seal::Plaintext>
+AgentClient::DoQuery(std::shared_ptr<NetworkDriver> network_driver,
+                     std::shared_ptr<CryptoDriver> crypto_driver, int query) {
+  return this->DoBatchQuery(network_driver, crypto_driver, {query})[0];
+}
 
-  std::vector<seal::Ciphertext> ciphertexts(this->dimension*this->sidelength,Ciphertext());
-  //std::cout << "Indices [";
-  for (int i = 0; i < indices.size();i++) {
-    if (i%this->sidelength == coordinates[i/this->sidelength]) {
-      indices[i] = 1;
-    }
-    //std::cout << " " << indices[i] << ", ";
-    seal::Plaintext plain(std::to_string(indices[i]));
-    encryptor.encrypt(plain,ciphertexts[i]);
+/**
+ * Ask the cloud to insert a value. Inserts are not private: only the shard
+ * holding the key is contacted, or both replicas in XOR mode. Returns
+ * whether every contacted cloud accepted the insert.
+ */
+bool AgentClient::DoInsert(std::shared_ptr<NetworkDriver> network_driver,
+                           std::shared_ptr<CryptoDriver> crypto_driver,
+                           int key, std::uint64_t value) {
+  std::vector<std::pair<std::pair<std::string, int>, int>> targets;
+  if (this->mode == PirMode::XOR) {
+    if (!this->geometry->contains(key))
+      throw std::runtime_error("Hypercube out of bounds");
+    for (auto &replica : this->shards)
+      targets.push_back({replica, key});
+  } else {
+    std::pair<int, int> location = this->shard_of(key);
+    targets.push_back({this->shards[location.first], location.second});
   }
-  //std::cout << "]" << std::endl;
-  //std::cout << "Generated a selection vector based on the key's coordinates" << std::endl;
 
-  UserToServer_Query_Message *message = new UserToServer_Query_Message();
-  message->rks = relinKeys;
-  message->query = ciphertexts;
+  bool accepted = true;
+  for (int i = 0; i < targets.size(); i++) {
+    std::shared_ptr<NetworkDriver> target_network =
+        i == 0 ? network_driver : std::make_shared<NetworkDriverImpl>();
+    std::shared_ptr<CryptoDriver> target_crypto =
+        i == 0 ? crypto_driver : std::make_shared<CryptoDriver>();
+    target_network->connect(targets[i].first.first, targets[i].first.second);
+    target_network->set_phase("handshake");
+    auto keys = this->HandleKeyExchange(target_crypto, target_network);
+
+    UserToServer_Insert_Message message;
+    message.database = this->database;
+    message.index = targets[i].second;
+    message.value = value;
+    target_network->set_phase("insert");
+    target_network->send(
+        target_crypto->encrypt_and_tag(keys.first, keys.second, &message));
+
+    target_network->set_phase("response");
+    std::vector<unsigned char> response = target_network->read();
+    std::pair<std::vector<unsigned char>, bool> unwrapped_response =
+        target_crypto->decrypt_and_verify(keys.first, keys.second, response);
+    ServerToUser_InsertResult_Message result;
+    result.deserialize(unwrapped_response.first);
+    accepted = accepted && result.accepted;
+  }
+  this->cache_driver->invalidate(key);
+  return accepted;
+}
 
-  std::vector<unsigned char> final_query = crypto_driver->encrypt_and_tag(keys.first,keys.second,message);
-  network_driver->send(final_query);
-  //std::cout << "Sent the selection vector to the server" << std::endl;
+/**
+ * Send a bulk update to the clouds. Indices are global, as for DoInsert:
+ * each shard is sent the part of the update it holds, and in XOR mode both
+ * replicas are sent all of it. Each cloud applies its part atomically, at
+ * the given base version, but parts sent to different clouds are applied
+ * independently. Shards count their versions separately, so a base version
+ * is refused for an update spanning several shards; replicas share one.
+ * Returns the index of every cloud contacted with its result.
+ */
+std::vector<std::pair<int, ServerToUser_UpdateResult_Message>>
+AgentClient::DoUpdate(std::shared_ptr<NetworkDriver> network_driver,
+                      std::shared_ptr<CryptoDriver> crypto_driver,
+                      std::string token,
+                      const std::vector<UpdateMutation> &mutations,
+                      std::uint64_t base_version) {
+  int shard_size = static_cast<int>(this->geometry->size());
+  std::map<int, UserToServer_Update_Message> parts;
+  for (const UpdateMutation &mutation : mutations) {
+    int count = mutation.op == UpdateOp::DELETE
+                    ? mutation.count
+                    : std::max(mutation.values.size(), mutation.records.size());
+    if (mutation.op == UpdateOp::UPSERT && count != 1)
+      throw std::runtime_error("Upsert takes one entry");
+    if (this->mode == PirMode::XOR) {
+      if (mutation.index < 0 || count < 0 || count > shard_size - mutation.index)
+        throw std::runtime_error("Hypercube out of bounds");
+      for (int replica = 0; replica < this->shards.size(); replica++)
+        parts[replica].mutations.push_back(mutation);
+      continue;
+    }
+    // Split ranges at shard boundaries.
+    for (int done = 0; done < count;) {
+      std::pair<int, int> location = this->shard_of(mutation.index + done);
+      int take = std::min(count - done, shard_size - location.second);
+      UpdateMutation piece;
+      piece.op = mutation.op;
+      piece.index = location.second;
+      if (mutation.op == UpdateOp::DELETE)
+        piece.count = take;
+      if (!mutation.values.empty())
+        piece.values.assign(mutation.values.begin() + done,
+                            mutation.values.begin() + done + take);
+      if (!mutation.records.empty())
+        piece.records.assign(mutation.records.begin() + done,
+                             mutation.records.begin() + done + take);
+      parts[location.first].mutations.push_back(std::move(piece));
+      done += take;
+    }
+  }
+  if (base_version != UPDATE_ANY_VERSION && this->mode != PirMode::XOR &&
+      parts.size() > 1)
+    throw std::runtime_error("A base version only applies to updates that "
+                             "touch a single shard");
+
+  std::vector<std::pair<int, ServerToUser_UpdateResult_Message>> results;
+  for (auto &part : parts) {
+    std::shared_ptr<NetworkDriver> target_network =
+        results.empty() ? network_driver : std::make_shared<NetworkDriverImpl>();
+    std::shared_ptr<CryptoDriver> target_crypto =
+        results.empty() ? crypto_driver : std::make_shared<CryptoDriver>();
+    target_network->connect(this->shards[part.first].first,
+                            this->shards[part.first].second);
+    target_network->set_phase("handshake");
+    auto keys = this->HandleKeyExchange(target_crypto, target_network);
+
+    UserToServer_Update_Message &message = part.second;
+    message.database = this->database;
+    message.token = token;
+    message.base_version = base_version;
+    target_network->set_phase("update");
+    target_network->send(
+        target_crypto->encrypt_and_tag(keys.first, keys.second, &message));
+
+    target_network->set_phase("response");
+    std::vector<unsigned char> response = target_network->read();
+    std::pair<std::vector<unsigned char>, bool> unwrapped_response =
+        target_crypto->decrypt_and_verify(keys.first, keys.second, response);
+    ServerToUser_UpdateResult_Message result;
+    result.deserialize(unwrapped_response.first);
+    results.push_back({part.first, result});
+  }
+  return results;
+}
 
-  std::vector<unsigned char> query_response = network_driver->read();
-  std::pair<std::vector<unsigned char>, bool> unwrapped_response = crypto_driver->decrypt_and_verify(keys.first,keys.second,query_response);
-  ServerToUser_Response_Message response_message;
-  response_message.deserialize(unwrapped_response.first,context);
-  seal::Ciphertext response = response_message.response;
+/**
+ * Number of entries across all shards.
+ */
+std::size_t AgentClient::size() {
+  if (this->mode == PirMode::XOR)
+    return this->geometry->size();
+  return this->shards.size() * this->geometry->size();
+}
 
-  seal::Plaintext plaintext;
-  decryptor.decrypt(response,plaintext);
-  std::cout << "Decoded the response " << plaintext.to_string() << std::endl;
-  return byteblock_to_integer(string_to_byteblock(plaintext.to_string()));
+/**
+ * Sum the traffic of every connection of one query and keep it, with the
+ * response's noise budget, as the latest query's report.
+ */
+void AgentClient::record_report(const std::vector<QueryTraffic> &traffics,
+                                int noise_budget) {
+  QueryReport report;
+  for (const QueryTraffic &traffic : traffics)
+    report.traffic.merge(traffic);
+  report.noise_budget = noise_budget;
+  std::unique_lock<std::mutex> lck(this->report_mtx);
+  this->last_report = report;
 }
 
-void
-AgentClient::DoBatchRetrieve(std::shared_ptr<NetworkDriver> network_driver,
-                        std::shared_ptr<CryptoDriver> crypto_driver, std::vector<int> query) {
-  // Initialize drivers.
-  network_driver->connect(this->address, this->port);
+/**
+ * Report of the most recent query or batch.
+ */
+QueryReport AgentClient::last_query_report() {
+  std::unique_lock<std::mutex> lck(this->report_mtx);
+  return this->last_report;
+}
 
-  // Key exchange with server. From here on out, any outgoing messages should
-  // be encrypted and MAC tagged. Incoming messages should be decrypted and have
-  // their MAC checked.
+/**
+ * Cloud whose epoch a cached result for key depends on: the shard holding
+ * it, or the first replica in XOR mode, whose epoch both must match.
+ */
+int AgentClient::cache_cloud(int key) {
+  return this->mode == PirMode::XOR ? 0 : this->shard_of(key).first;
+}
+
+/**
+ * Ask a cloud for the current epoch of the agent's database. The database
+ * is named inside the encrypted channel, so the cloud learns that the agent
+ * is active and an eavesdropper not even that much about what it reads.
+ */
+CloudEpoch AgentClient::ProbeEpoch(std::pair<std::string, int> cloud) {
+  std::shared_ptr<NetworkDriver> network_driver =
+      std::make_shared<NetworkDriverImpl>();
+  std::shared_ptr<CryptoDriver> crypto_driver =
+      std::make_shared<CryptoDriver>();
+  network_driver->connect(cloud.first, cloud.second);
+  network_driver->set_phase("handshake");
   auto keys = this->HandleKeyExchange(crypto_driver, network_driver);
-  //std::cout << "Connected and handled key exchange" << std::endl;
 
-  EncryptionParameters parms(scheme_type::bfv);
+  UserToServer_Epoch_Message message;
+  message.database = this->database;
+  network_driver->set_phase("query");
+  network_driver->send(
+      crypto_driver->encrypt_and_tag(keys.first, keys.second, &message));
+
+  network_driver->set_phase("response");
+  std::vector<unsigned char> response = network_driver->read();
+  std::pair<std::vector<unsigned char>, bool> unwrapped_response =
+      crypto_driver->decrypt_and_verify(keys.first, keys.second, response);
+  network_driver->disconnect();
+  if (!unwrapped_response.second)
+    throw std::runtime_error("Epoch reply failed verification");
+  ServerToUser_Epoch_Message reply;
+  reply.deserialize(unwrapped_response.first);
+  return reply.epoch;
+}
+
+/**
+ * Fill results from the result cache if every key of the query is in it
+ * and current. A batch is never served in part: asking the cloud for only
+ * the missing keys would show it which ones those are. Every cloud is
+ * probed for its epoch, as every cloud is sent a query, so a hit shows no
+ * more about which shard holds the keys than a miss does. Results stop
+ * being served after any write, by this agent or another, and after a
+ * cloud restarts.
+ */
+bool AgentClient::LookupCached(
+    const std::vector<int> &query,
+    std::vector<std::vector<seal::Plaintext>> &results) {
+  for (int key : query)
+    if (!this->cache_driver->contains(key))
+      return false;
+  std::vector<CloudEpoch> epochs;
+  for (auto &cloud : this->shards)
+    epochs.push_back(this->ProbeEpoch(cloud));
+  results.resize(query.size());
+  for (std::size_t i = 0; i < query.size(); i++) {
+    int cloud = this->cache_cloud(query[i]);
+    if (!this->cache_driver->lookup(query[i], cloud, epochs[cloud],
+                                    results[i]))
+      return false;
+  }
+  QueryReport report;
+  report.cached = true;
+  std::unique_lock<std::mutex> lck(this->report_mtx);
+  this->last_report = report;
+  return true;
+}
 
-  parms.set_poly_modulus_degree(POLY_MODULUS_DEGREE);
-  parms.set_coeff_modulus(CoeffModulus::BFVDefault(POLY_MODULUS_DEGREE));
-  parms.set_plain_modulus((PLAINTEXT_MODULUS));
+/**
+ * Shard holding the global index, and the index within that shard.
+ */
+std::pair<int, int> AgentClient::shard_of(int key) {
+  if (key < 0 || key >= this->size())
+    throw std::runtime_error("Hypercube out of bounds");
+  int shard_size = static_cast<int>(this->geometry->size());
+  return std::make_pair(key / shard_size, key % shard_size);
+}
 
+/**
+ * Privately query the cloud for several entries in one round trip. This
+ * function should:
+ * 1) Generate parameters, context, and keys. See constants.hpp.
+ * 2) For every shard, generate one selection vector per key, based on the
+ *    key's shard-local coordinates, and concatenate them. Keys held by other
+ *    shards get an all-zero selection vector, so every shard sees the same
+ *    shape of query whichever shard holds the key.
+ * 3) Send each shard its query in parallel, sum the shards' responses and
+ *    decrypt, one plaintext per part of each record, in query order. A
+ *    batch the cloud packed into shared ciphertexts is unpacked here.
+ * 4) Cache each result under the epoch of the shard that answered it.
+ * When every key's result is cached and current, no query is sent at all.
+ */
+std::vector<std::vector<seal::Plaintext>>
+AgentClient::DoBatchQuery(std::shared_ptr<NetworkDriver> network_driver,
+                          std::shared_ptr<CryptoDriver> crypto_driver,
+                          std::vector<int> query) {
+  if (query.empty())
+    throw std::runtime_error("Empty query");
+  std::vector<std::vector<seal::Plaintext>> cached;
+  if (this->LookupCached(query, cached))
+    return cached;
+  if (this->mode == PirMode::XOR)
+    return this->DoXorBatchQuery(network_driver, crypto_driver, query);
+  std::vector<std::pair<int, int>> locations;
+  for (int key : query)
+    locations.push_back(this->shard_of(key));
+
+  EncryptionParameters parms = make_parameters(
+      this->mode == PirMode::BGV ? scheme_type::bgv : scheme_type::bfv,
+      POLY_MODULUS_DEGREE, PLAINTEXT_MODULUS);
   SEALContext context(parms);
 
   KeyGenerator keygen(context);
@@ -197,48 +603,335 @@ AgentClient::DoBatchRetrieve(std::shared_ptr<NetworkDriver> network_driver,
   seal::RelinKeys relinKeys;
   keygen.create_relin_keys(relinKeys);
 
-  seal::Encryptor encryptor(context, publicKey);
-  seal::Decryptor decryptor(context, secretKey);
   //std::cout << "Generated parameters, context, and keys" << std::endl;
 
-  std::vector<std::vector<int>> coordinates;
-  for (int i = 0; i < query.size();i++) {
-    coordinates.push_back(this->hypercube_driver->to_coords((query[i])));
+  // Every shard gets one selection vector per key; keys it does not hold
+  // select nothing. All of them are encrypted up front, across the pool.
+  int shard_count = this->shards.size();
+  std::vector<unsigned char> bits;
+  for (auto &plan : this->selector_plan(query))
+    bits.insert(bits.end(), plan.begin(), plan.end());
+  std::vector<seal::Ciphertext> selectors =
+      this->EncryptSelectors(context, publicKey, bits);
+  std::size_t per_shard = selectors.size() / shard_count;
+
+  // One thread per shard; the first shard uses the caller's drivers.
+  std::vector<ServerToUser_Response_Message> responses(shard_count);
+  std::vector<QueryTraffic> traffics(shard_count);
+  std::vector<std::exception_ptr> errors(shard_count);
+  std::vector<std::thread> workers;
+  for (int k = 0; k < shard_count; k++) {
+    std::shared_ptr<NetworkDriver> shard_network =
+        k == 0 ? network_driver : std::make_shared<NetworkDriverImpl>();
+    std::shared_ptr<CryptoDriver> shard_crypto =
+        k == 0 ? crypto_driver : std::make_shared<CryptoDriver>();
+    workers.emplace_back([&, k, shard_network, shard_crypto]() {
+      try {
+        std::vector<seal::Ciphertext> ciphertexts(
+            std::make_move_iterator(selectors.begin() + k * per_shard),
+            std::make_move_iterator(selectors.begin() + (k + 1) * per_shard));
+        responses[k] =
+            this->SendQuery(shard_network, shard_crypto, this->shards[k],
+                            context, relinKeys, std::move(ciphertexts),
+                            traffics[k]);
+      } catch (...) {
+        errors[k] = std::current_exception();
+      }
+    });
   }
+  for (std::thread &worker : workers)
+    worker.join();
+  for (std::exception_ptr &error : errors)
+    if (error)
+      std::rethrow_exception(error);
+
+  // Unpacked, each key gets one ciphertext per part. Packed, each
+  // ciphertext carries per keys, stride coefficients apart.
+  std::size_t count = responses[0].response.size();
+  std::size_t stride = responses[0].stride;
+  for (int k = 1; k < shard_count; k++)
+    if (responses[k].response.size() != count || responses[k].stride != stride)
+      throw std::runtime_error("Shards disagree on record layout");
+  std::size_t parts = stride ? 1 : count / query.size();
+  std::size_t per = stride ? POLY_MODULUS_DEGREE / stride : 1;
+  if (stride ? per == 0 || count != (query.size() + per - 1) / per
+             : parts == 0 || parts * query.size() != count)
+    throw std::runtime_error("Malformed batch response");
+
+  // Sum the shards' responses (only the shard holding each key contributes
+  // a nonzero one), measure the noise left and decrypt, across the pool.
+  std::vector<int> budgets(count);
+  std::vector<seal::Plaintext> plaintexts(count);
+  this->pool_driver->run(count, [&](std::size_t begin, std::size_t end) {
+    seal::Evaluator evaluator(context);
+    seal::Decryptor decryptor(context, secretKey);
+    for (std::size_t i = begin; i < end; i++) {
+      seal::Ciphertext &combined = responses[0].response[i];
+      for (int k = 1; k < shard_count; k++)
+        evaluator.add_inplace(combined, responses[k].response[i]);
+      budgets[i] = decryptor.invariant_noise_budget(combined);
+      decryptor.decrypt(combined, plaintexts[i]);
+    }
+  });
+  std::vector<std::vector<seal::Plaintext>> results(
+      query.size(), std::vector<seal::Plaintext>(parts));
+  for (std::size_t i = 0; i < query.size() * parts; i++)
+    results[i / parts][i % parts] =
+        stride ? unpack_plaintext(plaintexts[i / per], i % per, stride)
+               : std::move(plaintexts[i]);
+
+  // With no noise budget left, decryption silently yields garbage.
+  int noise_budget = *std::min_element(budgets.begin(), budgets.end());
+  this->record_report(traffics, noise_budget);
+  CUSTOM_LOG(lg, debug) << "Response noise budget: " << noise_budget
+                        << " bits";
+  if (noise_budget == 0)
+    throw std::runtime_error("Response noise budget exhausted; the geometry "
+                             "is too deep for these parameters");
+  for (std::size_t i = 0; i < query.size(); i++) {
+    const ServerToUser_Response_Message &response =
+        responses[locations[i].first];
+    this->cache_driver->store(query[i], locations[i].first,
+                              {response.instance, response.version},
+                              results[i]);
+  }
+  return results;
+}
 
-  std::vector<int> indices(this->dimension*this->sidelength,0);
+/**
+ * Privately query two replicas for several entries. Each replica gets one
+ * random-looking share of each selection vector; XOR-ing their answers
+ * gives the entries' coefficients, returned as plaintexts of
+ * POLY_MODULUS_DEGREE coefficients so callers decode them like BFV results.
+ */
+std::vector<std::vector<seal::Plaintext>>
+AgentClient::DoXorBatchQuery(std::shared_ptr<NetworkDriver> network_driver,
+                             std::shared_ptr<CryptoDriver> crypto_driver,
+                             std::vector<int> query) {
+  if (query.empty())
+    throw std::runtime_error("Empty query");
+  CryptoPP::AutoSeededRandomPool rng;
+  UserToServer_XorQuery_Message shares[2];
+  shares[0].database = shares[1].database = this->database;
+  for (int key : query) {
+    auto split = xor_share_selection(this->geometry->size(), key, rng);
+    shares[0].selections.push_back(split.first);
+    shares[1].selections.push_back(split.second);
+  }
 
-  std::vector<seal::Ciphertext> ciphertexts(this->dimension*this->sidelength,Ciphertext());
-  //std::cout << "Indices [";
-  for (int i = 0; i < indices.size();i++) {
-    for (int j = 0; j < coordinates.size(); j++) {
-      if (i%this->sidelength == coordinates[j][i/this->sidelength]) {
-        indices[i] = 1;
-      }
+  ServerToUser_XorResponse_Message responses[2];
+  std::vector<QueryTraffic> traffics(2);
+  std::exception_ptr errors[2];
+  std::thread replica([&]() {
+    try {
+      responses[1] = this->SendXorQuery(
+          std::make_shared<NetworkDriverImpl>(),
+          std::make_shared<CryptoDriver>(), this->shards[1], shares[1],
+          traffics[1]);
+    } catch (...) {
+      errors[1] = std::current_exception();
     }
-    //std::cout << " " << indices[i] << ", ";
-    seal::Plaintext plain(std::to_string(indices[i]));
-    encryptor.encrypt(plain,ciphertexts[i]);
+  });
+  try {
+    responses[0] = this->SendXorQuery(network_driver, crypto_driver,
+                                      this->shards[0], shares[0], traffics[0]);
+  } catch (...) {
+    errors[0] = std::current_exception();
   }
-  //std::cout << "]" << std::endl;
-  //std::cout << "Generated a selection vector based on the key's coordinates" << std::endl;
+  replica.join();
+  for (std::exception_ptr &error : errors)
+    if (error)
+      std::rethrow_exception(error);
+  this->record_report(traffics, -1);
+
+  if (responses[0].version != responses[1].version)
+    throw std::runtime_error("Replicas are at different versions");
+  if (responses[0].answers.size() != query.size() ||
+      responses[1].answers.size() != query.size())
+    throw std::runtime_error("Malformed batch response");
+
+  int width = PackedValueStore(0, PLAINTEXT_MODULUS, 0).width();
+  std::vector<std::vector<seal::Plaintext>> results;
+  for (int j = 0; j < query.size(); j++) {
+    std::vector<std::uint64_t> coeffs = xor_combine(
+        responses[0].answers[j], responses[1].answers[j], width);
+    std::vector<seal::Plaintext> plaintexts;
+    for (std::size_t begin = 0; begin < coeffs.size();
+         begin += POLY_MODULUS_DEGREE) {
+      std::size_t end =
+          std::min<std::size_t>(begin + POLY_MODULUS_DEGREE, coeffs.size());
+      seal::Plaintext plaintext(end - begin);
+      for (std::size_t k = begin; k < end; k++)
+        plaintext[k - begin] = coeffs[k];
+      plaintexts.push_back(plaintext);
+    }
+    results.push_back(plaintexts);
+  }
+  for (int j = 0; j < query.size(); j++)
+    this->cache_driver->store(query[j], 0,
+                              {responses[0].instance, responses[0].version},
+                              results[j]);
+  return results;
+}
+
+/**
+ * Send one share of a two-server query to one replica. This function
+ * should:
+ * 0) Connect and handle key exchange.
+ * 1) Send the selection shares.
+ * 2) Receive the replica's answers.
+ * The connection's traffic is returned in traffic.
+ */
+ServerToUser_XorResponse_Message
+AgentClient::SendXorQuery(std::shared_ptr<NetworkDriver> network_driver,
+                          std::shared_ptr<CryptoDriver> crypto_driver,
+                          std::pair<std::string, int> replica,
+                          UserToServer_XorQuery_Message query,
+                          QueryTraffic &traffic) {
+  // Initialize drivers.
+  network_driver->connect(replica.first, replica.second);
+  network_driver->set_phase("handshake");
+
+  // Key exchange with server. From here on out, any outgoing messages should
+  // be encrypted and MAC tagged. Incoming messages should be decrypted and have
+  // their MAC checked.
+  auto keys = this->HandleKeyExchange(crypto_driver, network_driver);
+
+  network_driver->set_phase("query");
+  std::vector<unsigned char> final_query =
+      crypto_driver->encrypt_and_tag(keys.first, keys.second, &query);
+  network_driver->send(final_query);
+
+  network_driver->set_phase("response");
+  std::vector<unsigned char> query_response = network_driver->read();
+  std::pair<std::vector<unsigned char>, bool> unwrapped_response =
+      crypto_driver->decrypt_and_verify(keys.first, keys.second,
+                                        query_response);
+  ServerToUser_XorResponse_Message response_message;
+  response_message.deserialize(unwrapped_response.first);
+  traffic = connection_traffic(
+      network_driver, crypto_driver,
+      message_type_name(MessageType::UserToServer_XorQuery_Message),
+      message_type_name(MessageType::ServerToUser_XorResponse_Message), 0);
+  return response_message;
+}
+
+/**
+ * Plan the selection vectors of a query, before encryption: one row per
+ * shard, each holding one block of query_size bits per key, in key order.
+ * The shard that holds a key gets a one in each dimension's block at the
+ * key's coordinate; every other shard gets all zeros, which selects
+ * nothing. Every shard is sent a row, so none learns which keys it holds.
+ */
+std::vector<std::vector<unsigned char>>
+AgentClient::selector_plan(const std::vector<int> &query) {
+  std::size_t query_size = this->geometry->query_size();
+  std::vector<std::vector<unsigned char>> plan(
+      this->shards.size(),
+      std::vector<unsigned char>(query.size() * query_size, 0));
+  for (std::size_t j = 0; j < query.size(); j++) {
+    std::pair<int, int> location = this->shard_of(query[j]);
+    std::vector<int> coordinates = this->geometry->to_coords(location.second);
+    for (int dim = 0; dim < this->geometry->dimension(); dim++)
+      plan[location.first][j * query_size + this->geometry->offset(dim) +
+                           coordinates[dim]] = 1;
+  }
+  return plan;
+}
+
+/**
+ * Encrypt planned selector bits, in order. Every ciphertext is a fresh
+ * encryption of one of the pre-encoded 0/1 plaintexts, spread across the
+ * pool.
+ */
+std::vector<seal::Ciphertext>
+AgentClient::EncryptSelectors(seal::SEALContext context,
+                              const seal::PublicKey &public_key,
+                              const std::vector<unsigned char> &bits) {
+  std::vector<seal::Ciphertext> ciphertexts(bits.size());
+  this->pool_driver->run(bits.size(), [&](std::size_t begin, std::size_t end) {
+    seal::Encryptor encryptor(context, public_key);
+    for (std::size_t i = begin; i < end; i++)
+      encryptor.encrypt(bits[i] ? this->selector_one : this->selector_zero,
+                        ciphertexts[i]);
+  });
+  return ciphertexts;
+}
+
+/**
+ * Send one query to one shard and return its encrypted response. This
+ * function should:
+ * 0) Connect and handle key exchange.
+ * 1) Send the selection vectors and relinearization keys.
+ * 2) Receive the response.
+ * The connection's traffic is returned in traffic.
+ */
+ServerToUser_Response_Message
+AgentClient::SendQuery(std::shared_ptr<NetworkDriver> network_driver,
+                       std::shared_ptr<CryptoDriver> crypto_driver,
+                       std::pair<std::string, int> shard,
+                       seal::SEALContext context, seal::RelinKeys relin_keys,
+                       std::vector<seal::Ciphertext> ciphertexts,
+                       QueryTraffic &traffic) {
+  // Initialize drivers.
+  network_driver->connect(shard.first, shard.second);
+  network_driver->set_phase("handshake");
+
+  // Key exchange with server. From here on out, any outgoing messages should
+  // be encrypted and MAC tagged. Incoming messages should be decrypted and have
+  // their MAC checked.
+  auto keys = this->HandleKeyExchange(crypto_driver, network_driver);
+  //std::cout << "Connected and handled key exchange" << std::endl;
 
   UserToServer_Query_Message *message = new UserToServer_Query_Message();
-  message->rks = relinKeys;
-  message->query = ciphertexts;
+  message->scheme = context.first_context_data()->parms().scheme();
+  message->database = this->database;
+  message->rks = std::move(relin_keys);
+  message->query = std::move(ciphertexts);
 
+  network_driver->set_phase("query");
   std::vector<unsigned char> final_query = crypto_driver->encrypt_and_tag(keys.first,keys.second,message);
   network_driver->send(final_query);
   //std::cout << "Sent the selection vector to the server" << std::endl;
 
+  network_driver->set_phase("response");
   std::vector<unsigned char> query_response = network_driver->read();
   std::pair<std::vector<unsigned char>, bool> unwrapped_response = crypto_driver->decrypt_and_verify(keys.first,keys.second,query_response);
   ServerToUser_Response_Message response_message;
   response_message.deserialize(unwrapped_response.first,context);
-  seal::Ciphertext response = response_message.response;
+  traffic = connection_traffic(
+      network_driver, crypto_driver,
+      message_type_name(MessageType::UserToServer_Query_Message),
+      message_type_name(MessageType::ServerToUser_Response_Message),
+      message->rks_size);
+  return response_message;
+}
 
-  seal::Plaintext plaintext;
-  decryptor.decrypt(response,plaintext);
-  std::cout << "Decoded the response " << plaintext.to_string() << std::endl;
-  //return byteblock_to_integer(string_to_byteblock(plaintext.to_string()));
-}
\ No newline at end of file
+/**
+ * Privately look up a keyword. Fetches every candidate slot in one batch,
+ * so the cloud cannot tell which slot, if any, held the key.
+ */
+std::pair<std::vector<unsigned char>, bool>
+AgentClient::DoKeywordRetrieve(std::shared_ptr<NetworkDriver> network_driver,
+                               std::shared_ptr<CryptoDriver> crypto_driver,
+                               std::vector<unsigned char> key) {
+  if (this->mode != PirMode::XOR && this->shards.size() > 1)
+    throw std::runtime_error("Keyword mode does not support sharding");
+  std::vector<int> candidates =
+      keyword_candidates(key, this->geometry->size());
+  std::vector<std::vector<seal::Plaintext>> results =
+      this->DoBatchQuery(network_driver, crypto_driver, candidates);
+  std::vector<std::pair<std::vector<unsigned char>, bool>> values(
+      results.size());
+  this->pool_driver->run(results.size(), [&](std::size_t begin,
+                                             std::size_t end) {
+    for (std::size_t i = begin; i < end; i++)
+      values[i] = keyword_untag_record(
+          key, decode_record(results[i], plain_bits(PLAINTEXT_MODULUS),
+                             POLY_MODULUS_DEGREE));
+  });
+  for (auto &value : values)
+    if (value.second)
+      return value;
+  return std::make_pair(std::vector<unsigned char>(), false);
+}
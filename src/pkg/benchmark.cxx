@@ -2,12 +2,19 @@
 // Created by TJANUSZEWICZ on 08/07/2025.
 //
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+
 #include "../../include/pkg/benchmark.hpp"
 #include "../../include/pkg/agent.hpp"
 #include "../../include-shared/constants.hpp"
 #include "../../include-shared/logger.hpp"
 #include "../../include-shared/util.hpp"
 #include "../../include/drivers/hypercube_driver.hpp"
+#include "../../include/drivers/loader_driver.hpp"
+#include "../../include/drivers/xor_driver.hpp"
 #include "../../include/drivers/repl_driver.hpp"
 #include "../drivers/repl_driver.cxx"
 
@@ -21,36 +28,145 @@ namespace {
 src::severity_logger<logging::trivial::severity_level> lg;
 }
 
+/**
+ * The parameters the agent and cloud use, from constants.hpp.
+ */
+ParameterProfile ParameterProfile::standard() {
+  return {"default", POLY_MODULUS_DEGREE, PLAINTEXT_MODULUS};
+}
+
+/**
+ * Every profile the benchmark knows about.
+ */
+std::vector<ParameterProfile> ParameterProfile::all() {
+  return {standard(),
+          {"n8192-t1024", 8192, 1024},
+          {"n8192-t65537", 8192, 65537},
+          {"n16384-t65537", 16384, 65537}};
+}
+
+/**
+ * Look up a profile by name.
+ */
+ParameterProfile ParameterProfile::find(const std::string &name) {
+  for (const ParameterProfile &profile : all())
+    if (profile.name == name)
+      return profile;
+  throw std::runtime_error("Unknown parameter profile " + name);
+}
+
+/**
+ * Mean, extremes and nearest-rank percentiles of the samples.
+ */
+PhaseSummary summarize(std::vector<double> samples) {
+  PhaseSummary summary;
+  if (samples.empty())
+    return summary;
+  std::sort(samples.begin(), samples.end());
+  auto percentile = [&samples](double p) {
+    std::size_t rank = static_cast<std::size_t>(
+        std::ceil(p / 100.0 * samples.size()));
+    return samples[std::max<std::size_t>(rank, 1) - 1];
+  };
+  summary.count = samples.size();
+  summary.mean =
+      std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+  summary.min = samples.front();
+  summary.max = samples.back();
+  summary.p50 = percentile(50);
+  summary.p95 = percentile(95);
+  summary.p99 = percentile(99);
+  return summary;
+}
+
+namespace {
+using bench_clock = std::chrono::steady_clock;
+
+double elapsed_ms(bench_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(bench_clock::now() - start)
+      .count();
+}
+} // namespace
+
 /**
  * Constructor
  */
-BenchmarkClient::BenchmarkClient(int d, int s) {
-  this->dimension = d;
-  this->sidelength = s;
+BenchmarkClient::BenchmarkClient(int d, int s)
+    : BenchmarkClient(d, s, ParameterProfile::standard()) {}
 
+/**
+ * Constructor for an s^d cube.
+ */
+BenchmarkClient::BenchmarkClient(int d, int s, ParameterProfile profile)
+    : BenchmarkClient(std::vector<int>(std::max(d, 0), s), profile) {}
+
+/**
+ * Constructor. The database has the given side length in each dimension and
+ * stores values mod the profile's plain modulus; queries are evaluated under
+ * the given scheme.
+ */
+BenchmarkClient::BenchmarkClient(std::vector<int> sides,
+                                 ParameterProfile profile,
+                                 seal::scheme_type scheme) {
+  this->profile = profile;
+  this->scheme = scheme;
+
+  CryptoPP::Integer q((signed long)profile.plain_modulus);
   this->hypercube_driver = std::make_shared<HypercubeDriver>(
-      d, s, CryptoPP::Integer(PLAINTEXT_MODULUS));
+      sides, q, RecordLayout::scalar(profile.plain_modulus));
+  this->pool_driver = std::make_shared<ThreadPoolDriver>();
+  this->workspace = std::make_shared<EvaluationWorkspace>();
   initLogger();
 }
 
-
 /**
- * Privately retrieve a value from the cloud. This function should:
- * 0) Connect and handle key exchange.
- * 1) Generate parameters, context, and keys. See constants.hpp.
- * 2) Generate a selection vector based on the key's coordinates.
- * 3) Send the selection vector to the server and decode the response.
+ * Privately retrieve a value, playing both agent and cloud.
  */
 int BenchmarkClient::get(int index) {
-  EncryptionParameters parms(scheme_type::bfv);
+  PhaseTimings timings;
+  return this->get_timed(index, timings);
+}
 
-  parms.set_poly_modulus_degree(POLY_MODULUS_DEGREE);
-  parms.set_coeff_modulus(CoeffModulus::BFVDefault(POLY_MODULUS_DEGREE));
-  parms.set_plain_modulus((PLAINTEXT_MODULUS));
+/**
+ * Privately retrieve a value, playing both agent and cloud, and add the time
+ * spent in each phase to timings. See get_batch_timed.
+ */
+int BenchmarkClient::get_timed(int index, PhaseTimings &timings) {
+  return this->get_batch_timed({index}, timings)[0];
+}
+
+/**
+ * Privately retrieve several values in one query, playing both agent and
+ * cloud.
+ */
+std::vector<int> BenchmarkClient::get_batch(std::vector<int> indices) {
+  PhaseTimings timings;
+  return this->get_batch_timed(indices, timings);
+}
 
+/**
+ * Privately retrieve several values in one query, playing both agent and
+ * cloud, and add the time spent in each phase to timings:
+ * 0) context: parameters and context.
+ * 1) keygen: secret, public and relinearization keys.
+ * 2) encrypt: the selection vectors.
+ * 3) serialize: the query and response, each written and read back as on
+ *    the wire.
+ * 4) evaluate_dim<k>, relinearize: the server's folds.
+ * 5) pack: shifting a batch's results into shared ciphertexts.
+ * 6) decrypt: the response.
+ * The response's remaining noise budget is kept for last_noise_budget.
+ */
+std::vector<int> BenchmarkClient::get_batch_timed(std::vector<int> indices,
+                                                  PhaseTimings &timings) {
+  auto start = bench_clock::now();
+  EncryptionParameters parms =
+      make_parameters(this->scheme, this->profile.poly_modulus_degree,
+                      this->profile.plain_modulus);
   SEALContext context(parms);
-  seal::Evaluator evaluator(context);
+  timings["context"] += elapsed_ms(start);
 
+  start = bench_clock::now();
   KeyGenerator keygen(context);
   SecretKey secretKey = keygen.secret_key();
 
@@ -59,55 +175,128 @@ int BenchmarkClient::get(int index) {
   seal::RelinKeys relinKeys;
   keygen.create_relin_keys(relinKeys);
 
-  seal::Encryptor encryptor(context, publicKey);
   seal::Decryptor decryptor(context, secretKey);
-  //std::cout << "Generated parameters, context, and keys" << std::endl;
-
-  std::vector<int> coordinates = this->hypercube_driver->to_coords(index);
-  std::vector<int> indices(this->dimension*this->sidelength,0);
-
-  std::vector<seal::Ciphertext> query(this->dimension*this->sidelength,Ciphertext());
-  //std::cout << "Indices [";
-  for (int i = 0; i < indices.size();i++) {
-    if (i%this->sidelength == coordinates[i/this->sidelength]) {
-      indices[i] = 1;
-    }
-    //std::cout << " " << indices[i] << ", ";
-    seal::Plaintext plain(std::to_string(indices[i]));
-    encryptor.encrypt(plain,query[i]);
+  timings["keygen"] += elapsed_ms(start);
+
+  start = bench_clock::now();
+  const HypercubeGeometry &geometry = this->hypercube_driver->geometry();
+  std::size_t query_size = geometry.query_size();
+  std::vector<unsigned char> bits(indices.size() * query_size, 0);
+  for (std::size_t j = 0; j < indices.size(); j++) {
+    std::vector<int> coordinates = this->hypercube_driver->to_coords(indices[j]);
+    for (int dim = 0; dim < geometry.dimension(); dim++)
+      bits[j * query_size + geometry.offset(dim) + coordinates[dim]] = 1;
   }
-  //std::cout << "]" << std::endl;
-  //std::cout << "Generated a selection vector based on the key's coordinates" << std::endl;
-
-  std::vector<seal::Ciphertext> newCube;
-  for (int i = 0; i < dimension; i++) {
-    for (int j = 0; j < pow(sidelength,dimension); j++) {
-      std::vector<int> coords = hypercube_driver->to_coords(j);
-      if (i == 0) {
-        seal::Plaintext plaintext(std::to_string(hypercube_driver->get(j).ConvertToLong()));
-        seal::Ciphertext result;
-        evaluator.multiply_plain(query[coords[i]],plaintext,result);
-        newCube.push_back(result);
-      }
-      else {
-        evaluator.multiply_inplace(newCube[j],query[sidelength*i+coords[i]]);
-        evaluator.relinearize_inplace(newCube[j],relinKeys);
-      }
-
-    }
+  std::vector<seal::Ciphertext> query(bits.size(),Ciphertext());
+  seal::Plaintext zero("0"), one("1");
+  this->pool_driver->run(query.size(), [&](std::size_t begin, std::size_t end) {
+    seal::Encryptor encryptor(context, publicKey);
+    for (std::size_t i = begin; i < end; i++)
+      encryptor.encrypt(bits[i] ? one : zero, query[i]);
+  });
+  timings["encrypt"] += elapsed_ms(start);
+
+  start = bench_clock::now();
+  UserToServer_Query_Message query_message;
+  query_message.scheme = this->scheme;
+  query_message.rks = std::move(relinKeys);
+  query_message.query = std::move(query);
+  std::vector<unsigned char> query_data;
+  query_message.serialize(query_data);
+  UserToServer_Query_Message received_query;
+  received_query.deserialize(query_data, context);
+  timings["serialize"] += elapsed_ms(start);
+
+  std::shared_ptr<const HypercubeSnapshot> snapshot =
+      this->hypercube_driver->snapshot();
+  EvaluatorDriver evaluator(context,
+                            this->hypercube_driver->geometry().plan(),
+                            this->workspace.get());
+  std::vector<seal::Ciphertext> query_result = evaluator.evaluate(
+      *snapshot, received_query.query, received_query.rks, &timings);
+  start = bench_clock::now();
+  std::size_t stride = evaluator.pack(query_result, snapshot->layout);
+  if (stride)
+    timings["pack"] += elapsed_ms(start);
+
+  start = bench_clock::now();
+  ServerToUser_Response_Message response_message;
+  response_message.response = std::move(query_result);
+  response_message.stride = stride;
+  std::vector<unsigned char> response_data;
+  response_message.serialize(response_data);
+  ServerToUser_Response_Message received_response;
+  received_response.deserialize(response_data, context);
+  timings["serialize"] += elapsed_ms(start);
+
+  this->noise_budget = -1;
+  for (seal::Ciphertext &ciphertext : received_response.response) {
+    int budget = decryptor.invariant_noise_budget(ciphertext);
+    this->noise_budget = this->noise_budget < 0
+                             ? budget
+                             : std::min(this->noise_budget, budget);
   }
 
-  seal::Ciphertext query_result;
-  for (int i = 0; i < pow(sidelength,dimension); i++) {
-    if (i==0) query_result = newCube[i];
-    else evaluator.add_inplace(query_result,newCube[i]);
+  // Scalar entries: one ciphertext per value, or per values packed
+  // stride coefficients apart.
+  start = bench_clock::now();
+  std::size_t per = stride ? this->profile.poly_modulus_degree / stride : 1;
+  std::vector<seal::Plaintext> plaintexts(received_response.response.size());
+  for (std::size_t i = 0; i < plaintexts.size(); i++)
+    decryptor.decrypt(received_response.response[i], plaintexts[i]);
+  std::vector<int> values;
+  for (std::size_t i = 0; i < indices.size(); i++) {
+    seal::Plaintext plaintext =
+        stride ? unpack_plaintext(plaintexts[i / per], i % per, stride)
+               : plaintexts[i];
+    values.push_back(plaintext.coeff_count() > 0 ? plaintext[0] : 0);
   }
+  timings["decrypt"] += elapsed_ms(start);
+  return values;
+}
 
-  seal::Plaintext plaintext;
-  decryptor.decrypt(query_result,plaintext);
-  //std::cout << "Decoded the response " << plaintext.to_string() << std::endl;
-  return stoi(plaintext.to_string());
+/**
+ * Smallest noise budget, in bits, left in any ciphertext of the last BFV
+ * response, or -1 if the last query used XOR PIR. Zero means the response
+ * decrypted to garbage.
+ */
+int BenchmarkClient::last_noise_budget() { return this->noise_budget; }
 
+/**
+ * Retrieve a value with two-server XOR PIR, playing both replicas against the
+ * same snapshot.
+ */
+int BenchmarkClient::get_xor(int index) {
+  PhaseTimings timings;
+  return this->get_xor_timed(index, timings);
+}
+
+/**
+ * Retrieve a value with two-server XOR PIR and add the time spent sharing
+ * the selection, answering both shares and combining them to timings.
+ */
+int BenchmarkClient::get_xor_timed(int index, PhaseTimings &timings) {
+  this->noise_budget = -1;
+  auto start = bench_clock::now();
+  CryptoPP::AutoSeededRandomPool rng;
+  auto shares = xor_share_selection(this->hypercube_driver->geometry().size(),
+                                    index, rng);
+  timings["share"] += elapsed_ms(start);
+
+  start = bench_clock::now();
+  std::shared_ptr<const HypercubeSnapshot> snapshot =
+      this->hypercube_driver->snapshot();
+  XorEvaluatorDriver evaluator;
+  std::vector<unsigned char> first = evaluator.evaluate(*snapshot, shares.first);
+  std::vector<unsigned char> second =
+      evaluator.evaluate(*snapshot, shares.second);
+  timings["evaluate"] += elapsed_ms(start);
+
+  start = bench_clock::now();
+  int width = snapshot->pages[0]->values.width();
+  int value = xor_combine(first, second, width)[0];
+  timings["combine"] += elapsed_ms(start);
+  return value;
 }
 
 /**
@@ -115,8 +304,7 @@ int BenchmarkClient::get(int index) {
  */
 void BenchmarkClient::insert(int index, int val) {
   int key = index;
-  CryptoPP::Integer value = CryptoPP::Integer(val);
-  this->hypercube_driver->insert(key, value);
+  this->hypercube_driver->insert(key, static_cast<std::uint64_t>(val));
 }
 
 /**
@@ -124,17 +312,18 @@ void BenchmarkClient::insert(int index, int val) {
  */
 void BenchmarkClient::cube(std::vector<int>& cube) {
     //read_csv_values(input_split[1]);
+  std::vector<std::pair<int, std::uint64_t>> updates;
   for (int i = 0; i < cube.size(); i++) {
-    CryptoPP::Integer value = CryptoPP::Integer(cube[i]);
-    //std::cout << value << " ";
-    this->hypercube_driver->insert(i, value);
+    //std::cout << cube[i] << " ";
+    updates.push_back({i, static_cast<std::uint64_t>(cube[i])});
   }
+  this->hypercube_driver->insert_many(updates);
 }
 
 /**
- * Get a file and put all values in the cube
+ * Get a file (CSV or binary bulk format) and put all values in the cube
  */
 void BenchmarkClient::cube(std::string filename) {
-  std::vector<int> cube = read_csv_values(filename);
-  this->cube(cube);
+  LoaderDriver loader(this->hypercube_driver);
+  loader.load(filename);
 }
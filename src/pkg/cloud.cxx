@@ -14,22 +14,192 @@ See logger.hpp for more modes besides 'debug'
 */
 namespace {
 src::severity_logger<logging::trivial::severity_level> lg;
+
+/**
+ * Whether the two secrets are equal, in time independent of where they
+ * differ.
+ */
+bool same_secret(const std::string &a, const std::string &b) {
+  if (a.size() != b.size())
+    return false;
+  unsigned char diff = 0;
+  for (std::size_t i = 0; i < a.size(); i++)
+    diff |= a[i] ^ b[i];
+  return diff == 0;
+}
+
+/**
+ * Throw unless the database may be written by index. Keyword databases are
+ * only written by keyword, so their driver always knows which slot holds
+ * which key.
+ */
+void check_indexed(const CloudDatabase &database) {
+  if (database.keyword_driver)
+    throw std::runtime_error("Database " + database.name +
+                             " is written by keyword");
+}
+
+/**
+ * The entry updates a bulk update makes, in order. Deleted entries get no
+ * coefficients, which stores zero.
+ */
+EntryUpdates entry_updates(const HypercubeDriver &hypercube_driver,
+                           const std::vector<UpdateMutation> &mutations) {
+  bool records = hypercube_driver.layout().record_size > 0;
+  std::int64_t size = hypercube_driver.geometry().size();
+  EntryUpdates updates;
+  for (const UpdateMutation &mutation : mutations) {
+    std::int64_t count;
+    if (mutation.op == UpdateOp::DELETE) {
+      count = mutation.count;
+    } else {
+      if (records ? !mutation.values.empty() : !mutation.records.empty())
+        throw std::runtime_error(records ? "Database stores records"
+                                         : "Database stores values");
+      count = records ? mutation.records.size() : mutation.values.size();
+      if (mutation.op == UpdateOp::UPSERT && count != 1)
+        throw std::runtime_error("Upsert takes one entry");
+    }
+    if (mutation.index < 0 || count < 0 || count > size - mutation.index)
+      throw std::runtime_error("Hypercube out of bounds");
+    for (std::int64_t k = 0; k < count; k++) {
+      int idx = mutation.index + k;
+      if (mutation.op == UpdateOp::DELETE)
+        updates.push_back({idx, {}});
+      else if (records)
+        updates.push_back(
+            {idx, hypercube_driver.record_coeffs(mutation.records[k])});
+      else
+        updates.push_back(
+            {idx, hypercube_driver.value_coeffs(mutation.values[k])});
+    }
+  }
+  return updates;
+}
 }
 using namespace seal;
 
 /**
- * Constructor
+ * Constructor for an s^d cube.
+ */
+CloudClient::CloudClient(int d, int s, int record_size, bool remote_inserts,
+                         bool keywords)
+    : CloudClient(std::vector<int>(std::max(d, 0), s), record_size,
+                  remote_inserts, keywords) {}
+
+/**
+ * Constructor for a cube with the given side length in each dimension.
  */
-CloudClient::CloudClient(int d, int s) {
-  this->dimension = d;
-  this->sidelength = s;
+CloudClient::CloudClient(std::vector<int> sides, int record_size,
+                         bool remote_inserts, bool keywords) {
+  this->remote_inserts = remote_inserts;
+  CryptoPP::AutoSeededRandomPool rng;
+  rng.GenerateBlock(reinterpret_cast<CryptoPP::byte *>(&this->instance),
+                    sizeof(this->instance));
   this->cli_driver = std::make_shared<CLIDriver>();
   this->cli_driver->init();
-  this->hypercube_driver = std::make_shared<HypercubeDriver>(
-      d, s, CryptoPP::Integer(PLAINTEXT_MODULUS));
+  this->metrics_driver = std::make_shared<MetricsDriver>();
+  this->trace_driver = std::make_shared<TraceDriver>();
+  this->workspace_pool = std::make_shared<WorkspacePool>();
+  this->AddDatabase(DEFAULT_DATABASE, sides, record_size, keywords);
+  this->current_database = DEFAULT_DATABASE;
   initLogger();
 }
 
+/**
+ * Host another database under the given name, with the given side lengths
+ * and record size (0 for scalars). A keyword database places its records by
+ * keyword and refuses writes by index. If a data path is set, the database is
+ * restored from and kept under it. The name is reserved while the database
+ * is restored, so queries to other databases are not held up meanwhile.
+ */
+void CloudClient::AddDatabase(std::string name, std::vector<int> sides,
+                              int record_size, bool keywords) {
+  if (name.empty() || name.find_first_of("/ ") != std::string::npos)
+    throw std::runtime_error("Invalid database name " + name);
+  std::string data_path;
+  {
+    std::unique_lock<std::mutex> lck(this->databases_mtx);
+    if (this->databases.count(name) || this->pending_databases.count(name))
+      throw std::runtime_error("Database " + name + " already exists");
+    this->pending_databases.insert(name);
+    data_path = this->data_path;
+  }
+  try {
+    auto database = this->BuildDatabase(name, sides, record_size, keywords);
+    if (!data_path.empty())
+      this->persist(*database, data_path);
+    std::unique_lock<std::mutex> lck(this->databases_mtx);
+    this->pending_databases.erase(name);
+    if (this->databases.count(name))
+      throw std::runtime_error("Database " + name + " already exists");
+    this->databases[name] = database;
+  } catch (...) {
+    std::unique_lock<std::mutex> lck(this->databases_mtx);
+    this->pending_databases.erase(name);
+    throw;
+  }
+}
+
+/**
+ * A new, empty database and its drivers.
+ */
+std::shared_ptr<CloudDatabase>
+CloudClient::BuildDatabase(std::string name, std::vector<int> sides,
+                           int record_size, bool keywords) {
+  auto database = std::make_shared<CloudDatabase>();
+  database->name = name;
+  RecordLayout layout =
+      record_size > 0
+          ? RecordLayout::records(record_size, PLAINTEXT_MODULUS,
+                                  POLY_MODULUS_DEGREE)
+          : RecordLayout::scalar(PLAINTEXT_MODULUS);
+  database->hypercube_driver = std::make_shared<HypercubeDriver>(
+      sides, CryptoPP::Integer(PLAINTEXT_MODULUS), layout);
+  database->update_driver =
+      std::make_shared<UpdateDriver>(database->hypercube_driver);
+  if (keywords)
+    database->keyword_driver =
+        std::make_shared<KeywordDriver>(database->hypercube_driver);
+  if (record_size == 0)
+    database->loader_driver =
+        std::make_shared<LoaderDriver>(database->hypercube_driver);
+  return database;
+}
+
+/**
+ * The database with the given name; the default one if the name is empty.
+ */
+std::shared_ptr<CloudDatabase>
+CloudClient::database(const std::string &name) {
+  std::unique_lock<std::mutex> lck(this->databases_mtx);
+  auto found = this->databases.find(name.empty() ? DEFAULT_DATABASE : name);
+  if (found == this->databases.end())
+    throw std::runtime_error("Unknown database " + name);
+  return found->second;
+}
+
+/**
+ * The database the REPL is working on.
+ */
+std::shared_ptr<CloudDatabase> CloudClient::current() {
+  return this->database(this->current_database);
+}
+
+/**
+ * The shared context for a scheme. Every database uses the same parameters,
+ * so queries only pay for building one the first time a scheme is used.
+ */
+std::shared_ptr<seal::SEALContext>
+CloudClient::context(seal::scheme_type scheme) {
+  std::unique_lock<std::mutex> lck(this->contexts_mtx);
+  std::shared_ptr<seal::SEALContext> &context = this->contexts[scheme];
+  if (!context)
+    context = std::make_shared<seal::SEALContext>(
+        make_parameters(scheme, POLY_MODULUS_DEGREE, PLAINTEXT_MODULUS));
+  return context;
+}
+
 /**
  * run
  */
@@ -41,13 +211,25 @@ void CloudClient::run(int port) {
   // Run REPL.
   REPLDriver<CloudClient> repl = REPLDriver<CloudClient>(this);
   repl.add_action("insert", "insert <key> <value>", &CloudClient::HandleInsert);
+  repl.add_action("record", "record <key> <text>",
+                  &CloudClient::HandleInsertRecord);
   repl.add_action("get", "get <key>", &CloudClient::HandleGet);
   repl.add_action("cube", "cube <filename>", &CloudClient::HandleCube);
+  repl.add_action("kwinsert", "kwinsert <keyword> <text>",
+                  &CloudClient::HandleKeywordInsert);
+  repl.add_action("stats", "stats", &CloudClient::HandleStats);
+  repl.add_action("trace", "trace <filename>", &CloudClient::HandleTrace);
+  repl.add_action("save", "save", &CloudClient::HandleSave);
+  repl.add_action("create", "create <name> <dimension> <sidelength>[x...] "
+                  "[record_size [keywords]]", &CloudClient::HandleCreate);
+  repl.add_action("use", "use <name>", &CloudClient::HandleUse);
+  repl.add_action("databases", "databases", &CloudClient::HandleDatabases);
   repl.run();
 }
 
 /**
- * Insert a value into the database
+ * Insert a value into the database. Point updates are batched and published
+ * in the background.
  */
 void CloudClient::HandleInsert(std::string input) {
   std::vector<std::string> input_split = string_split(input, ' ');
@@ -56,11 +238,53 @@ void CloudClient::HandleInsert(std::string input) {
     return;
   }
   int key = std::stoi(input_split[1]);
-  CryptoPP::Integer value = CryptoPP::Integer(std::stoi(input_split[2]));
-  this->hypercube_driver->insert(key, value);
+  std::uint64_t value = std::stoull(input_split[2]);
+  std::shared_ptr<CloudDatabase> database = this->current();
+  check_indexed(*database);
+  database->update_driver->submit(key, value);
   this->cli_driver->print_success("Inserted value!");
 }
 
+/**
+ * Insert a record into the database. Everything after the key is stored
+ * verbatim. Like insert, the update is published in the background.
+ */
+void CloudClient::HandleInsertRecord(std::string input) {
+  std::vector<std::string> input_split = string_split(input, ' ');
+  if (input_split.size() < 3) {
+    this->cli_driver->print_left("invalid number of arguments.");
+    return;
+  }
+  int key = std::stoi(input_split[1]);
+  std::size_t offset = input_split[0].size() + input_split[1].size() + 2;
+  std::shared_ptr<CloudDatabase> database = this->current();
+  check_indexed(*database);
+  database->update_driver->submit_record(key, str2chvec(input.substr(offset)));
+  this->cli_driver->print_success("Inserted record!");
+}
+
+/**
+ * Insert a record under a keyword. Everything after the keyword is stored
+ * verbatim.
+ */
+void CloudClient::HandleKeywordInsert(std::string input) {
+  std::vector<std::string> input_split = string_split(input, ' ');
+  if (input_split.size() < 3) {
+    this->cli_driver->print_left("invalid number of arguments.");
+    return;
+  }
+  std::shared_ptr<CloudDatabase> database = this->current();
+  if (!database->keyword_driver) {
+    this->cli_driver->print_warning(
+        "Database was not created for keywords; see create.");
+    return;
+  }
+  std::size_t offset = input_split[0].size() + input_split[1].size() + 2;
+  database->keyword_driver->insert(keyword_from_string(input_split[1]),
+                               str2chvec(input.substr(offset)));
+  this->cli_driver->print_success("Inserted keyword!");
+}
+
 /**
  * Get a value from the database
  */
@@ -71,12 +295,21 @@ void CloudClient::HandleGet(std::string input) {
     return;
   }
   int key = std::stoi(input_split[1]);
-  CryptoPP::Integer value = this->hypercube_driver->get(key);
+  std::shared_ptr<HypercubeDriver> hypercube_driver =
+      this->current()->hypercube_driver;
+  if (hypercube_driver->layout().record_size > 0) {
+    std::vector<unsigned char> record = hypercube_driver->get_record(key);
+    this->cli_driver->print_success("Get record: " + chvec2str(record));
+    return;
+  }
+  CryptoPP::Integer value = hypercube_driver->get(key);
   this->cli_driver->print_success("Get value: " + CryptoPP::IntToString(value));
 }
 
 /**
- * Get a file and put all values in the cube
+ * Get a file and put all values in the cube. The file is either CSV or the
+ * binary bulk format. Loading runs in the background; queries keep using the
+ * old database until the new one is swapped in.
  */
 void CloudClient::HandleCube(std::string input) {
   std::vector<std::string> input_split = string_split(input, ' ');
@@ -84,13 +317,224 @@ void CloudClient::HandleCube(std::string input) {
     this->cli_driver->print_left("invalid number of arguments.");
     return;
   }
-  std::vector<int> values = read_csv_values(input_split[1]);
-  for (int i = 0; i < values.size(); i++) {
-    CryptoPP::Integer value = CryptoPP::Integer(values[i]);
-    //std::cout << value << " ";
-    this->hypercube_driver->insert(i, value);
+  std::shared_ptr<LoaderDriver> loader_driver = this->current()->loader_driver;
+  if (!loader_driver) {
+    this->cli_driver->print_warning("Bulk loading needs a scalar hypercube.");
+    return;
+  }
+  std::string filename = input_split[1];
+  std::thread load_thread([this, loader_driver, filename]() {
+    try {
+      std::size_t count = loader_driver->load(filename);
+      this->cli_driver->print_success("Preset Hypercube with " +
+                                      std::to_string(count) + " values!");
+    } catch (std::exception &e) {
+      this->cli_driver->print_warning("Failed to load " + filename + ": " +
+                                      e.what());
+    }
+  });
+  load_thread.detach();
+  this->cli_driver->print_left("Loading " + filename + " in the background.");
+}
+
+/**
+ * Print live server metrics.
+ */
+void CloudClient::HandleStats(std::string input) {
+  this->cli_driver->print_left(this->ReadMetrics().summary());
+}
+
+/**
+ * Write the spans of recent queries to a file in Chrome trace-event JSON.
+ */
+void CloudClient::HandleTrace(std::string input) {
+  std::vector<std::string> input_split = string_split(input, ' ');
+  if (input_split.size() != 2) {
+    this->cli_driver->print_left("invalid number of arguments.");
+    return;
+  }
+  try {
+    this->trace_driver->dump(input_split[1]);
+    this->cli_driver->print_success("Wrote trace to " + input_split[1]);
+  } catch (std::exception &e) {
+    this->cli_driver->print_warning(e.what());
+  }
+}
+
+/**
+ * Write a snapshot of the current database now, instead of waiting for the
+ * log to fill up.
+ */
+void CloudClient::HandleSave(std::string input) {
+  std::shared_ptr<PersistenceDriver> persistence_driver =
+      this->current()->persistence_driver;
+  if (!persistence_driver) {
+    this->cli_driver->print_warning("No data path given.");
+    return;
+  }
+  try {
+    std::uint64_t version = persistence_driver->save();
+    this->cli_driver->print_success("Saved version " +
+                                    std::to_string(version));
+  } catch (std::exception &e) {
+    this->cli_driver->print_warning(e.what());
+  }
+}
+
+/**
+ * Accept bulk updates that carry the given token. Without one, the cloud
+ * refuses every bulk update.
+ */
+void CloudClient::SetUpdateToken(std::string token) {
+  this->update_token = token;
+}
+
+/**
+ * Host another database: create <name> <dimension> <sidelength>[x...]
+ * [record_size [keywords]].
+ */
+void CloudClient::HandleCreate(std::string input) {
+  std::vector<std::string> input_split = string_split(input, ' ');
+  if (input_split.size() < 4 || input_split.size() > 6 ||
+      (input_split.size() == 6 && input_split[5] != "keywords")) {
+    this->cli_driver->print_left("invalid number of arguments.");
+    return;
+  }
+  try {
+    this->AddDatabase(
+        input_split[1], parse_sides(std::stoi(input_split[2]), input_split[3]),
+        input_split.size() >= 5 ? std::stoi(input_split[4]) : 0,
+        input_split.size() == 6);
+    this->cli_driver->print_success("Created database " + input_split[1]);
+  } catch (std::exception &e) {
+    this->cli_driver->print_warning(e.what());
+  }
+}
+
+/**
+ * Point the REPL's commands at another database.
+ */
+void CloudClient::HandleUse(std::string input) {
+  std::vector<std::string> input_split = string_split(input, ' ');
+  if (input_split.size() != 2) {
+    this->cli_driver->print_left("invalid number of arguments.");
+    return;
+  }
+  try {
+    this->current_database = this->database(input_split[1])->name;
+    this->cli_driver->print_success("Using database " + input_split[1]);
+  } catch (std::exception &e) {
+    this->cli_driver->print_warning(e.what());
+  }
+}
+
+/**
+ * List the hosted databases with their shape, size and version.
+ */
+void CloudClient::HandleDatabases(std::string input) {
+  std::unique_lock<std::mutex> lck(this->databases_mtx);
+  std::string listing;
+  for (auto &entry : this->databases) {
+    std::shared_ptr<HypercubeDriver> hypercube_driver =
+        entry.second->hypercube_driver;
+    std::shared_ptr<const HypercubeSnapshot> snapshot =
+        hypercube_driver->snapshot();
+    listing += (entry.first == this->current_database ? "* " : "  ") +
+               entry.first + " " + shape_name(hypercube_driver->geometry().shape()) +
+               ", " + std::to_string(snapshot->populated) + "/" +
+               std::to_string(snapshot->size()) + " populated, version " +
+               std::to_string(snapshot->version) + "\n";
+  }
+  this->cli_driver->print_left(listing);
+}
+
+/**
+ * Keep every database under path: the default one at path itself, others
+ * at path-<name>. Restores whatever is found there and logs every later
+ * update; databases created later are restored and kept the same way. Must
+ * be called before serving. Returns the default database's version.
+ */
+std::uint64_t CloudClient::EnablePersistence(std::string path) {
+  std::vector<std::shared_ptr<CloudDatabase>> existing;
+  {
+    std::unique_lock<std::mutex> lck(this->databases_mtx);
+    this->data_path = path;
+    for (auto &entry : this->databases)
+      existing.push_back(entry.second);
+  }
+  for (auto &database : existing)
+    this->persist(*database, path);
+  return this->database(DEFAULT_DATABASE)->hypercube_driver->version();
+}
+
+/**
+ * Restore a database from under data_path and keep logging it there. Called
+ * without databases_mtx held, as restoring a large database takes a while.
+ */
+void CloudClient::persist(CloudDatabase &database,
+                          const std::string &data_path) {
+  std::string path = database.name == DEFAULT_DATABASE
+                         ? data_path
+                         : data_path + "-" + database.name;
+  database.persistence_driver =
+      std::make_shared<PersistenceDriver>(database.hypercube_driver, path);
+  database.persistence_driver->restore();
+  if (database.keyword_driver)
+    database.keyword_driver->restore(path + ".keys");
+}
+
+/**
+ * Dump the trace of every query slower than threshold to
+ * slow-query-<id>.json.
+ */
+void CloudClient::SetSlowQueryThreshold(std::chrono::milliseconds threshold) {
+  this->trace_driver->set_slow_threshold(threshold);
+}
+
+/**
+ * Periodically write the metrics to a file in Prometheus text format, for a
+ * node exporter's textfile collector or similar to pick up.
+ */
+void CloudClient::StartMetricsDump(std::string filename) {
+  this->metrics_driver->start_dump(
+      filename, [this]() { return this->ReadMetrics().prometheus(); });
+}
+
+/**
+ * Merge the per-thread counters and add gauges for the databases, update
+ * queues and SEAL memory pools. Entries, populated entries, queue depth and
+ * log size are summed over every database; the version is the default
+ * database's.
+ */
+MetricsSnapshot CloudClient::ReadMetrics() {
+  MetricsSnapshot metrics = this->metrics_driver->read();
+  metrics.gauges["pir_databases"] = 0;
+  metrics.gauges["pir_database_entries"] = 0;
+  metrics.gauges["pir_database_populated"] = 0;
+  metrics.gauges["pir_update_queue_depth"] = 0;
+  {
+    std::unique_lock<std::mutex> lck(this->databases_mtx);
+    for (auto &entry : this->databases) {
+      CloudDatabase &database = *entry.second;
+      std::shared_ptr<const HypercubeSnapshot> snapshot =
+          database.hypercube_driver->snapshot();
+      metrics.gauges["pir_databases"] += 1;
+      metrics.gauges["pir_database_entries"] += snapshot->size();
+      metrics.gauges["pir_database_populated"] += snapshot->populated;
+      if (entry.first == DEFAULT_DATABASE)
+        metrics.gauges["pir_database_version"] = snapshot->version;
+      metrics.gauges["pir_update_queue_depth"] +=
+          database.update_driver->pending_count();
+      if (database.persistence_driver)
+        metrics.gauges["pir_snapshot_log_bytes"] +=
+            database.persistence_driver->log_bytes();
+    }
   }
-  this->cli_driver->print_success("Preset Hypercube!");
+  metrics.gauges["pir_seal_pool_bytes"] =
+      seal::MemoryManager::GetPool().alloc_byte_count();
+  metrics.gauges["pir_seal_worker_pool_bytes"] =
+      this->workspace_pool->alloc_byte_count();
+  return metrics;
 }
 
 /**
@@ -105,7 +549,8 @@ void CloudClient::ListenForConnections(int port) {
         std::make_shared<CryptoDriver>();
     network_driver->listen(port);
     std::thread connection_thread(&CloudClient::HandleSend, this,
-                                  network_driver, crypto_driver);
+                                  network_driver, crypto_driver,
+                                  std::chrono::steady_clock::now());
     connection_thread.detach();
   }
 }
@@ -144,100 +589,279 @@ CloudClient::HandleKeyExchange(std::shared_ptr<NetworkDriver> network_driver,
 }
 
 /**
- * Obliviously send a value to the retriever. This function should:
- * 1) Generate parameters and context.
- * 2) Receive the selection vector.
- * 3) Evaluate and return a response using homomorphic operations.
+ * Serve one connection and record it in the metrics. A failed connection is
+ * logged and counted as an error.
  */
 void CloudClient::HandleSend(std::shared_ptr<NetworkDriver> network_driver,
-                             std::shared_ptr<CryptoDriver> crypto_driver) {
+                             std::shared_ptr<CryptoDriver> crypto_driver,
+                             std::chrono::steady_clock::time_point accepted) {
+  static const std::uint32_t ACCEPT = trace_name("accept");
+  std::uint64_t query_id = this->trace_driver->next_query();
+  auto start = std::chrono::steady_clock::now();
+  this->trace_driver->record(ACCEPT, query_id, accepted, start);
+  this->metrics_driver->connection_opened();
+  try {
+    this->ServeQuery(network_driver, crypto_driver, query_id);
+  } catch (std::exception &e) {
+    this->metrics_driver->error();
+    CUSTOM_LOG(lg, warning) << "Connection failed: " << e.what();
+  }
+  auto end = std::chrono::steady_clock::now();
+  this->metrics_driver->observe(ServerPhase::TOTAL, end - start);
+  this->metrics_driver->connection_closed();
+  this->trace_driver->finish_query(query_id, accepted, end);
+}
+
+/**
+ * Obliviously send a value to the retriever, timing each phase and tracing
+ * each step under query_id. This function should:
+ * 1) Receive the query. XOR-shared queries are answered by HandleXorQuery,
+ *    and inserts by HandleRemoteInsert.
+ * 2) Generate parameters and context.
+ * 3) Evaluate and return a response using homomorphic operations.
+ */
+void CloudClient::ServeQuery(std::shared_ptr<NetworkDriver> network_driver,
+                             std::shared_ptr<CryptoDriver> crypto_driver,
+                             std::uint64_t query_id) {
+  static const std::uint32_t HANDSHAKE = trace_name("handshake");
+  static const std::uint32_t RECEIVE = trace_name("receive");
+  static const std::uint32_t DESERIALIZE = trace_name("deserialize");
+  static const std::uint32_t XOR_ANSWER = trace_name("xor_answer");
+  static const std::uint32_t SERIALIZE = trace_name("serialize");
+  static const std::uint32_t SEND = trace_name("send");
+
+  auto mark = std::chrono::steady_clock::now();
+  auto lap = [this, &mark](ServerPhase phase) {
+    auto now = std::chrono::steady_clock::now();
+    this->metrics_driver->observe(phase, now - mark);
+    mark = now;
+  };
+  auto span_start = mark;
+  auto span = [this, query_id, &span_start](std::uint32_t name) {
+    auto now = std::chrono::steady_clock::now();
+    this->trace_driver->record(name, query_id, span_start, now);
+    span_start = now;
+  };
+
   // Key exchange with server. From here on out, any outgoing messages should
   // be encrypted and MAC tagged. Incoming messages should be decrypted and have
   // their MAC checked.
+  network_driver->set_phase("handshake");
   auto keys = this->HandleKeyExchange(network_driver, crypto_driver);
-  //std::cout << "Key exchange completed" << std::endl;
-
-  EncryptionParameters parms(scheme_type::bfv);
-
-  parms.set_poly_modulus_degree(POLY_MODULUS_DEGREE);
-  parms.set_coeff_modulus(CoeffModulus::BFVDefault(POLY_MODULUS_DEGREE));
-  parms.set_plain_modulus((PLAINTEXT_MODULUS));
-
-  SEALContext context(parms);
-  seal::Evaluator evaluator(context);
-  //std::cout << "Generated parameters and context " << std::endl;
+  span(HANDSHAKE);
+  lap(ServerPhase::HANDSHAKE);
 
+  network_driver->set_phase("query");
   std::vector<unsigned char> wrapped_query = network_driver->read();
+  span(RECEIVE);
   std::pair<std::vector<unsigned char>, bool> unwrapped_query = crypto_driver->decrypt_and_verify(keys.first,keys.second,wrapped_query);
-  UserToServer_Query_Message query_message;
-  query_message.deserialize(unwrapped_query.first,context);
-  seal::RelinKeys relinKeys = query_message.rks;
-  std::vector<seal::Ciphertext> query = query_message.query;
-  //std::cout << " Received the selection vector" << std::endl;
-
-  /**
-  std::vector<seal::Ciphertext> newCube;
-  //std::cout << "Original Cube: [";
-  for (int i = 0; i < pow(sidelength,dimension); i++) {
-    CryptoPP::Integer element = hypercube_driver->get(i);
-    //std::cout << " " << std::to_string(element.ConvertToLong()) << ",";
-    seal::Plaintext plaintext(std::to_string(element.ConvertToLong()));
-    seal::Ciphertext result;
-    evaluator.multiply_plain(query[i/sidelength],plaintext,result);
-    newCube.push_back(result);
-  }
-  //std::cout << "]" << std::endl;
-
-  if (dimension > 1) {
-    for (int j = 1; j < dimension; j++) {
-      for (int i = 0; i < pow(sidelength,dimension); i++) {
-        evaluator.multiply_inplace(newCube[i],query[sidelength*j+i%sidelength]);
-        evaluator.relinearize_inplace(newCube[i],relinKeys);
-      }
-    }
-  }**/
-
-  std::vector<seal::Ciphertext> newCube;
-  for (int i = 0; i < dimension; i++) {
-    for (int j = 0; j < pow(sidelength,dimension); j++) {
-      std::vector<int> coords = hypercube_driver->to_coords(j);
-      if (i == 0) {
-        uint64_t temp = static_cast<uint64_t>(hypercube_driver->get(j).ConvertToLong());
-        //std::cout << "Multiplying " << std::to_string(hypercube_driver->get(j).ConvertToLong()) << " in hex " << seal::util::uint_to_hex_string(&temp, std::size_t(1)) << std::endl;
-        if (temp != 0) {
-          seal::Plaintext plaintext(seal::util::uint_to_hex_string(&temp, std::size_t(1)));
-          seal::Ciphertext result;
-          evaluator.multiply_plain(query[coords[i]],plaintext,result);
-          newCube.push_back(result);
-        }
-      }
-      /**
-      if (i == 0) {
-        seal::Plaintext plaintext(std::to_string(hypercube_driver->get(j).ConvertToLong()));
-        seal::Ciphertext result;
-        evaluator.multiply_plain(query[coords[i]],plaintext,result);
-        newCube.push_back(result);
-      }**/
-      else {
-        evaluator.multiply_inplace(newCube[j],query[sidelength*i+coords[i]]);
-        evaluator.relinearize_inplace(newCube[j],relinKeys);
-      }
-
-    }
+  // Nothing that fails its MAC is acted on; the connection is dropped.
+  if (!unwrapped_query.second)
+    throw std::runtime_error("Message failed MAC verification");
+  network_driver->set_phase("response");
+  if (get_message_type(unwrapped_query.first) ==
+      MessageType::UserToServer_XorQuery_Message) {
+    span(DESERIALIZE);
+    lap(ServerPhase::DESERIALIZE);
+    // XOR answers are cheap enough that sending them is counted in evaluate.
+    this->HandleXorQuery(network_driver, crypto_driver, keys,
+                         unwrapped_query.first);
+    span(XOR_ANSWER);
+    lap(ServerPhase::EVALUATE);
+    this->metrics_driver->query_served();
+    return;
   }
-
-  seal::Ciphertext query_result;
-  for (int i = 0; i < pow(sidelength,dimension); i++) {
-    if (i==0) query_result = newCube[i];
-    else evaluator.add_inplace(query_result,newCube[i]);
+  if (get_message_type(unwrapped_query.first) ==
+      MessageType::UserToServer_Insert_Message) {
+    this->HandleRemoteInsert(network_driver, crypto_driver, keys,
+                             unwrapped_query.first);
+    return;
+  }
+  if (get_message_type(unwrapped_query.first) ==
+      MessageType::UserToServer_Update_Message) {
+    this->HandleRemoteUpdate(network_driver, crypto_driver, keys,
+                             unwrapped_query.first);
+    return;
   }
+  if (get_message_type(unwrapped_query.first) ==
+      MessageType::UserToServer_Epoch_Message) {
+    this->HandleEpochQuery(network_driver, crypto_driver, keys,
+                           unwrapped_query.first);
+    return;
+  }
+
+  // Agents pick the scheme; use its context to read the keys.
+  std::shared_ptr<SEALContext> context =
+      this->context(get_query_scheme(unwrapped_query.first));
+
+  UserToServer_Query_Message query_message;
+  query_message.deserialize(unwrapped_query.first, *context);
+  seal::RelinKeys relinKeys = std::move(query_message.rks);
+  std::vector<seal::Ciphertext> query = std::move(query_message.query);
+  std::shared_ptr<HypercubeDriver> hypercube_driver =
+      this->database(query_message.database)->hypercube_driver;
+  span(DESERIALIZE);
+  lap(ServerPhase::DESERIALIZE);
+
+  // Pin one version of the database for the whole evaluation, and evaluate
+  // in a recycled workspace with its own memory pool.
+  std::shared_ptr<const HypercubeSnapshot> snapshot =
+      hypercube_driver->snapshot();
+  std::shared_ptr<EvaluationWorkspace> workspace =
+      this->workspace_pool->acquire();
+  EvaluatorDriver evaluator(*context, hypercube_driver->geometry().plan(),
+                            workspace.get());
+  evaluator.set_trace(this->trace_driver.get(), query_id);
+  std::vector<seal::Ciphertext> query_result =
+      evaluator.evaluate(*snapshot, query, relinKeys);
+  // Batches download as one ciphertext where the entries fit.
+  std::size_t stride = evaluator.pack(query_result, snapshot->layout);
+  span_start = std::chrono::steady_clock::now();
+  lap(ServerPhase::EVALUATE);
 
   ServerToUser_Response_Message *message = new ServerToUser_Response_Message();
-  message->response = query_result;
+  message->response = std::move(query_result);
+  message->stride = stride;
+  message->version = snapshot->version;
+  message->instance = this->instance;
 
   std::vector<unsigned char> final_result = crypto_driver->encrypt_and_tag(keys.first,keys.second,message);
+  span(SERIALIZE);
   network_driver->send(final_result);
+  span(SEND);
+  lap(ServerPhase::RESPOND);
+  this->metrics_driver->query_served();
   //std::cout << "Evaluated and returned a response using homomorphic operations" << std::endl;
 }
 
+/**
+ * Answer one share of a two-server query: XOR the selected entries of one
+ * pinned snapshot and report its version, so the agent can tell whether
+ * both replicas answered from the same data.
+ */
+void CloudClient::HandleXorQuery(
+    std::shared_ptr<NetworkDriver> network_driver,
+    std::shared_ptr<CryptoDriver> crypto_driver,
+    std::pair<CryptoPP::SecByteBlock, CryptoPP::SecByteBlock> keys,
+    std::vector<unsigned char> data) {
+  UserToServer_XorQuery_Message query_message;
+  query_message.deserialize(data);
+
+  std::shared_ptr<const HypercubeSnapshot> snapshot =
+      this->database(query_message.database)->hypercube_driver->snapshot();
+  XorEvaluatorDriver evaluator;
+  ServerToUser_XorResponse_Message message;
+  message.version = snapshot->version;
+  message.instance = this->instance;
+  for (auto &selection : query_message.selections)
+    message.answers.push_back(evaluator.evaluate(*snapshot, selection));
+
+  std::vector<unsigned char> final_result =
+      crypto_driver->encrypt_and_tag(keys.first, keys.second, &message);
+  network_driver->send(final_result);
+}
+
+/**
+ * Report the epoch of the database an agent's cached results depend on. The
+ * database is named inside the encrypted channel, like a query's.
+ */
+void CloudClient::HandleEpochQuery(
+    std::shared_ptr<NetworkDriver> network_driver,
+    std::shared_ptr<CryptoDriver> crypto_driver,
+    std::pair<CryptoPP::SecByteBlock, CryptoPP::SecByteBlock> keys,
+    std::vector<unsigned char> data) {
+  UserToServer_Epoch_Message epoch_message;
+  epoch_message.deserialize(data);
+
+  ServerToUser_Epoch_Message message;
+  message.epoch.instance = this->instance;
+  try {
+    message.epoch.version = this->database(epoch_message.database)
+                                ->hypercube_driver->snapshot()
+                                ->version;
+  } catch (std::runtime_error &e) {
+    // Unknown databases fail on the query itself; report version 0 here.
+  }
+
+  std::vector<unsigned char> final_result =
+      crypto_driver->encrypt_and_tag(keys.first, keys.second, &message);
+  network_driver->send(final_result);
+}
+
+/**
+ * Queue an insert sent by an agent, if remote inserts are enabled. Like the
+ * REPL's insert, it is published in the background.
+ */
+void CloudClient::HandleRemoteInsert(
+    std::shared_ptr<NetworkDriver> network_driver,
+    std::shared_ptr<CryptoDriver> crypto_driver,
+    std::pair<CryptoPP::SecByteBlock, CryptoPP::SecByteBlock> keys,
+    std::vector<unsigned char> data) {
+  UserToServer_Insert_Message insert_message;
+  insert_message.deserialize(data);
+
+  ServerToUser_InsertResult_Message message;
+  message.accepted = false;
+  if (this->remote_inserts) {
+    try {
+      std::shared_ptr<CloudDatabase> database =
+          this->database(insert_message.database);
+      check_indexed(*database);
+      database->update_driver->submit(insert_message.index,
+                                      insert_message.value);
+      message.accepted = true;
+    } catch (std::exception &e) {
+      CUSTOM_LOG(lg, warning) << "Rejected remote insert: " << e.what();
+    }
+  }
+
+  std::vector<unsigned char> final_result =
+      crypto_driver->encrypt_and_tag(keys.first, keys.second, &message);
+  network_driver->send(final_result);
+}
+
+/**
+ * Apply a bulk update from the network and reply with the version it was
+ * published as. Every mutation of the update is published together, or
+ * none is: the update is rejected if its token is wrong, if the database
+ * has moved past its base version or if any mutation is invalid. Bulk
+ * updates bypass the update queue, so they are visible as soon as the reply
+ * is sent.
+ */
+void CloudClient::HandleRemoteUpdate(
+    std::shared_ptr<NetworkDriver> network_driver,
+    std::shared_ptr<CryptoDriver> crypto_driver,
+    std::pair<CryptoPP::SecByteBlock, CryptoPP::SecByteBlock> keys,
+    std::vector<unsigned char> data) {
+  ServerToUser_UpdateResult_Message message;
+  message.accepted = false;
+  message.version = 0;
+  try {
+    UserToServer_Update_Message update_message;
+    update_message.deserialize(data);
+    if (this->update_token.empty() ||
+        !same_secret(update_message.token, this->update_token))
+      throw std::runtime_error("Update not authorized");
+    std::shared_ptr<CloudDatabase> database =
+        this->database(update_message.database);
+    std::shared_ptr<HypercubeDriver> hypercube_driver =
+        database->hypercube_driver;
+    try {
+      check_indexed(*database);
+      message.version = hypercube_driver->apply(
+          entry_updates(*hypercube_driver, update_message.mutations),
+          update_message.base_version);
+      message.accepted = true;
+    } catch (std::exception &e) {
+      message.version = hypercube_driver->version();
+      throw;
+    }
+  } catch (std::exception &e) {
+    message.error = e.what();
+    CUSTOM_LOG(lg, warning) << "Rejected remote update: " << e.what();
+  }
 
+  std::vector<unsigned char> final_result =
+      crypto_driver->encrypt_and_tag(keys.first, keys.second, &message);
+  network_driver->send(final_result);
+}
@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <thread>
+
+#include "../../include/pkg/loadgen.hpp"
+
+namespace {
+const std::size_t BUCKETS_PER_DOUBLING = 4;
+// Up to 2^40us, about 12 days.
+const std::size_t HISTOGRAM_BUCKETS = 40 * BUCKETS_PER_DOUBLING + 1;
+} // namespace
+
+LatencyHistogram::LatencyHistogram() : counts(HISTOGRAM_BUCKETS, 0) {}
+
+/**
+ * Record one latency.
+ */
+void LatencyHistogram::record(double micros) {
+  std::size_t i = 0;
+  if (micros >= 1)
+    i = std::min<std::size_t>(
+        static_cast<std::size_t>(std::log2(micros) * BUCKETS_PER_DOUBLING) + 1,
+        HISTOGRAM_BUCKETS - 1);
+  this->counts[i]++;
+  this->total++;
+  this->sum += micros;
+  this->maximum = std::max(this->maximum, micros);
+}
+
+/**
+ * Add another histogram's samples to this one.
+ */
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+  for (std::size_t i = 0; i < this->counts.size(); i++)
+    this->counts[i] += other.counts[i];
+  this->total += other.total;
+  this->sum += other.sum;
+  this->maximum = std::max(this->maximum, other.maximum);
+}
+
+double LatencyHistogram::mean() const {
+  return this->total ? this->sum / this->total : 0;
+}
+
+/**
+ * Upper bound of the bucket holding the p-th percentile, capped at the
+ * largest sample.
+ */
+double LatencyHistogram::percentile(double p) const {
+  if (this->total == 0)
+    return 0;
+  std::uint64_t rank = std::max<std::uint64_t>(
+      1, static_cast<std::uint64_t>(std::ceil(p / 100.0 * this->total)));
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < this->counts.size(); i++) {
+    seen += this->counts[i];
+    if (seen >= rank)
+      return std::min(bucket_upper(i), this->maximum);
+  }
+  return this->maximum;
+}
+
+/**
+ * Exclusive upper bound of bucket i, in microseconds.
+ */
+double LatencyHistogram::bucket_upper(std::size_t i) {
+  return std::pow(2.0, static_cast<double>(i) / BUCKETS_PER_DOUBLING);
+}
+
+KeyDistribution KeyDistribution::uniform(std::size_t n) {
+  KeyDistribution distribution;
+  distribution.n = n;
+  return distribution;
+}
+
+KeyDistribution KeyDistribution::zipf(std::size_t n, double s) {
+  KeyDistribution distribution;
+  distribution.n = n;
+  distribution.cdf.resize(n);
+  double total = 0;
+  for (std::size_t k = 0; k < n; k++) {
+    total += 1.0 / std::pow(static_cast<double>(k + 1), s);
+    distribution.cdf[k] = total;
+  }
+  for (double &c : distribution.cdf)
+    c /= total;
+  return distribution;
+}
+
+/**
+ * Draw one key.
+ */
+int KeyDistribution::sample(std::mt19937_64 &rng) const {
+  if (this->cdf.empty())
+    return std::uniform_int_distribution<std::size_t>(0, this->n - 1)(rng);
+  double u = std::uniform_real_distribution<double>(0, 1)(rng);
+  auto it = std::lower_bound(this->cdf.begin(), this->cdf.end(), u);
+  return std::min<std::size_t>(it - this->cdf.begin(), this->n - 1);
+}
+
+/**
+ * Print throughput, latency percentiles and the non-empty histogram buckets
+ * of each operation type.
+ */
+void LoadReport::print(std::ostream &out) const {
+  std::uint64_t completed = this->queries.count() + this->updates.count();
+  out << std::fixed << std::setprecision(2);
+  out << "elapsed " << this->elapsed << " s, " << completed << " ops, "
+      << (this->elapsed > 0 ? completed / this->elapsed : 0) << " ops/s, "
+      << this->errors << " errors, " << this->rejected << " rejected"
+      << std::endl;
+  for (auto &named : {std::make_pair("query", &this->queries),
+                      std::make_pair("update", &this->updates)}) {
+    const LatencyHistogram &histogram = *named.second;
+    if (histogram.count() == 0)
+      continue;
+    out << named.first << ": " << histogram.count() << " ops, "
+        << histogram.count() / std::max(this->elapsed, 1e-9) << " ops/s, ms"
+        << " mean " << histogram.mean() / 1000 << " p50 "
+        << histogram.percentile(50) / 1000 << " p90 "
+        << histogram.percentile(90) / 1000 << " p99 "
+        << histogram.percentile(99) / 1000 << " p99.9 "
+        << histogram.percentile(99.9) / 1000 << " max "
+        << histogram.max() / 1000 << std::endl;
+    std::uint64_t largest = 0;
+    for (std::size_t i = 0; i < histogram.buckets(); i++)
+      largest = std::max(largest, histogram.bucket_count(i));
+    for (std::size_t i = 0; i < histogram.buckets(); i++) {
+      if (histogram.bucket_count(i) == 0)
+        continue;
+      int bar = static_cast<int>(40 * histogram.bucket_count(i) / largest);
+      out << "  < " << std::setw(10) << LatencyHistogram::bucket_upper(i) / 1000
+          << " ms " << std::setw(8) << histogram.bucket_count(i) << " "
+          << std::string(std::max(bar, 1), '#') << std::endl;
+    }
+  }
+}
+
+/**
+ * Constructor.
+ */
+LoadGenerator::LoadGenerator(LoadConfig config, Operation operation)
+    : config(config), operation(operation) {
+  if (config.sessions < 1 || (config.open_loop && config.rate <= 0))
+    throw std::runtime_error("Invalid load configuration");
+}
+
+/**
+ * Operations that go through the agent over the real network path: queries
+ * with DoQuery, updates with DoInsert.
+ */
+LoadGenerator::Operation
+LoadGenerator::agent_operation(std::shared_ptr<AgentClient> agent) {
+  return [agent](bool update, int key) {
+    std::shared_ptr<NetworkDriver> network_driver =
+        std::make_shared<NetworkDriverImpl>();
+    std::shared_ptr<CryptoDriver> crypto_driver =
+        std::make_shared<CryptoDriver>();
+    if (update)
+      return agent->DoInsert(network_driver, crypto_driver, key, key);
+    agent->DoQuery(network_driver, crypto_driver, key);
+    return true;
+  };
+}
+
+/**
+ * Run the configured load for its duration and collect the results. In open
+ * loop, arrival k is due at start + k / rate and is picked up by whichever
+ * session is free; its latency counts from when it was due, so queueing
+ * behind slow operations shows up instead of being hidden.
+ */
+LoadReport LoadGenerator::run() {
+  using clock = std::chrono::steady_clock;
+  auto start = clock::now();
+  auto end = start + std::chrono::duration_cast<clock::duration>(
+                         std::chrono::duration<double>(this->config.duration));
+  std::atomic<std::uint64_t> next_arrival{0};
+  std::vector<LoadReport> reports(this->config.sessions);
+  std::vector<std::thread> sessions;
+  for (int w = 0; w < this->config.sessions; w++) {
+    sessions.emplace_back([this, w, start, end, &next_arrival, &reports]() {
+      LoadReport &report = reports[w];
+      std::mt19937_64 rng(std::random_device{}() + w);
+      std::uniform_real_distribution<double> coin(0, 1);
+      while (true) {
+        clock::time_point due = clock::now();
+        if (this->config.open_loop) {
+          std::uint64_t k = next_arrival++;
+          due = start + std::chrono::duration_cast<clock::duration>(
+                            std::chrono::duration<double>(k / this->config.rate));
+          if (due >= end)
+            break;
+          std::this_thread::sleep_until(due);
+        } else if (due >= end) {
+          break;
+        }
+
+        bool update = coin(rng) < this->config.update_fraction;
+        int key = this->config.keys.sample(rng);
+        try {
+          if (!this->operation(update, key))
+            report.rejected++;
+        } catch (std::exception &e) {
+          report.errors++;
+          continue;
+        }
+        double micros = std::chrono::duration<double, std::micro>(
+                            clock::now() - due)
+                            .count();
+        (update ? report.updates : report.queries).record(micros);
+      }
+    });
+  }
+  for (std::thread &session : sessions)
+    session.join();
+
+  LoadReport total;
+  total.elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  for (LoadReport &report : reports) {
+    total.errors += report.errors;
+    total.rejected += report.rejected;
+    total.queries.merge(report.queries);
+    total.updates.merge(report.updates);
+  }
+  return total;
+}
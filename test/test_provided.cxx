@@ -2,6 +2,15 @@
 #include "doctest/doctest.h"
 #include "../include-shared/logger.hpp"
 #include "../include/drivers/hypercube_driver.hpp"
+#include "../include/drivers/keyword_driver.hpp"
+#include "../include/drivers/loader_driver.hpp"
+#include "../include/drivers/metrics_driver.hpp"
+#include "../include/drivers/persistence_driver.hpp"
+#include "../include/drivers/result_cache_driver.hpp"
+#include "../include/drivers/thread_pool_driver.hpp"
+#include "../include/drivers/trace_driver.hpp"
+#include "../include/drivers/update_driver.hpp"
+#include "../include/drivers/xor_driver.hpp"
 #include "../include/pkg/agent.hpp"
 
 #include "../include-shared/constants.hpp"
@@ -10,6 +19,10 @@
 #include "../src/drivers/repl_driver.cxx"
 #include "../include/pkg/cloud.hpp"
 #include "pkg/benchmark.hpp"
+#include "pkg/loadgen.hpp"
+
+#include <filesystem>
+#include <functional>
 
 TEST_CASE("sample") { CHECK(true); }
 
@@ -32,55 +45,960 @@ TEST_CASE("createBenchmark") {
 TEST_CASE("getBenchmark0") {
     BenchmarkClient client = BenchmarkClient(2,3);
     int result = client.get(0);
-    CHECK(result == 1);
+    CHECK(result == 0);
 }
 
 TEST_CASE("getBenchmark1") {
     BenchmarkClient client = BenchmarkClient(2,3);
     int result = client.get(1);
-    CHECK(result == 1);
+    CHECK(result == 0);
 }
 
 TEST_CASE("getBenchmark2") {
     BenchmarkClient client = BenchmarkClient(2,3);
     int result = client.get(2);
-    CHECK(result == 1);
+    CHECK(result == 0);
 }
 
 TEST_CASE("getBenchmark3") {
     BenchmarkClient client = BenchmarkClient(2,3);
     int result = client.get(3);
-    CHECK(result == 1);
+    CHECK(result == 0);
 }
 
 TEST_CASE("getBenchmark4") {
     BenchmarkClient client = BenchmarkClient(2,3);
     int result = client.get(4);
-    CHECK(result == 1);
+    CHECK(result == 0);
 }
 
 TEST_CASE("getBenchmark5") {
     BenchmarkClient client = BenchmarkClient(2,3);
     int result = client.get(5);
-    CHECK(result == 1);
+    CHECK(result == 0);
 }
 
 TEST_CASE("getBenchmark6") {
     BenchmarkClient client = BenchmarkClient(2,3);
     int result = client.get(6);
-    CHECK(result == 1);
+    CHECK(result == 0);
 }
 
 TEST_CASE("getBenchmark7") {
     BenchmarkClient client = BenchmarkClient(2,3);
     int result = client.get(7);
-    CHECK(result == 1);
+    CHECK(result == 0);
 }
 
 TEST_CASE("getBenchmark8") {
     BenchmarkClient client = BenchmarkClient(2,3);
     int result = client.get(8);
-    CHECK(result == 1);
+    CHECK(result == 0);
+}
+
+
+TEST_CASE("packedStoreWidth") {
+    PackedValueStore store(9, PLAINTEXT_MODULUS, 1);
+    CHECK(store.width() == 2);
+    store.set(4, PLAINTEXT_MODULUS - 1);
+    CHECK(store.get(4) == PLAINTEXT_MODULUS - 1);
+    CHECK(store.get(3) == 1);
+}
+
+TEST_CASE("insertBenchmark") {
+    BenchmarkClient client = BenchmarkClient(2,3);
+    client.insert(4, 7);
+    CHECK(client.get(4) == 7);
+    CHECK(client.get(5) == 0);
+}
+
+TEST_CASE("hypercubeSnapshot") {
+    HypercubeDriver cube(2, 3, CryptoPP::Integer(PLAINTEXT_MODULUS));
+    std::shared_ptr<const HypercubeSnapshot> pinned = cube.snapshot();
+    cube.insert_many({{0, 5}, {8, 6}});
+    CHECK(pinned->get(0) == 0);
+    CHECK(cube.get_value(0) == 5);
+    CHECK(cube.get_value(8) == 6);
+    CHECK(cube.version() == pinned->version + 1);
+}
+
+TEST_CASE("hypercubeGeometry") {
+    static_assert(StaticGeometry<2, 8>::size == 64);
+    HypercubeGeometry geometry(3, 4);
+    std::vector<int> coords = geometry.to_coords(27);
+    CHECK(coords == std::vector<int>({1, 2, 3}));
+    CHECK(geometry.from_coords(coords) == 27);
+    CHECK(geometry.plan()->folds.size() == 3);
+    CHECK(geometry.plan()->folds[0].out_count == 16);
+}
+
+TEST_CASE("hypercubeRecords") {
+    RecordLayout layout = RecordLayout::records(512, PLAINTEXT_MODULUS, 256);
+    CHECK(layout.parts == 2);
+    HypercubeDriver cube(2, 3, CryptoPP::Integer(PLAINTEXT_MODULUS), layout);
+    std::vector<unsigned char> record(512);
+    for (int i = 0; i < record.size(); i++)
+        record[i] = i * 7;
+    cube.insert_record(5, record);
+    CHECK(cube.get_record(5) == record);
+    CHECK(cube.get_record(4).empty());
+    CHECK_THROWS(cube.insert_record(5, std::vector<unsigned char>(513)));
+}
+
+TEST_CASE("keywordCuckoo") {
+    auto cube = std::make_shared<HypercubeDriver>(
+        2, 8, CryptoPP::Integer(PLAINTEXT_MODULUS),
+        RecordLayout::records(24, PLAINTEXT_MODULUS, 256));
+    KeywordDriver keywords(cube);
+    for (int i = 0; i < 32; i++)
+        keywords.insert(keyword_from_id(i), str2chvec("value" + std::to_string(i)));
+    CHECK(keywords.size() == 32);
+    for (int i = 0; i < 32; i++) {
+        std::vector<unsigned char> key = keyword_from_id(i);
+        // The agent only sees the candidates; one of them must hold the key.
+        bool found = false;
+        for (int slot : keyword_candidates(key, cube->geometry().size())) {
+            auto value = keyword_untag_record(key, cube->get_record(slot));
+            if (value.second) {
+                CHECK(chvec2str(value.first) == "value" + std::to_string(i));
+                found = true;
+            }
+        }
+        CHECK(found);
+    }
+    CHECK(!keywords.get(keyword_from_id(1000)).second);
+}
+
+TEST_CASE("unevenGeometry") {
+    HypercubeGeometry geometry(std::vector<int>{4, 3, 2});
+    CHECK(geometry.size() == 24);
+    CHECK(geometry.query_size() == 9);
+    CHECK(geometry.offset(2) == 7);
+    CHECK(geometry.to_coords(23) == std::vector<int>({3, 2, 1}));
+    CHECK(geometry.from_coords(geometry.to_coords(17)) == 17);
+    CHECK(geometry.plan()->folds[1].out_count == 2);
+    CHECK(geometry.plan()->folds[1].selectors == std::vector<int>({4, 5, 6}));
+    CHECK(parse_sides(3, "64x32x8") == std::vector<int>({64, 32, 8}));
+    CHECK(parse_sides(2, "9") == std::vector<int>({9, 9}));
+    CHECK_THROWS(parse_sides(2, "4x4x4"));
+    CHECK(shape_name({64, 32, 8}) == "64x32x8");
+
+    BenchmarkClient client = BenchmarkClient({5, 2, 3}, ParameterProfile::standard());
+    client.insert(29, 8);
+    client.insert(7, 3);
+    CHECK(client.get(29) == 8);
+    CHECK(client.get(7) == 3);
+    CHECK(client.get(6) == 0);
+}
+
+TEST_CASE("bulkLoader") {
+    auto cube = std::make_shared<HypercubeDriver>(2, 16, CryptoPP::Integer(PLAINTEXT_MODULUS));
+    LoaderDriver loader(cube, 4);
+
+    std::string csv = "5,6,7\n8, 9,1030\n\n11";
+    std::size_t count;
+    auto values = loader.parse(csv.data(), csv.size(), count);
+    CHECK(count == 7);
+    CHECK(values->get(2) == 7);
+    CHECK(values->get(5) == 1030 % PLAINTEXT_MODULUS);
+    CHECK(values->get(7) == 0);
+
+    std::vector<std::uint64_t> expected;
+    for (int i = 0; i < 200; i++)
+        expected.push_back(i * 7);
+    write_bulk_values("bulk_loader_test.bin", expected, PLAINTEXT_MODULUS);
+    std::uint64_t version = cube->version();
+    CHECK(loader.load("bulk_loader_test.bin") == 200);
+    std::remove("bulk_loader_test.bin");
+    CHECK(cube->version() == version + 1);
+    for (int i = 0; i < 200; i++)
+        CHECK(cube->get_value(i) == expected[i] % PLAINTEXT_MODULUS);
+    CHECK(cube->get_value(255) == 0);
+    CHECK_THROWS(loader.parse("1,x", 3, count));
+}
+
+TEST_CASE("pagedUpdates") {
+    auto cube = std::make_shared<HypercubeDriver>(2, 32, CryptoPP::Integer(PLAINTEXT_MODULUS));
+    auto before = cube->snapshot();
+    cube->insert(5, (std::uint64_t)9);
+    auto after = cube->snapshot();
+    // Only the page holding entry 5 is copied.
+    CHECK(after->pages[0] != before->pages[0]);
+    for (int p = 1; p < after->pages.size(); p++)
+        CHECK(after->pages[p] == before->pages[p]);
+    CHECK(before->get(5) == 0);
+    CHECK(after->get(5) == 9);
+}
+
+TEST_CASE("sparseCube") {
+    auto cube = std::make_shared<HypercubeDriver>(2, 32, CryptoPP::Integer(PLAINTEXT_MODULUS));
+    CHECK(cube->snapshot()->populated == 0);
+    // Untouched pages are all the same empty page.
+    CHECK(cube->snapshot()->pages[1] == cube->snapshot()->pages[2]);
+    cube->insert_many({{3, 7}, {700, 9}, {701, 0}});
+    auto snapshot = cube->snapshot();
+    CHECK(snapshot->populated == 2);
+    CHECK(snapshot->pages[2]->occupied == std::vector<std::uint16_t>{700 - 512});
+    CHECK(snapshot->density() == 2.0 / 1024);
+    cube->insert(3, (std::uint64_t)0);
+    CHECK(cube->snapshot()->populated == 1);
+
+    BenchmarkClient client = BenchmarkClient(3, 9);
+    client.insert(100, 5);
+    client.insert(728, 6);
+    CHECK(client.get(100) == 5);
+    CHECK(client.get(728) == 6);
+    CHECK(client.get(101) == 0);
+}
+
+TEST_CASE("batchedUpdates") {
+    auto cube = std::make_shared<HypercubeDriver>(2, 32, CryptoPP::Integer(PLAINTEXT_MODULUS));
+    std::uint64_t version = cube->version();
+    {
+        UpdateDriver updates(cube, std::chrono::milliseconds(1000), std::chrono::milliseconds(5000));
+        for (int i = 0; i < 100; i++)
+            updates.submit(i, i + 1000);
+        updates.submit(3, 7);
+        CHECK_THROWS(updates.submit(1024, 1));
+        updates.flush();
+        CHECK(updates.pending_count() == 0);
+    }
+    // The whole burst is published as one snapshot.
+    CHECK(cube->version() == version + 1);
+    CHECK(cube->get_value(3) == 7);
+    CHECK(cube->get_value(99) == (99 + 1000) % PLAINTEXT_MODULUS);
+}
+
+TEST_CASE("shardedAgent") {
+    AgentClient agent = AgentClient({{"localhost", 8080}, {"localhost", 8081}, {"localhost", 8082}}, 2, 3);
+    CHECK(agent.size() == 27);
+    CHECK(agent.shard_of(0) == std::make_pair(0, 0));
+    CHECK(agent.shard_of(10) == std::make_pair(1, 1));
+    CHECK(agent.shard_of(26) == std::make_pair(2, 8));
+    CHECK_THROWS(agent.shard_of(27));
+
+    // Every shard is sent a selector for every key; only the shard holding
+    // a key has any ones in it, one per dimension at the key's coordinates.
+    std::vector<int> query = {0, 10, 26, 4};
+    std::vector<std::vector<unsigned char>> plan = agent.selector_plan(query);
+    REQUIRE(plan.size() == 3);
+    std::size_t query_size = 2 * 3;
+    for (int k = 0; k < 3; k++) {
+        REQUIRE(plan[k].size() == query.size() * query_size);
+        for (std::size_t j = 0; j < query.size(); j++) {
+            std::pair<int, int> location = agent.shard_of(query[j]);
+            int ones = 0;
+            for (std::size_t i = 0; i < query_size; i++)
+                ones += plan[k][j * query_size + i];
+            CHECK(ones == (location.first == k ? 2 : 0));
+        }
+    }
+    // Key 10 is local index 1 on shard 1: coordinates (0, 1).
+    CHECK(plan[1][1 * query_size + 0] == 1);
+    CHECK(plan[1][1 * query_size + 3 + 1] == 1);
+    CHECK(agent.selector_plan({}).size() == 3);
+    CHECK_THROWS(agent.selector_plan({27}));
+}
+
+TEST_CASE("xorPir") {
+    HypercubeDriver cube(2, 20, CryptoPP::Integer(PLAINTEXT_MODULUS));
+    cube.insert_many({{0, 11}, {7, 900}, {399, 5}});
+    auto snapshot = cube.snapshot();
+    XorEvaluatorDriver evaluator;
+    CryptoPP::AutoSeededRandomPool rng;
+    int width = snapshot->pages[0]->values.width();
+    for (int idx : {0, 7, 150, 399}) {
+        auto shares = xor_share_selection(snapshot->size(), idx, rng);
+        auto coeffs = xor_combine(evaluator.evaluate(*snapshot, shares.first),
+                                  evaluator.evaluate(*snapshot, shares.second), width);
+        CHECK(coeffs.size() == 1);
+        CHECK(coeffs[0] == cube.get_value(idx));
+    }
+
+    HypercubeDriver records(1, 300, CryptoPP::Integer(PLAINTEXT_MODULUS),
+                            RecordLayout::records(40, PLAINTEXT_MODULUS, 256));
+    records.insert_record(299, str2chvec("two servers, no homomorphism"));
+    auto shares = xor_share_selection(300, 299, rng);
+    auto coeffs = xor_combine(evaluator.evaluate(*records.snapshot(), shares.first),
+                              evaluator.evaluate(*records.snapshot(), shares.second),
+                              records.snapshot()->pages[0]->values.width());
+    CHECK(chvec2str(decode_record(coeffs, plain_bits(PLAINTEXT_MODULUS))) == "two servers, no homomorphism");
+}
+
+TEST_CASE("phaseSummary") {
+    std::vector<double> samples;
+    for (int i = 100; i >= 1; i--)
+        samples.push_back(i);
+    PhaseSummary summary = summarize(samples);
+    CHECK(summary.count == 100);
+    CHECK(summary.p50 == 50);
+    CHECK(summary.p95 == 95);
+    CHECK(summary.p99 == 99);
+    CHECK(summary.max == 100);
+    CHECK(summary.mean == 50.5);
+}
+
+TEST_CASE("phaseTimings") {
+    BenchmarkClient client = BenchmarkClient(2,3);
+    client.insert(4, 7);
+    PhaseTimings timings;
+    CHECK(client.get_timed(4, timings) == 7);
+    for (std::string phase : {"keygen", "encrypt", "serialize", "evaluate_dim0",
+                              "evaluate_dim1", "relinearize", "decrypt"})
+        CHECK(timings.count(phase) == 1);
+}
+
+TEST_CASE("packedBatch") {
+    seal::Plaintext packed;
+    packed.resize(6);
+    packed[0] = 3;
+    packed[3] = 5;
+    packed[4] = 6;
+    CHECK(unpack_plaintext(packed, 0, 3).coeff_count() == 1);
+    CHECK(unpack_plaintext(packed, 1, 3)[1] == 6);
+    CHECK(unpack_plaintext(packed, 2, 3).is_zero());
+
+    BenchmarkClient client = BenchmarkClient(2,9);
+    client.insert(4, 7);
+    client.insert(80, 9);
+    PhaseTimings timings;
+    std::vector<int> values = client.get_batch_timed({80, 3, 4, 80}, timings);
+    CHECK(values == std::vector<int>({9, 0, 7, 9}));
+    CHECK(timings.count("pack") == 1);
+    CHECK(client.last_noise_budget() > 0);
+}
+
+TEST_CASE("latencyHistogram") {
+    LatencyHistogram histogram;
+    for (int i = 1; i <= 1000; i++)
+        histogram.record(i);
+    CHECK(histogram.count() == 1000);
+    CHECK(histogram.max() == 1000);
+    // Buckets are a fourth of a doubling wide, so percentiles are within 19%.
+    CHECK(histogram.percentile(50) >= 500);
+    CHECK(histogram.percentile(50) < 500 * 1.19);
+    CHECK(histogram.percentile(99) >= 990);
+    CHECK(histogram.percentile(100) == 1000);
+
+    LatencyHistogram other;
+    other.record(0.5);
+    histogram.merge(other);
+    CHECK(histogram.count() == 1001);
+    CHECK(histogram.percentile(0) <= 1);
+}
+
+TEST_CASE("loadGenerator") {
+    std::mt19937_64 rng(1);
+    KeyDistribution zipf = KeyDistribution::zipf(100, 1.2);
+    std::vector<int> hits(100, 0);
+    for (int i = 0; i < 10000; i++)
+        hits[zipf.sample(rng)]++;
+    CHECK(hits[0] > hits[1]);
+    CHECK(hits[0] > 10 * hits[50]);
+
+    LoadConfig config;
+    config.open_loop = true;
+    config.rate = 200;
+    config.duration = 0.5;
+    config.sessions = 2;
+    config.update_fraction = 0.5;
+    config.keys = KeyDistribution::uniform(10);
+    std::atomic<int> calls{0};
+    LoadGenerator generator(config, [&calls](bool update, int key) {
+        calls++;
+        if (key < 0 || key >= 10)
+            throw std::runtime_error("bad key");
+        return !update;
+    });
+    LoadReport report = generator.run();
+    CHECK(calls == 100);
+    CHECK(report.errors == 0);
+    CHECK(report.queries.count() + report.updates.count() == 100);
+    CHECK(report.rejected == report.updates.count());
 }
 
+TEST_CASE("trafficStats") {
+    TrafficStats stats;
+    stats.record_send("handshake", 100);
+    stats.record_read("handshake", 120);
+    stats.record_send("query", 5000);
+    stats.record_round_trip();
+    CHECK(stats.get("handshake").bytes() == 220);
+    CHECK(stats.get("query").messages_sent == 1);
+    CHECK(stats.get("missing").bytes() == 0);
+    CHECK(stats.total().bytes_sent == 5100);
 
+    TrafficStats other;
+    other.record_read("query", 40);
+    other.record_round_trip();
+    stats.merge(other);
+    CHECK(stats.get("query").bytes() == 5040);
+    CHECK(stats.round_trips() == 2);
+}
+
+TEST_CASE("messageTraffic") {
+    CryptoDriver crypto;
+    SecByteBlock secret(32);
+    std::memset(secret.data(), 7, secret.size());
+    SecByteBlock aes_key = crypto.AES_generate_key(secret);
+    SecByteBlock hmac_key = crypto.HMAC_generate_key(secret);
+    UserToServer_Insert_Message message;
+    message.index = 3;
+    message.value = 9;
+    std::vector<unsigned char> wire = crypto.encrypt_and_tag(aes_key, hmac_key, &message);
+    auto plain = crypto.decrypt_and_verify(aes_key, hmac_key, wire);
+    CHECK(plain.second);
+    TrafficCounter counter = crypto.traffic().get("UserToServer_Insert_Message");
+    CHECK(counter.bytes_sent == plain.first.size());
+    CHECK(counter.bytes_received == plain.first.size());
+    CHECK(crypto.traffic().get("aead").bytes_sent == wire.size() - plain.first.size());
+}
+
+TEST_CASE("metricsDriver") {
+    MetricsDriver metrics;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.emplace_back([&metrics]() {
+            for (int i = 0; i < 100; i++) {
+                metrics.connection_opened();
+                metrics.observe(ServerPhase::EVALUATE, std::chrono::milliseconds(3));
+                metrics.query_served();
+                metrics.connection_closed();
+            }
+        });
+    for (std::thread &thread : threads)
+        thread.join();
+    metrics.connection_opened();
+
+    MetricsSnapshot snapshot = metrics.read();
+    CHECK(snapshot.queries == 400);
+    CHECK(snapshot.active_connections() == 1);
+    const PhaseHistogram &evaluate = snapshot.phases[static_cast<int>(ServerPhase::EVALUATE)];
+    CHECK(evaluate.count() == 400);
+    CHECK(evaluate.percentile(50) == 5);
+    CHECK(snapshot.evaluation_seconds == doctest::Approx(1.2));
+    // Shards of exited threads are still counted, and reused by new threads.
+    CHECK(metrics.read().queries == 400);
+    for (int t = 0; t < 10; t++)
+        std::thread([&metrics]() { metrics.query_served(); }).join();
+    CHECK(metrics.shard_count() <= 5);
+    CHECK(metrics.read().queries == 410);
+
+    std::string text = snapshot.prometheus();
+    CHECK(text.find("pir_queries_total 400") != std::string::npos);
+    CHECK(text.find("pir_phase_latency_seconds_bucket{phase=\"evaluate\",le=\"0.002\"} 0") != std::string::npos);
+    CHECK(text.find("pir_phase_latency_seconds_bucket{phase=\"evaluate\",le=\"+Inf\"} 400") != std::string::npos);
+}
+
+TEST_CASE("noiseBudget") {
+    BenchmarkClient client = BenchmarkClient(2,3);
+    client.insert(5, 9);
+    CHECK(client.get(5) == 9);
+    CHECK(client.last_noise_budget() > 0);
+    CHECK(client.get_xor(5) == 9);
+    CHECK(client.last_noise_budget() == -1);
+}
+
+TEST_CASE("traceDriver") {
+    TraceDriver trace(8);
+    std::uint32_t fold = trace_name("fold_dim0");
+    std::uint32_t send = trace_name("send");
+    CHECK(trace_name("fold_dim0") == fold);
+    std::uint64_t first = trace.next_query();
+    std::uint64_t second = trace.next_query();
+    CHECK(second == first + 1);
+
+    auto now = TraceDriver::clock::now();
+    std::thread([&]() {
+        trace.record(fold, first, now, now + std::chrono::microseconds(500));
+    }).join();
+    // The exited thread's ring is reused rather than a new one allocated.
+    std::thread([&]() {
+        trace.record(send, second, now + std::chrono::milliseconds(1),
+                     now + std::chrono::milliseconds(2));
+    }).join();
+    std::vector<TraceEvent> events = trace.events();
+    REQUIRE(events.size() == 2);
+    CHECK(events[0].name == "fold_dim0");
+    CHECK(events[0].end_ns - events[0].start_ns == 500000);
+    CHECK(events[0].thread == events[1].thread);
+    CHECK(trace.events(second).size() == 1);
+    CHECK(trace.chrome_json(first).find("\"name\": \"fold_dim0\"") != std::string::npos);
+
+    // This thread picks up the same free ring; once it wraps, only the
+    // newest spans survive.
+    for (int i = 0; i < 20; i++)
+        trace.record(send, 100 + i, now, now);
+    CHECK(trace.events().size() == 8);
+    CHECK(trace.events(first).empty());
+    CHECK(trace.events(100).empty());
+    CHECK(trace.events(119).size() == 1);
+}
+
+TEST_CASE("threadPool") {
+    ThreadPoolDriver pool(4);
+    CHECK(pool.size() == 4);
+    std::vector<int> hits(1000, 0);
+    pool.run(hits.size(), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++)
+            hits[i]++;
+    });
+    CHECK(std::count(hits.begin(), hits.end(), 1) == 1000);
+
+    std::atomic<int> ranges(0);
+    pool.run(2, [&](std::size_t begin, std::size_t end) { ranges++; });
+    CHECK(ranges == 2);
+    CHECK_THROWS(pool.run(100, [](std::size_t begin, std::size_t) {
+        if (begin == 0)
+            throw std::runtime_error("range failed");
+    }));
+    pool.run(0, [](std::size_t, std::size_t) {});
+}
+
+TEST_CASE("workspacePool") {
+    auto pool = std::make_shared<WorkspacePool>();
+    std::shared_ptr<EvaluationWorkspace> first = pool->acquire();
+    std::shared_ptr<EvaluationWorkspace> second = pool->acquire();
+    CHECK(first != second);
+    EvaluationWorkspace *recycled = first.get();
+    first.reset();
+    CHECK(pool->acquire().get() == recycled);
+    pool.reset();
+    second.reset();
+
+    // Later queries overwrite the buffers left by earlier ones.
+    BenchmarkClient client = BenchmarkClient(2,9);
+    client.insert(0, 4);
+    client.insert(80, 5);
+    CHECK(client.get(80) == 5);
+    CHECK(client.get(0) == 4);
+    CHECK(client.get(40) == 0);
+    CHECK(client.get_batch({0, 80}) == std::vector<int>({4, 5}));
+}
+
+TEST_CASE("bgvBackend") {
+    CHECK(scheme_from_name(scheme_name(seal::scheme_type::bgv)) ==
+          seal::scheme_type::bgv);
+    CHECK(scheme_from_name("bfv") == seal::scheme_type::bfv);
+    CHECK_THROWS(scheme_from_name("ckks"));
+
+    std::vector<unsigned char> data;
+    UserToServer_Query_Message message;
+    message.scheme = seal::scheme_type::bgv;
+    message.serialize(data);
+    CHECK(get_query_scheme(data) == seal::scheme_type::bgv);
+
+    BenchmarkClient client = BenchmarkClient(
+        std::vector<int>({3, 9, 3}), ParameterProfile::standard(),
+        seal::scheme_type::bgv);
+    client.insert(4, 7);
+    client.insert(80, 9);
+    CHECK(client.get(80) == 9);
+    CHECK(client.get(5) == 0);
+    CHECK(client.last_noise_budget() > 0);
+    CHECK(client.get_batch({80, 3, 4}) == std::vector<int>({9, 0, 7}));
+}
+
+TEST_CASE("resultCache") {
+    ResultCacheDriver cache(2, std::chrono::milliseconds(60000));
+    std::vector<seal::Plaintext> result;
+    CloudEpoch epoch{9, 5};
+    CHECK(!cache.contains(1));
+    CHECK(!cache.lookup(1, 0, epoch, result));
+    cache.store(1, 0, epoch, {seal::Plaintext("7")});
+    cache.store(2, 1, {9, 3}, {seal::Plaintext("8")});
+    CHECK(cache.contains(1));
+    CHECK(cache.lookup(1, 0, epoch, result));
+    CHECK(result[0][0] == 7);
+    // Results are served only at the epoch they were computed at.
+    CHECK(!cache.lookup(1, 0, {9, 6}, result));
+    CHECK(!cache.contains(1));
+    CHECK(cache.lookup(2, 1, {9, 3}, result));
+    // A restarted cloud counts versions again under a new instance id.
+    cache.store(1, 0, epoch, {seal::Plaintext("7")});
+    CHECK(!cache.lookup(1, 0, {10, 5}, result));
+    // The least recently used result is evicted.
+    cache.store(3, 0, {9, 6}, {seal::Plaintext("9")});
+    cache.store(4, 0, {9, 6}, {seal::Plaintext("A")});
+    CHECK(cache.size() == 2);
+    CHECK(!cache.lookup(2, 1, {9, 3}, result));
+    cache.invalidate(4);
+    CHECK(!cache.lookup(4, 0, {9, 6}, result));
+    CHECK(cache.hits() == 2);
+
+    ResultCacheDriver expiring(4, std::chrono::milliseconds(0));
+    expiring.store(1, 0, {9, 0}, {seal::Plaintext("7")});
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    CHECK(!expiring.lookup(1, 0, {9, 0}, result));
+
+    UserToServer_Epoch_Message probe;
+    probe.database = "wide";
+    std::vector<unsigned char> probe_data;
+    probe.serialize(probe_data);
+    UserToServer_Epoch_Message probe_received;
+    probe_received.deserialize(probe_data);
+    CHECK(probe_received.database == "wide");
+    ServerToUser_Epoch_Message reply;
+    reply.epoch = {9, 6};
+    std::vector<unsigned char> reply_data;
+    reply.serialize(reply_data);
+    ServerToUser_Epoch_Message reply_received;
+    reply_received.deserialize(reply_data);
+    CHECK(reply_received.epoch == CloudEpoch({9, 6}));
+
+    std::vector<unsigned char> data;
+    ServerToUser_Response_Message message;
+    message.version = 42;
+    message.instance = 9;
+    message.serialize(data);
+    ServerToUser_Response_Message received;
+    received.deserialize(data, seal::SEALContext(make_parameters(
+        seal::scheme_type::bfv, POLY_MODULUS_DEGREE, PLAINTEXT_MODULUS)));
+    CHECK(received.version == 42);
+    CHECK(received.instance == 9);
+}
+
+TEST_CASE("persistentSnapshot") {
+    std::remove("persistence_test.snap");
+    std::remove("persistence_test.snap.log");
+    std::vector<int> sides = {30, 20};
+    auto cube = std::make_shared<HypercubeDriver>(
+        sides, CryptoPP::Integer(PLAINTEXT_MODULUS),
+        RecordLayout::scalar(PLAINTEXT_MODULUS));
+    std::uint64_t version;
+    {
+        PersistenceDriver persistence(cube, "persistence_test.snap");
+        CHECK(persistence.restore() == 0);
+        cube->insert(3, (std::uint64_t)7);
+        cube->insert(590, (std::uint64_t)9);
+        CHECK(persistence.save() == 2);
+        CHECK(persistence.log_bytes() == 0);
+        // Logged after the snapshot, replayed on restore.
+        cube->insert_many({{3, 11}, {300, 5}});
+        cube->insert(590, (std::uint64_t)0);
+        CHECK(persistence.log_bytes() > 0);
+        version = cube->version();
+    }
+
+    auto restored = std::make_shared<HypercubeDriver>(
+        sides, CryptoPP::Integer(PLAINTEXT_MODULUS),
+        RecordLayout::scalar(PLAINTEXT_MODULUS));
+    PersistenceDriver persistence(restored, "persistence_test.snap");
+    CHECK(persistence.restore() == version);
+    CHECK(restored->version() == version);
+    CHECK(restored->get_value(3) == 11);
+    CHECK(restored->get_value(300) == 5);
+    CHECK(restored->get_value(590) == 0);
+    CHECK(restored->snapshot()->populated == 2);
+    CHECK(restored->snapshot()->plaintext(300)[0] == 5);
+
+    // Replacing the whole database snapshots it at once.
+    auto values = std::make_shared<PackedValueStore>(600, PLAINTEXT_MODULUS, 1);
+    restored->replace(values);
+    CHECK(persistence.log_bytes() == 0);
+    restored->insert(0, (std::uint64_t)2);
+    CHECK(persistence.log_bytes() > 0);
+    std::remove("persistence_test.snap");
+    std::remove("persistence_test.snap.log");
+}
+
+TEST_CASE("persistentLogTail") {
+    std::remove("persistence_tail.snap");
+    std::remove("persistence_tail.snap.log");
+    std::vector<int> sides = {30, 20};
+    auto make_cube = [&sides]() {
+        return std::make_shared<HypercubeDriver>(
+            sides, CryptoPP::Integer(PLAINTEXT_MODULUS),
+            RecordLayout::scalar(PLAINTEXT_MODULUS));
+    };
+    std::size_t complete;
+    {
+        auto cube = make_cube();
+        PersistenceDriver persistence(cube, "persistence_tail.snap");
+        persistence.restore();
+        cube->insert(3, (std::uint64_t)7);
+        complete = persistence.log_bytes();
+        cube->insert(4, (std::uint64_t)8);
+    }
+    // A crash in the middle of the second record.
+    std::filesystem::resize_file("persistence_tail.snap.log", complete + 12);
+
+    {
+        auto cube = make_cube();
+        PersistenceDriver persistence(cube, "persistence_tail.snap");
+        CHECK(persistence.restore() == 1);
+        CHECK(cube->get_value(3) == 7);
+        CHECK(cube->get_value(4) == 0);
+        CHECK(persistence.log_bytes() == complete);
+        cube->insert(5, (std::uint64_t)9);
+        cube->insert(6, (std::uint64_t)10);
+    }
+
+    // Records logged after the cut are replayed, not hidden behind it.
+    auto cube = make_cube();
+    PersistenceDriver persistence(cube, "persistence_tail.snap");
+    CHECK(persistence.restore() == 3);
+    CHECK(cube->get_value(3) == 7);
+    CHECK(cube->get_value(5) == 9);
+    CHECK(cube->get_value(6) == 10);
+    std::remove("persistence_tail.snap");
+    std::remove("persistence_tail.snap.log");
+}
+
+TEST_CASE("persistentKeywords") {
+    std::remove("persistence_keys.snap");
+    std::remove("persistence_keys.snap.log");
+    std::remove("persistence_keys.snap.keys");
+    auto make_cube = []() {
+        return std::make_shared<HypercubeDriver>(
+            2, 8, CryptoPP::Integer(PLAINTEXT_MODULUS),
+            RecordLayout::records(24, PLAINTEXT_MODULUS, 256));
+    };
+    {
+        auto cube = make_cube();
+        PersistenceDriver persistence(cube, "persistence_keys.snap");
+        persistence.restore();
+        KeywordDriver keywords(cube);
+        CHECK(keywords.restore("persistence_keys.snap.keys") == 0);
+        for (int i = 0; i < 32; i++)
+            keywords.insert(keyword_from_id(i),
+                            str2chvec("value" + std::to_string(i)));
+    }
+
+    auto cube = make_cube();
+    PersistenceDriver persistence(cube, "persistence_keys.snap");
+    persistence.restore();
+    KeywordDriver keywords(cube);
+    CHECK(keywords.restore("persistence_keys.snap.keys") == 32);
+    for (int i = 0; i < 32; i++)
+        CHECK(chvec2str(keywords.get(keyword_from_id(i)).first) ==
+              "value" + std::to_string(i));
+    // Known keys are overwritten in place, not placed a second time.
+    keywords.insert(keyword_from_id(5), str2chvec("again"));
+    CHECK(keywords.size() == 32);
+    CHECK(cube->snapshot()->populated == 32);
+    CHECK(chvec2str(keywords.get(keyword_from_id(5)).first) == "again");
+    std::remove("persistence_keys.snap");
+    std::remove("persistence_keys.snap.log");
+    std::remove("persistence_keys.snap.keys");
+}
+
+TEST_CASE("namedDatabases") {
+    CloudClient cloud = CloudClient(2, 3);
+    cloud.AddDatabase("wide", {4, 5, 2}, 16);
+    CHECK_THROWS(cloud.AddDatabase("wide", {2}));
+    CHECK_THROWS(cloud.database("missing"));
+    CHECK(cloud.database("")->name == DEFAULT_DATABASE);
+    std::shared_ptr<CloudDatabase> wide = cloud.database("wide");
+    CHECK(wide->hypercube_driver->geometry().size() == 40);
+    CHECK(!wide->keyword_driver);
+    CHECK(!wide->loader_driver);
+    // Each database has its own contents and versions.
+    wide->hypercube_driver->insert_record(7, {1, 2, 3});
+    CHECK(wide->hypercube_driver->version() == 1);
+    CHECK(cloud.database(DEFAULT_DATABASE)->hypercube_driver->version() == 0);
+    CHECK(cloud.ReadMetrics().gauges["pir_databases"] == 2);
+    CHECK(cloud.ReadMetrics().gauges["pir_database_entries"] == 49);
+
+    std::vector<unsigned char> data;
+    UserToServer_Insert_Message insert;
+    insert.database = "wide";
+    insert.index = 7;
+    insert.value = 3;
+    insert.serialize(data);
+    UserToServer_Insert_Message received;
+    received.deserialize(data);
+    CHECK(received.database == "wide");
+    CHECK(received.index == 7);
+
+    ResultCacheDriver cache(4, std::chrono::milliseconds(60000));
+    std::vector<seal::Plaintext> result;
+    cache.store(1, 0, {9, 5}, {seal::Plaintext("7")});
+    cache.clear();
+    CHECK(cache.size() == 0);
+    CHECK(!cache.lookup(1, 0, {9, 5}, result));
+}
+
+/**
+ * Network driver for one cloud connection driven by the test: each read
+ * asks the test for the agent's next message, and every reply is kept.
+ */
+class ScriptedNetworkDriver : public NetworkDriver {
+public:
+    std::function<std::vector<unsigned char>()> next;
+    std::vector<std::vector<unsigned char>> sent;
+
+    void listen(int port) {}
+    void connect(std::string address, int port) {}
+    void disconnect() {}
+    void send(std::vector<unsigned char> data) { this->sent.push_back(data); }
+    std::vector<unsigned char> read() { return this->next(); }
+    std::string get_remote_info() { return "scripted"; }
+    void set_phase(std::string phase) {}
+    TrafficStats &traffic() { return this->stats; }
+
+private:
+    TrafficStats stats;
+};
+
+/**
+ * Send a bulk update to the cloud over a scripted connection, optionally
+ * with its MAC corrupted. Returns the scripted connection.
+ */
+std::shared_ptr<ScriptedNetworkDriver>
+send_scripted_update(CloudClient &cloud, UserToServer_Update_Message update,
+                     bool tamper) {
+    auto network = std::make_shared<ScriptedNetworkDriver>();
+    CryptoDriver crypto;
+    auto dh = crypto.DH_initialize();
+    network->next = [&]() {
+        std::vector<unsigned char> data;
+        if (network->sent.empty()) {
+            DHPublicValue_Message public_value;
+            public_value.public_value = std::get<2>(dh);
+            public_value.serialize(data);
+            return data;
+        }
+        DHPublicValue_Message server_value;
+        server_value.deserialize(network->sent[0]);
+        auto shared = crypto.DH_generate_shared_key(
+            std::get<0>(dh), std::get<1>(dh), server_value.public_value);
+        data = crypto.encrypt_and_tag(crypto.AES_generate_key(shared),
+                                      crypto.HMAC_generate_key(shared),
+                                      &update);
+        // The MAC is the last field of the wrapper.
+        if (tamper)
+            data.back() ^= 1;
+        return data;
+    };
+    cloud.HandleSend(network, std::make_shared<CryptoDriver>());
+    return network;
+}
+
+TEST_CASE("bulkUpdateMac") {
+    CloudClient cloud = CloudClient(2, 3);
+    cloud.SetUpdateToken("secret");
+    UserToServer_Update_Message update;
+    update.token = "secret";
+    update.base_version = UPDATE_ANY_VERSION;
+    UpdateMutation upsert;
+    upsert.op = UpdateOp::UPSERT;
+    upsert.index = 1;
+    upsert.values = {5};
+    update.mutations = {upsert};
+
+    // A tampered update is dropped before it is read.
+    auto refused = send_scripted_update(cloud, update, true);
+    CHECK(refused->sent.size() == 1);
+    CHECK(cloud.database("")->hypercube_driver->version() == 0);
+    CHECK(cloud.ReadMetrics().errors == 1);
+
+    auto accepted = send_scripted_update(cloud, update, false);
+    CHECK(accepted->sent.size() == 2);
+    CHECK(cloud.database("")->hypercube_driver->version() == 1);
+    CHECK(cloud.database("")->hypercube_driver->get_value(1) == 5);
+
+    // Keyword databases are only written by keyword.
+    cloud.AddDatabase("keyed", {4, 4}, 16, true);
+    update.database = "keyed";
+    update.mutations[0].values.clear();
+    update.mutations[0].records = {{1, 2, 3}};
+    auto keyed = send_scripted_update(cloud, update, false);
+    CHECK(keyed->sent.size() == 2);
+    CHECK(cloud.database("keyed")->hypercube_driver->version() == 0);
+}
+
+TEST_CASE("keywordDatabases") {
+    CloudClient cloud = CloudClient(2, 3);
+    cloud.AddDatabase("plain", {4, 4}, 16);
+    cloud.AddDatabase("keyed", {4, 4}, 16, true);
+    CHECK_THROWS(cloud.AddDatabase("tiny", {4, 4}, KEYWORD_TAG_SIZE, true));
+    CHECK(!cloud.database("plain")->keyword_driver);
+    std::shared_ptr<CloudDatabase> keyed = cloud.database("keyed");
+    CHECK(keyed->keyword_driver);
+
+    // Records placed by keyword cannot be overwritten by index.
+    cloud.HandleUse("use keyed");
+    cloud.HandleKeywordInsert("kwinsert alice hello");
+    CHECK(keyed->keyword_driver->size() == 1);
+    CHECK_THROWS(cloud.HandleInsertRecord("record 3 hello"));
+    CHECK_THROWS(cloud.HandleInsert("insert 3 7"));
+    CHECK(keyed->hypercube_driver->snapshot()->populated == 1);
+    CHECK(chvec2str(keyed->keyword_driver->get(keyword_from_string("alice"))
+                        .first) == "hello");
+
+    // Records written by index cannot be evicted by keyword placement.
+    cloud.HandleUse("use plain");
+    std::shared_ptr<CloudDatabase> plain = cloud.database("plain");
+    cloud.HandleInsertRecord("record 3 hello");
+    plain->update_driver->flush();
+    cloud.HandleKeywordInsert("kwinsert alice other");
+    CHECK(plain->hypercube_driver->snapshot()->populated == 1);
+    CHECK(chvec2str(plain->hypercube_driver->get_record(3)) == "hello");
+}
+
+TEST_CASE("bulkUpdate") {
+    UserToServer_Update_Message update;
+    update.database = "wide";
+    update.token = "secret";
+    update.base_version = 4;
+    UpdateMutation upsert;
+    upsert.op = UpdateOp::UPSERT;
+    upsert.index = 2;
+    upsert.values = {9};
+    UpdateMutation remove;
+    remove.op = UpdateOp::DELETE;
+    remove.index = 5;
+    remove.count = 3;
+    UpdateMutation record;
+    record.op = UpdateOp::REPLACE;
+    record.index = 8;
+    record.records = {{1, 2}, {3}};
+    update.mutations = {upsert, remove, record};
+    std::vector<unsigned char> data;
+    update.serialize(data);
+    UserToServer_Update_Message received;
+    received.deserialize(data);
+    CHECK(received.database == "wide");
+    CHECK(received.token == "secret");
+    CHECK(received.base_version == 4);
+    CHECK(received.mutations.size() == 3);
+    CHECK(received.mutations[0].values == std::vector<std::uint64_t>({9}));
+    CHECK(received.mutations[1].op == UpdateOp::DELETE);
+    CHECK(received.mutations[1].count == 3);
+    CHECK(received.mutations[2].records[1] == std::vector<unsigned char>({3}));
+    // Lengths from the network are checked before they are read.
+    data.resize(data.size() - 1);
+    CHECK_THROWS(received.deserialize(data));
+
+    // A batch is published as one version, and only at its base version.
+    HypercubeDriver cube(2, 4, CryptoPP::Integer(PLAINTEXT_MODULUS));
+    CHECK(cube.apply({{1, {5}}, {2, {6}}}) == 1);
+    CHECK_THROWS(cube.apply({{3, {7}}}, 0));
+    CHECK(cube.apply({{3, {7}}, {1, {}}}, 1) == 2);
+    CHECK(cube.get_value(1) == 0);
+    CHECK(cube.get_value(3) == 7);
+    // Nothing is published if any update is out of bounds.
+    CHECK_THROWS(cube.apply({{0, {1}}, {16, {1}}}));
+    CHECK(cube.version() == 2);
+    CHECK(cube.get_value(0) == 0);
+    // Nor if the journal cannot record it.
+    cube.set_journal([](std::uint64_t, const EntryUpdates *) {
+        throw std::runtime_error("disk full");
+    });
+    CHECK_THROWS(cube.apply({{0, {1}}}));
+    CHECK(cube.version() == 2);
+    CHECK(cube.get_value(0) == 0);
+    cube.set_journal(nullptr);
+    CHECK(cube.value_coeffs(PLAINTEXT_MODULUS + 3) == std::vector<std::uint64_t>({3}));
+
+    // Shards count versions separately, so one base cannot cover two.
+    AgentClient agent({{"localhost", 8080}, {"localhost", 8081}}, 2, 3);
+    UpdateMutation spanning;
+    spanning.op = UpdateOp::DELETE;
+    spanning.index = 8;
+    spanning.count = 2;
+    CHECK_THROWS(agent.DoUpdate(std::make_shared<NetworkDriverImpl>(),
+                                std::make_shared<CryptoDriver>(), "secret",
+                                {spanning}, 4));
+}